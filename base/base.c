@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <math.h>
+#include <inttypes.h>
 
 static opi_t
 loadfile(void)
@@ -14,7 +15,7 @@ loadfile(void)
 
   opi_t path = opi_pop();
   opi_t srcd = opi_nargs > 1 ? opi_pop() : opi_nil;
-  if (opi_unlikely(path->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(path) != opi_str_type)) {
     opi_drop(path);
     opi_drop(srcd);
     return opi_undefined(opi_symbol("type-error"));
@@ -38,9 +39,9 @@ loadfile(void)
   OpiBuilder bldr;
   opi_builder_init(&bldr, ctx);
   opi_builtins(&bldr);
-  for (opi_t it = srcd; it->type == opi_pair_type; it = opi_cdr(it)) {
+  for (opi_t it = srcd; opi_typeof(it) == opi_pair_type; it = opi_cdr(it)) {
     opi_t d = opi_car(it);
-    if (d->type != opi_str_type) {
+    if (opi_typeof(d) != opi_str_type) {
       opi_drop(srcd);
       opi_ast_delete(ast);
       opi_builder_destroy(&bldr);
@@ -73,7 +74,7 @@ static opi_t
 List_length(void)
 {
   opi_t x = opi_pop();
-  opi_t ret = opi_num_new(opi_length(x));
+  opi_t ret = opi_int_new(opi_length(x));
   opi_drop(x);
   return ret;
 }
@@ -82,11 +83,11 @@ static opi_t
 strlen_(void)
 {
   opi_t str = opi_pop();
-  if (opi_unlikely(str->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(str) != opi_str_type)) {
     opi_drop(str);
     return opi_undefined(opi_symbol("type-error"));
   }
-  opi_t ret = opi_num_new(OPI_STR(str)->len);
+  opi_t ret = opi_int_new(OPI_STR(str)->len);
   opi_drop(str);
   return ret;
 }
@@ -104,7 +105,7 @@ substr(void)
   opi_t start = opi_pop();
   opi_t end = opi_nargs == 3 ? opi_pop() : NULL;
 
-  if (opi_unlikely(str->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(str) != opi_str_type)) {
     opi_drop(str);
     opi_drop(start);
     if (end)
@@ -112,7 +113,7 @@ substr(void)
     return opi_undefined(opi_symbol("type-error"));
   }
 
-  if (opi_unlikely(start->type != opi_num_type)) {
+  if (opi_unlikely(!opi_is_int(start))) {
     opi_drop(str);
     opi_drop(start);
     if (end)
@@ -120,7 +121,7 @@ substr(void)
     return opi_undefined(opi_symbol("type-error"));
   }
 
-  if (end && opi_unlikely(end->type != opi_num_type)) {
+  if (end && opi_unlikely(!opi_is_int(end))) {
     opi_drop(str);
     opi_drop(start);
     opi_drop(end);
@@ -129,8 +130,8 @@ substr(void)
 
   const char *s = OPI_STR(str)->str;
   ssize_t len = OPI_STR(str)->len;
-  ssize_t from = opi_num_get_value(start);
-  ssize_t to = end ? opi_num_get_value(end) : len;
+  ssize_t from = opi_int_get_value(start);
+  ssize_t to = end ? opi_int_get_value(end) : len;
 
   if (from < 0)
     from = len + from;
@@ -157,7 +158,7 @@ static opi_t
 chop(void)
 {
   opi_t str = opi_pop();
-  if (opi_unlikely(str->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(str) != opi_str_type)) {
     opi_drop(str);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -180,7 +181,7 @@ static opi_t
 rtrim(void)
 {
   opi_t str = opi_pop();
-  if (opi_unlikely(str->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(str) != opi_str_type)) {
     opi_drop(str);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -208,7 +209,7 @@ static opi_t
 ltrim(void)
 {
   opi_t str = opi_pop();
-  if (opi_unlikely(str->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(str) != opi_str_type)) {
     opi_drop(str);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -233,8 +234,8 @@ strstr_(void)
 {
   opi_t str = opi_pop();
   opi_t chr = opi_pop();
-  if (opi_unlikely(str->type != opi_str_type
-                || chr->type != opi_str_type))
+  if (opi_unlikely(opi_typeof(str) != opi_str_type
+                || opi_typeof(chr) != opi_str_type))
   {
     opi_drop(str);
     opi_drop(chr);
@@ -248,7 +249,7 @@ strstr_(void)
     opi_drop(str);
     return opi_false;
   } else {
-    opi_t ret = opi_num_new(at - OPI_STR(str)->str);
+    opi_t ret = opi_int_new(at - OPI_STR(str)->str);
     opi_drop(str);
     return ret;
   }
@@ -260,11 +261,11 @@ revappend(void)
   opi_t l = opi_pop();
   opi_t acc = opi_pop();
 
-  while (l->rc == 0 && l->type == opi_pair_type) {
+  while (opi_typeof(l) == opi_pair_type && l->rc == 0) {
     opi_t x = opi_car(l);
     opi_t tmp = opi_cdr(l);
 
-    _opi_cons_at(x, acc, (OpiPair*)l);
+    _opi_pair_set(x, acc, (OpiPair*)l);
     acc = l;
 
     opi_dec_rc(tmp);
@@ -272,7 +273,7 @@ revappend(void)
     l = tmp;
   }
 
-  for (opi_t it = l; it->type == opi_pair_type; it = opi_cdr(it))
+  for (opi_t it = l; opi_typeof(it) == opi_pair_type; it = opi_cdr(it))
     acc = opi_cons(opi_car(it), acc);
   opi_drop(l);
 
@@ -285,8 +286,8 @@ open_(void)
   opi_t path = opi_pop();
   opi_t mode = opi_pop();
 
-  if (opi_unlikely(path->type != opi_str_type
-                || mode->type != opi_str_type))
+  if (opi_unlikely(opi_typeof(path) != opi_str_type
+                || opi_typeof(mode) != opi_str_type))
   {
     opi_drop(path);
     opi_drop(mode);
@@ -309,8 +310,8 @@ popen_(void)
   opi_t cmd = opi_pop();
   opi_t mode = opi_pop();
 
-  if (opi_unlikely(cmd->type != opi_str_type
-                || mode->type != opi_str_type))
+  if (opi_unlikely(opi_typeof(cmd) != opi_str_type
+                || opi_typeof(mode) != opi_str_type))
   {
     opi_drop(cmd);
     opi_drop(mode);
@@ -332,9 +333,9 @@ concat(void)
 {
   opi_t l = opi_pop();
   size_t len = 0;
-  for (opi_t it = l; it->type == opi_pair_type; it = opi_cdr(it)) {
+  for (opi_t it = l; opi_typeof(it) == opi_pair_type; it = opi_cdr(it)) {
     opi_t s = opi_car(it);
-    if (opi_unlikely(s->type != opi_str_type)) {
+    if (opi_unlikely(opi_typeof(s) != opi_str_type)) {
       opi_drop(l);
       return opi_undefined(opi_symbol("type-error"));
     }
@@ -343,7 +344,7 @@ concat(void)
 
   char *str = malloc(len + 1);
   char *p = str;
-  for (opi_t it = l; it->type == opi_pair_type; it = opi_cdr(it)) {
+  for (opi_t it = l; opi_typeof(it) == opi_pair_type; it = opi_cdr(it)) {
     opi_t s = opi_car(it);
     size_t slen = OPI_STR(s)->len;
     memcpy(p, OPI_STR(s)->str, slen);
@@ -359,7 +360,7 @@ static opi_t
 readline(void)
 {
   opi_t file = opi_pop();
-  if (opi_unlikely(file->type != opi_file_type)) {
+  if (opi_unlikely(opi_typeof(file) != opi_file_type)) {
     opi_drop(file);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -392,8 +393,8 @@ read_(void)
   FILE *fs = opi_file_get_value(file);
 
   if (opi_nargs == 2) {
-    OPI_ARG(size, opi_num_type)
-    size_t n = OPI_NUM(size)->val;
+    OPI_ARG(size, opi_int_type)
+    size_t n = opi_int_get_value(size);
     char *buf = malloc(n + 1);
     size_t nrd = fread(buf, 1, n, fs);
     if (nrd == 0) {
@@ -464,10 +465,14 @@ typedef struct {
 static
 opi_type_t fpos_type;
 
+static void
+fpos_delete(opi_type_t ty, opi_t x)
+{ opi_free(x, sizeof(FPos)); }
+
 static opi_t
 fpos_new(const fpos_t *pos)
 {
-  FPos *fpos = malloc(sizeof(FPos));
+  FPos *fpos = opi_alloc(sizeof(FPos));
   fpos->pos = *pos;
   opi_init_cell(fpos, fpos_type);
   return OPI(fpos);
@@ -575,7 +580,7 @@ split(void)
   /*opi_t l = opi_pop();*/
 
   /*// Optimized for list with zero reference count*/
-  /*while ((l->type == opi_pair_type) & (l->rc == 0)) {*/
+  /*while ((opi_typeof(l) == opi_pair_type) & (l->rc == 0)) {*/
     /*opi_t x = opi_car(l);*/
     /*opi_t tmp = opi_cdr(l);*/
 
@@ -588,21 +593,21 @@ split(void)
     /*opi_push(x);*/
     /*opi_push(acc);*/
     /*acc = opi_apply(f, 2);*/
-    /*if (opi_unlikely(acc->type == opi_undefined_type)) {*/
+    /*if (opi_unlikely(opi_typeof(acc) == opi_undefined_type)) {*/
       /*opi_unref(f);*/
       /*return acc;*/
     /*}*/
   /*}*/
 
   /*// Handle non-zero reference count*/
-  /*while (l->type == opi_pair_type) {*/
+  /*while (opi_typeof(l) == opi_pair_type) {*/
     /*opi_t x = opi_car(l);*/
     /*l = opi_cdr(l);*/
 
     /*opi_push(x);*/
     /*opi_push(acc);*/
     /*acc = opi_apply(f, 2);*/
-    /*if (opi_unlikely(acc->type == opi_undefined_type)) {*/
+    /*if (opi_unlikely(opi_typeof(acc) == opi_undefined_type)) {*/
       /*opi_unref(f);*/
       /*return acc;*/
     /*}*/
@@ -629,22 +634,22 @@ static opi_t
 Array_empty(void)
 {
   OPI_BEGIN_FN()
-  OPI_ARG(reserve, opi_num_type)
-  OPI_RETURN(opi_array_new_empty(OPI_NUM(reserve)->val));
+  OPI_ARG(reserve, opi_int_type)
+  OPI_RETURN(opi_array_new_empty(opi_int_get_value(reserve)));
 }
 
 static opi_t
 Array_init(void)
 {
   OPI_BEGIN_FN()
-  OPI_ARG(size, opi_num_type);
+  OPI_ARG(size, opi_int_type);
   OPI_ARG(f, opi_fn_type);
-  size_t n = OPI_NUM(size)->val;
+  size_t n = opi_int_get_value(size);
   opi_t arr = opi_array_new_empty(n);
   for (size_t i = 0; i < n; ++i ) {
-    opi_push(opi_num_new(i));
+    opi_push(opi_int_new(i));
     opi_t val = opi_apply(f, 1);
-    if (opi_unlikely(val->type == opi_undefined_type)) {
+    if (opi_unlikely(opi_typeof(val) == opi_undefined_type)) {
       opi_drop(arr);
       OPI_RETURN(val);
     }
@@ -657,11 +662,11 @@ static opi_t
 Array_length(void)
 {
   opi_t arr = opi_pop();
-  if (opi_unlikely(arr->type != opi_array_type)) {
+  if (opi_unlikely(opi_typeof(arr) != opi_array_type)) {
     opi_drop(arr);
     return opi_undefined(opi_symbol("type-error"));
   }
-  opi_t ret = opi_num_new(opi_array_get_length(arr));
+  opi_t ret = opi_int_new(opi_array_get_length(arr));
   opi_drop(arr);
   return ret;
 }
@@ -674,13 +679,13 @@ Array_get(void)
   opi_t arr = opi_pop();
   opi_inc_rc(arr);
 
-  if (opi_unlikely(arr->type != opi_array_type || nth->type != opi_num_type)) {
+  if (opi_unlikely(opi_typeof(arr) != opi_array_type || !opi_is_int(nth))) {
     opi_unref(arr);
     opi_unref(nth);
     return opi_undefined(opi_symbol("type-error"));
   }
 
-  size_t i = OPI_NUM(nth)->val;
+  size_t i = opi_int_get_value(nth);
   if (opi_unlikely(i >= opi_array_get_length(arr))) {
     opi_unref(arr);
     opi_unref(nth);
@@ -704,7 +709,7 @@ Array_push(void)
   opi_t x = opi_pop();
   opi_inc_rc(x);
 
-  if (opi_unlikely(arr->type != opi_array_type)) {
+  if (opi_unlikely(opi_typeof(arr) != opi_array_type)) {
     opi_unref(arr);
     opi_unref(x);
     return opi_undefined(opi_symbol("type-error"));
@@ -724,7 +729,7 @@ static opi_t
 Array_toList(void)
 {
   opi_t arr = opi_pop();
-  if (opi_unlikely(arr->type != opi_array_type)) {
+  if (opi_unlikely(opi_typeof(arr) != opi_array_type)) {
     opi_drop(arr);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -740,7 +745,7 @@ static opi_t
 Array_toRevList(void)
 {
   opi_t arr = opi_pop();
-  if (opi_unlikely(arr->type != opi_array_type)) {
+  if (opi_unlikely(opi_typeof(arr) != opi_array_type)) {
     opi_drop(arr);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -761,6 +766,7 @@ Array_ofSeq(void)
 
   opi_t x;
   opi_t s = opi_seq_copy(seq);
+  uint32_t start = OPI_SEQ(s)->cnt;
 
   opi_t err;
   if ((err = opi_seq_force(s, TRUE))) {
@@ -768,7 +774,16 @@ Array_ofSeq(void)
     opi_return(err);
   }
 
-  opi_t arr = OPI_SEQ(s)->cache->arr;
+  // the cache may have already slid past its first elements
+  OpiSeqCache *cache = OPI_SEQ(s)->cache;
+  opi_t arr = cache->arr;
+  if (start != cache->base) {
+    OpiArray *src = OPI_ARRAY(arr);
+    size_t i = start - cache->base;
+    arr = opi_array_new_empty(src->len - i);
+    for (; i < src->len; ++i)
+      opi_array_push(arr, src->data[i]);
+  }
   opi_drop(s);
 
   opi_return(arr);
@@ -791,7 +806,7 @@ Array_toSeq(void)
 
   OpiIter* array_iter_copy(OpiIter *self) {
     ArrayIter *iter = (void*)self;
-    ArrayIter *newiter = malloc(sizeof(ArrayIter));
+    ArrayIter *newiter = opi_alloc(sizeof(ArrayIter));
     opi_inc_rc(newiter->arr = iter->arr);
     newiter->i = iter->i;
     return (OpiIter*)newiter;
@@ -800,13 +815,13 @@ Array_toSeq(void)
   void array_iter_delete(OpiIter *self) {
     ArrayIter *iter = (void*)self;
     opi_unref(iter->arr);
-    free(iter);
+    opi_free(iter, sizeof(ArrayIter));
   }
 
   OPI_BEGIN_FN()
   OPI_ARG(arr, opi_array_type)
 
-  ArrayIter *iter = malloc(sizeof(ArrayIter));
+  ArrayIter *iter = opi_alloc(sizeof(ArrayIter));
   iter->arr = arr;
   iter->i = 0;
   OpiSeqCache *cache = opi_seq_cache_new(arr, OPI_ARRAY(arr)->len);
@@ -821,11 +836,11 @@ static opi_t
 Array_legnth(void)
 {
   opi_t x = opi_pop();
-  if (opi_unlikely(x->type != opi_array_type)) {
+  if (opi_unlikely(opi_typeof(x) != opi_array_type)) {
     opi_drop(x);
     return opi_undefined(opi_symbol("type-error"));
   }
-  opi_t ret = opi_num_new(OPI_ARRAY(x)->len);
+  opi_t ret = opi_int_new(OPI_ARRAY(x)->len);
   opi_drop(x);
   return ret;
 }
@@ -842,7 +857,7 @@ Seq_iter(void)
   opi_unref(seq);
   while ((x = opi_seq_next(s))) {
 
-    if (opi_unlikely(x->type == opi_undefined_type)) {
+    if (opi_unlikely(opi_typeof(x) == opi_undefined_type)) {
       opi_drop(s);
       opi_unref(f);
       return x;
@@ -850,7 +865,7 @@ Seq_iter(void)
 
     opi_push(x);
     opi_t ret = opi_apply(f, 1);
-    if (opi_unlikely(ret->type == opi_undefined_type)) {
+    if (opi_unlikely(opi_typeof(ret) == opi_undefined_type)) {
       opi_drop(s);
       opi_unref(f);
       return ret;
@@ -872,28 +887,34 @@ Seq_foldl(void)
   OPI_ARG(z, NULL)
   OPI_ARG(seq, opi_seq_type)
 
-  opi_t x;
+  opi_t buf[OPI_SEQ_BATCH];
+  size_t n;
   opi_t s = opi_seq_copy(seq);
   opi_unref(seq);
-  while ((x = opi_seq_next(s))) {
-
-    if (opi_unlikely(x->type == opi_undefined_type)) {
-      opi_unref(f);
-      opi_unref(z);
-      opi_drop(s);
-      return x;
-    }
+  while ((n = opi_seq_next_batch(s, buf, OPI_SEQ_BATCH))) {
+    for (size_t i = 0; i < n; ++i) {
+      opi_t x = buf[i];
+
+      if (opi_unlikely(opi_typeof(x) == opi_undefined_type)) {
+        opi_unref(f);
+        opi_unref(z);
+        opi_drop(s);
+        return x;
+      }
 
-    opi_push(x);
-    opi_push(z);
-    opi_dec_rc(z);
-    z = opi_apply(f, 2);
-    if (opi_unlikely(z->type == opi_undefined_type)) {
-      opi_unref(f);
-      opi_drop(s);
-      return z;
+      opi_push(x);
+      opi_push(z);
+      opi_dec_rc(z);
+      z = opi_apply(f, 2);
+      if (opi_unlikely(opi_typeof(z) == opi_undefined_type)) {
+        while (++i < n)
+          opi_drop(buf[i]);
+        opi_unref(f);
+        opi_drop(s);
+        return z;
+      }
+      opi_inc_rc(z);
     }
-    opi_inc_rc(z);
   }
 
   opi_unref(f);
@@ -902,6 +923,35 @@ Seq_foldl(void)
   return z;
 }
 
+static opi_t
+Seq_length(void)
+{
+  OPI_BEGIN_FN()
+  OPI_ARG(seq, opi_seq_type)
+
+  // count elements without collecting them into an Array
+  opi_t buf[OPI_SEQ_BATCH];
+  size_t n, len = 0;
+  opi_t s = opi_seq_copy(seq);
+  opi_unref(seq);
+  while ((n = opi_seq_next_batch(s, buf, OPI_SEQ_BATCH))) {
+    for (size_t i = 0; i < n; ++i) {
+      if (opi_unlikely(opi_typeof(buf[i]) == opi_undefined_type)) {
+        opi_t err = buf[i];
+        while (++i < n)
+          opi_drop(buf[i]);
+        opi_drop(s);
+        return err;
+      }
+      opi_drop(buf[i]);
+    }
+    len += n;
+  }
+
+  opi_drop(s);
+  return opi_int_new(len);
+}
+
 static opi_t
 Seq_scanl(void)
 {
@@ -919,14 +969,14 @@ Seq_scanl(void)
     opi_unref(self->f);
     opi_unref(self->z);
     opi_unref(self->s);
-    free(self);
+    opi_free(self, sizeof(Iter));
   }
 
   opi_t iter_next(OpiIter *iter) {
     Iter *restrict self = (void*)iter;
     opi_t x = opi_seq_next(self->s);
     if (opi_unlikely(x == NULL)) return NULL;
-    if (opi_unlikely(x->type == opi_undefined_type)) return x;
+    if (opi_unlikely(opi_typeof(x) == opi_undefined_type)) return x;
     opi_dec_rc(self->z);
     opi_push(x);
     opi_push(self->z);
@@ -937,14 +987,14 @@ Seq_scanl(void)
 
   OpiIter* iter_copy(OpiIter *iter) {
     Iter *self = (void*)iter;
-    Iter *new_iter = malloc(sizeof(Iter));
+    Iter *new_iter = opi_alloc(sizeof(Iter));
     opi_inc_rc(new_iter->f = self->f);
     opi_inc_rc(new_iter->z = self->z);
     opi_inc_rc(new_iter->s = opi_seq_copy(self->s));
     return (OpiIter*)new_iter;
   }
 
-  Iter *iter = malloc(sizeof(Iter));
+  Iter *iter = opi_alloc(sizeof(Iter));
   iter->f = f;
   iter->z = z;
   opi_inc_rc(iter->s = opi_seq_copy(s));
@@ -972,7 +1022,7 @@ Seq_reduce(void)
     opi_drop(s);
     return opi_undefined(opi_symbol("empty-sequence"));
   }
-  if (opi_unlikely(z->type == opi_undefined_type)) {
+  if (opi_unlikely(opi_typeof(z) == opi_undefined_type)) {
     opi_unref(f);
     opi_drop(s);
     return z;
@@ -982,7 +1032,7 @@ Seq_reduce(void)
   opi_inc_rc(z);
   while ((x = opi_seq_next(s))) {
 
-    if (opi_unlikely(x->type == opi_undefined_type)) {
+    if (opi_unlikely(opi_typeof(x) == opi_undefined_type)) {
       opi_unref(f);
       opi_drop(s);
       return x;
@@ -992,7 +1042,7 @@ Seq_reduce(void)
     opi_push(z);
     opi_dec_rc(z);
     z = opi_apply(f, 2);
-    if (opi_unlikely(z->type == opi_undefined_type)) {
+    if (opi_unlikely(opi_typeof(z) == opi_undefined_type)) {
       opi_unref(f);
       opi_drop(s);
       return z;
@@ -1006,6 +1056,190 @@ Seq_reduce(void)
   return z;
 }
 
+/*
+ * Fused stages.
+ *
+ * When the input of map/filter/zip is not shared, its iterator is taken over
+ * (see opi_seq_steal()) and the stage is applied directly to the elements it
+ * produces. Adjacent stages accumulate in a single iterator, so a pipeline
+ * creates neither intermediate sequences nor intermediate caches. The right
+ * side of zip is taken over in the same way if it is not shared either (e.g.
+ * `take`, which zips a range with the sequence).
+ */
+enum { STAGE_MAP, STAGE_FILTER, STAGE_ZIP, STAGE_ZIP_FUSED };
+
+typedef struct SeqStage_s {
+  int kind;
+  union {
+    opi_t arg; // function or (for zip) the right sequence
+    struct FusedIter_s *rhs; // right side of zip taken over
+  };
+} SeqStage;
+
+typedef struct FusedIter_s {
+  OpiIter *src;
+  OpiSeqCfg src_cfg;
+  size_t nstages, cap;
+  SeqStage *stages;
+} FusedIter;
+
+static opi_t
+fused_iter_next(OpiIter *iter)
+{
+  FusedIter *self = (void*)iter;
+next:;
+  opi_t x = self->src_cfg.next(self->src);
+  if (x == NULL || opi_typeof(x) == opi_undefined_type)
+    return x;
+
+  for (size_t i = 0; i < self->nstages; ++i) {
+    opi_t arg = self->stages[i].arg;
+    switch (self->stages[i].kind) {
+      case STAGE_MAP:
+        opi_push(x);
+        x = opi_apply(arg, 1);
+        if (opi_unlikely(opi_typeof(x) == opi_undefined_type))
+          return x;
+        break;
+
+      case STAGE_FILTER:
+      {
+        opi_push(x);
+        opi_inc_rc(x);
+        opi_t test = opi_apply(arg, 1);
+        if (opi_unlikely(opi_typeof(test) == opi_undefined_type)) {
+          opi_unref(x);
+          return test;
+        }
+        if (test == opi_false) {
+          opi_unref(x);
+          goto next;
+        }
+        opi_dec_rc(x);
+        break;
+      }
+
+      case STAGE_ZIP:
+      {
+        opi_inc_rc(x);
+        opi_t y = opi_seq_next(arg);
+        if (y == NULL || opi_typeof(y) == opi_undefined_type) {
+          opi_unref(x);
+          return y;
+        }
+        opi_dec_rc(x);
+        x = opi_cons(x, y);
+        break;
+      }
+
+      case STAGE_ZIP_FUSED:
+      {
+        opi_inc_rc(x);
+        opi_t y = fused_iter_next((OpiIter*)self->stages[i].rhs);
+        if (y == NULL || opi_typeof(y) == opi_undefined_type) {
+          opi_unref(x);
+          return y;
+        }
+        opi_dec_rc(x);
+        x = opi_cons(x, y);
+        break;
+      }
+    }
+  }
+  return x;
+}
+
+static OpiIter*
+fused_iter_copy(OpiIter *iter)
+{
+  FusedIter *self = (void*)iter;
+  FusedIter *new_iter = opi_alloc(sizeof(FusedIter));
+  new_iter->src = self->src_cfg.copy(self->src);
+  new_iter->src_cfg = self->src_cfg;
+  new_iter->nstages = new_iter->cap = self->nstages;
+  new_iter->stages = opi_alloc(sizeof(SeqStage) * self->nstages);
+  for (size_t i = 0; i < self->nstages; ++i) {
+    SeqStage stage = self->stages[i];
+    if (stage.kind == STAGE_ZIP_FUSED) {
+      stage.rhs = (void*)fused_iter_copy((OpiIter*)stage.rhs);
+    } else {
+      if (stage.kind == STAGE_ZIP)
+        stage.arg = opi_seq_copy(stage.arg);
+      opi_inc_rc(stage.arg);
+    }
+    new_iter->stages[i] = stage;
+  }
+  return (OpiIter*)new_iter;
+}
+
+static void
+fused_iter_delete(OpiIter *iter)
+{
+  FusedIter *self = (void*)iter;
+  self->src_cfg.dtor(self->src);
+  for (size_t i = 0; i < self->nstages; ++i) {
+    if (self->stages[i].kind == STAGE_ZIP_FUSED)
+      fused_iter_delete((OpiIter*)self->stages[i].rhs);
+    else
+      opi_unref(self->stages[i].arg);
+  }
+  opi_free(self->stages, sizeof(SeqStage) * self->cap);
+  opi_free(self, sizeof(FusedIter));
+}
+
+/*
+ * Make a fused iterator out of one taken over from a sequence.
+ */
+static FusedIter*
+fused_iter_wrap(OpiIter *src, OpiSeqCfg cfg)
+{
+  if (cfg.next == fused_iter_next)
+    return (void*)src;
+  FusedIter *iter = opi_alloc(sizeof(FusedIter));
+  iter->src = src;
+  iter->src_cfg = cfg;
+  iter->nstages = 0;
+  iter->cap = 4;
+  iter->stages = opi_alloc(sizeof(SeqStage) * iter->cap);
+  return iter;
+}
+
+/*
+ * Append a stage to the sequence s (taking over references to both s and
+ * arg) if s is not shared. Return NULL (and leave s intact) otherwise.
+ */
+static opi_t
+seq_fuse(opi_t s, int kind, opi_t arg)
+{
+  OpiIter *src;
+  OpiSeqCfg cfg;
+  if (!opi_seq_steal(s, &src, &cfg))
+    return NULL;
+
+  FusedIter *iter = fused_iter_wrap(src, cfg);
+  SeqStage stage = { .kind = kind, .arg = arg };
+  if (kind == STAGE_ZIP && opi_seq_steal(arg, &src, &cfg)) {
+    stage.kind = STAGE_ZIP_FUSED;
+    stage.rhs = fused_iter_wrap(src, cfg);
+  }
+
+  if (iter->nstages == iter->cap) {
+    size_t cap = iter->cap ? iter->cap * 2 : 4;
+    SeqStage *stages = opi_alloc(sizeof(SeqStage) * cap);
+    memcpy(stages, iter->stages, sizeof(SeqStage) * iter->nstages);
+    opi_free(iter->stages, sizeof(SeqStage) * iter->cap);
+    iter->stages = stages;
+    iter->cap = cap;
+  }
+  iter->stages[iter->nstages++] = stage;
+
+  return opi_seq_new((OpiIter*)iter, (OpiSeqCfg) {
+    .next = fused_iter_next,
+    .copy = fused_iter_copy,
+    .dtor = fused_iter_delete,
+  });
+}
+
 static opi_t
 Seq_map(void)
 {
@@ -1013,6 +1247,10 @@ Seq_map(void)
   OPI_ARG(f, opi_fn_type)
   OPI_ARG(s, opi_seq_type)
 
+  opi_t fused = seq_fuse(s, STAGE_MAP, f);
+  if (fused)
+    return fused;
+
   typedef struct MapIter_s {
     opi_t f, s;
   } MapIter;
@@ -1021,7 +1259,7 @@ Seq_map(void)
     MapIter *self = (void*)iter;
     opi_unref(self->f);
     opi_unref(self->s);
-    free(self);
+    opi_free(self, sizeof(MapIter));
   }
 
   opi_t map_iter_next(OpiIter *iter) {
@@ -1029,7 +1267,7 @@ Seq_map(void)
     opi_t x = opi_seq_next(self->s);
     if (x == NULL)
       return NULL;
-    if (x->type == opi_undefined_type)
+    if (opi_typeof(x) == opi_undefined_type)
       return x;
     opi_push(x);
     return opi_apply(self->f, 1);
@@ -1037,13 +1275,13 @@ Seq_map(void)
 
   OpiIter* map_iter_copy(OpiIter *iter) {
     MapIter *self = (void*)iter;
-    MapIter *new_iter = malloc(sizeof(MapIter));
+    MapIter *new_iter = opi_alloc(sizeof(MapIter));
     opi_inc_rc(new_iter->f = self->f);
     opi_inc_rc(new_iter->s = opi_seq_copy(self->s));
     return (OpiIter*)new_iter;
   }
 
-  MapIter *iter = malloc(sizeof(MapIter));
+  MapIter *iter = opi_alloc(sizeof(MapIter));
   iter->f = f;
   opi_inc_rc(iter->s = opi_seq_copy(s));
   opi_unref(s);
@@ -1061,6 +1299,17 @@ Seq_zip(void)
   OPI_ARG(s1, opi_seq_type)
   OPI_ARG(s2, opi_seq_type)
 
+  // the right sequence is only read through opi_seq_next(), so an unshared
+  // one needs no copy
+  opi_t s2c = s2;
+  if (opi_get_rc(s2) > 1) {
+    opi_inc_rc(s2c = opi_seq_copy(s2));
+    opi_unref(s2);
+  }
+  opi_t fused = seq_fuse(s1, STAGE_ZIP, s2c);
+  if (fused)
+    return fused;
+
   typedef struct ZipIter_s {
     opi_t s1, s2;
   } ZipIter;
@@ -1069,19 +1318,19 @@ Seq_zip(void)
     ZipIter *self = (void*)iter;
     opi_unref(self->s1);
     opi_unref(self->s2);
-    free(self);
+    opi_free(self, sizeof(ZipIter));
   }
 
   opi_t zip_iter_next(OpiIter *iter) {
     ZipIter *self = (void*)iter;
 
     opi_t x1 = opi_seq_next(self->s1);
-    if (x1 == NULL || x1->type == opi_undefined_type)
+    if (x1 == NULL || opi_typeof(x1) == opi_undefined_type)
       return x1;
     opi_inc_rc(x1);
 
     opi_t x2 = opi_seq_next(self->s2);
-    if (x2 == NULL || x2->type == opi_undefined_type) {
+    if (x2 == NULL || opi_typeof(x2) == opi_undefined_type) {
       opi_unref(x1);
       return x2;
     }
@@ -1092,17 +1341,16 @@ Seq_zip(void)
 
   OpiIter* zip_iter_copy(OpiIter *iter) {
     ZipIter *self = (void*)iter;
-    ZipIter *new_iter = malloc(sizeof(ZipIter));
+    ZipIter *new_iter = opi_alloc(sizeof(ZipIter));
     opi_inc_rc(new_iter->s1 = opi_seq_copy(self->s1));
     opi_inc_rc(new_iter->s2 = opi_seq_copy(self->s2));
     return (OpiIter*)new_iter;
   }
 
-  ZipIter *iter = malloc(sizeof(ZipIter));
+  ZipIter *iter = opi_alloc(sizeof(ZipIter));
   opi_inc_rc(iter->s1 = opi_seq_copy(s1));
   opi_unref(s1);
-  opi_inc_rc(iter->s2 = opi_seq_copy(s2));
-  opi_unref(s2);
+  iter->s2 = s2c;
   return opi_seq_new((OpiIter*)iter, (OpiSeqCfg) {
     .next = zip_iter_next,
     .copy = zip_iter_copy,
@@ -1117,6 +1365,10 @@ Seq_filter(void)
   OPI_ARG(f, opi_fn_type)
   OPI_ARG(s, opi_seq_type)
 
+  opi_t fused = seq_fuse(s, STAGE_FILTER, f);
+  if (fused)
+    return fused;
+
   typedef struct FilterIter_s {
     opi_t f, s;
   } FilterIter;
@@ -1125,7 +1377,7 @@ Seq_filter(void)
     FilterIter *self = (void*)iter;
     opi_unref(self->f);
     opi_unref(self->s);
-    free(self);
+    opi_free(self, sizeof(FilterIter));
   }
 
   opi_t filter_iter_next(OpiIter *iter) {
@@ -1134,12 +1386,12 @@ Seq_filter(void)
       opi_t x = opi_seq_next(self->s);
       if (x == NULL)
         return NULL;
-      if (x->type == opi_undefined_type)
+      if (opi_typeof(x) == opi_undefined_type)
         return x;
       opi_push(x);
       opi_inc_rc(x);
       opi_t test = opi_apply(self->f, 1);
-      if (opi_unlikely(test->type == opi_undefined_type)) {
+      if (opi_unlikely(opi_typeof(test) == opi_undefined_type)) {
         opi_unref(x);
         return test;
       }
@@ -1153,13 +1405,13 @@ Seq_filter(void)
 
   OpiIter* filter_iter_copy(OpiIter *iter) {
     FilterIter *self = (void*)iter;
-    FilterIter *new_iter = malloc(sizeof(FilterIter));
+    FilterIter *new_iter = opi_alloc(sizeof(FilterIter));
     opi_inc_rc(new_iter->f = self->f);
     opi_inc_rc(new_iter->s = opi_seq_copy(self->s));
     return (OpiIter*)new_iter;
   }
 
-  FilterIter *iter = malloc(sizeof(FilterIter));
+  FilterIter *iter = opi_alloc(sizeof(FilterIter));
   iter->f = f;
   opi_inc_rc(iter->s = opi_seq_copy(s));
   opi_unref(s);
@@ -1186,7 +1438,7 @@ Seq_unfold(void)
     opi_unref(self->f);
     if (self->i)
       opi_unref(self->i);
-    free(self);
+    opi_free(self, sizeof(UnfoldIter));
   }
 
   opi_t unfold_iter_next(OpiIter *iter) {
@@ -1196,9 +1448,9 @@ Seq_unfold(void)
     opi_dec_rc(self->i);
     opi_t x = opi_apply(self->f, 1);
 
-    if (opi_unlikely(x->type != opi_pair_type)) {
+    if (opi_unlikely(opi_typeof(x) != opi_pair_type)) {
       self->i = NULL;
-      if (x->type == opi_undefined_type) {
+      if (opi_typeof(x) == opi_undefined_type) {
         return x;
       } else {
         opi_drop(x);
@@ -1218,13 +1470,13 @@ Seq_unfold(void)
 
   OpiIter* unfold_iter_copy(OpiIter *iter) {
     UnfoldIter *self = (void*)iter;
-    UnfoldIter *new_iter = malloc(sizeof(UnfoldIter));
+    UnfoldIter *new_iter = opi_alloc(sizeof(UnfoldIter));
     opi_inc_rc(new_iter->f = self->f);
     opi_inc_rc(new_iter->i = self->i);
     return (OpiIter*)new_iter;
   }
 
-  UnfoldIter *iter = malloc(sizeof(UnfoldIter));
+  UnfoldIter *iter = opi_alloc(sizeof(UnfoldIter));
   iter->f = f;
   iter->i = i;
   return opi_seq_new((OpiIter*)iter, (OpiSeqCfg) {
@@ -1245,7 +1497,7 @@ List_toSeq(void)
     ListIter *iter = (void*)self;
 
     opi_t it = iter->it;
-    if (opi_unlikely(it->type != opi_pair_type))
+    if (opi_unlikely(opi_typeof(it) != opi_pair_type))
       return NULL;
 
     opi_t val = opi_car(it);
@@ -1256,9 +1508,24 @@ List_toSeq(void)
     return val;
   }
 
+  size_t list_iter_next_batch(OpiIter *self, opi_t *out, size_t n) {
+    ListIter *iter = (void*)self;
+
+    opi_t it = iter->it;
+    size_t k = 0;
+    for (; k < n && opi_typeof(it) == opi_pair_type; it = opi_cdr(it))
+      opi_inc_rc(out[k++] = opi_car(it));
+    opi_inc_rc(it);
+    opi_unref(iter->it);
+    iter->it = it;
+    for (size_t i = 0; i < k; ++i)
+      opi_dec_rc(out[i]);
+    return k;
+  }
+
   OpiIter *list_iter_copy(OpiIter *iter) {
     ListIter *self = (void*)iter;
-    ListIter *new_iter = malloc(sizeof(ListIter));
+    ListIter *new_iter = opi_alloc(sizeof(ListIter));
     opi_inc_rc(new_iter->it = self->it);
     return (OpiIter*)new_iter;
   }
@@ -1266,16 +1533,17 @@ List_toSeq(void)
   void list_iter_delete(OpiIter *self) {
     ListIter *iter = (void*)self;
     opi_unref(iter->it);
-    free(iter);
+    opi_free(iter, sizeof(ListIter));
   }
 
   opi_t l = opi_pop();
-  ListIter *iter = malloc(sizeof(ListIter));
+  ListIter *iter = opi_alloc(sizeof(ListIter));
   opi_inc_rc(iter->it = l);
   return opi_seq_new((OpiIter*)iter, (OpiSeqCfg) {
     .next = list_iter_next,
     .copy = list_iter_copy,
     .dtor = list_iter_delete,
+    .next_batch = list_iter_next_batch,
   });
 }
 
@@ -1290,7 +1558,7 @@ List_ofRevSeq(void)
   opi_t s = opi_seq_copy(seq);
   opi_unref(seq);
   while ((x = opi_seq_next(s))) {
-    if (opi_unlikely(x->type == opi_undefined_type)) {
+    if (opi_unlikely(opi_typeof(x) == opi_undefined_type)) {
       opi_drop(l);
       opi_drop(s);
       return x;
@@ -1332,8 +1600,8 @@ Buffer_ofStr(void)
 
 static
 OPI_DEF(Buffer_malloc,
-  opi_arg(size, opi_num_type)
-  size_t sz = OPI_NUM(size)->val;
+  opi_arg(size, opi_int_type)
+  size_t sz = opi_int_get_value(size);
   void *ptr = malloc(sz);
   if (ptr == NULL)
     opi_throw("out-of-memory");
@@ -1343,10 +1611,10 @@ OPI_DEF(Buffer_malloc,
 
 static
 OPI_DEF(Buffer_calloc,
-  opi_arg(nelts, opi_num_type)
-  opi_arg(size, opi_num_type)
-  size_t sz = OPI_NUM(size)->val;
-  size_t n = OPI_NUM(nelts)->val;
+  opi_arg(nelts, opi_int_type)
+  opi_arg(size, opi_int_type)
+  size_t sz = opi_int_get_value(size);
+  size_t n = opi_int_get_value(nelts);
   void *ptr = calloc(n, sz);
   if (ptr == NULL)
     opi_throw("out-of-memory");
@@ -1354,27 +1622,27 @@ OPI_DEF(Buffer_calloc,
   opi_return(OPI(opi_buffer_new(ptr, sz * n, delete, NULL)));
 )
 
-#define BUFFER_GET(name, type)                          \
+#define BUFFER_GET(name, type, ctor)                    \
   static                                                \
   OPI_DEF(name,                                         \
     opi_arg(buf, opi_buffer_type)                       \
-    opi_arg(at, opi_num_type)                           \
+    opi_arg(at, opi_int_type)                           \
     OpiBuffer *b = OPI_BUFFER(buf);                     \
-    size_t i = OPI_NUM(at)->val;                        \
+    size_t i = opi_int_get_value(at);                   \
     if (i * sizeof(type) + sizeof(type) - 1 >= b->size) \
       opi_throw("out-of-range");                        \
-    opi_return(opi_num_new(((type*)b->ptr)[i]));        \
+    opi_return(ctor(((type*)b->ptr)[i]));               \
 )
-BUFFER_GET(Buffer_getS8, int8_t)
-BUFFER_GET(Buffer_getU8, uint8_t)
-BUFFER_GET(Buffer_getS16, int16_t)
-BUFFER_GET(Buffer_getU16, uint16_t)
-BUFFER_GET(Buffer_getS32, int32_t)
-BUFFER_GET(Buffer_getU32, uint32_t)
-BUFFER_GET(Buffer_getS64, int64_t)
-BUFFER_GET(Buffer_getU64, uint64_t)
-BUFFER_GET(Buffer_getFloat, float)
-BUFFER_GET(Buffer_getDouble, double)
+BUFFER_GET(Buffer_getS8, int8_t, opi_int_new)
+BUFFER_GET(Buffer_getU8, uint8_t, opi_int_new)
+BUFFER_GET(Buffer_getS16, int16_t, opi_int_new)
+BUFFER_GET(Buffer_getU16, uint16_t, opi_int_new)
+BUFFER_GET(Buffer_getS32, int32_t, opi_int_new)
+BUFFER_GET(Buffer_getU32, uint32_t, opi_int_new)
+BUFFER_GET(Buffer_getS64, int64_t, opi_int_new)
+BUFFER_GET(Buffer_getU64, uint64_t, opi_int_new)
+BUFFER_GET(Buffer_getFloat, float, opi_float_new)
+BUFFER_GET(Buffer_getDouble, double, opi_float_new)
 
 #define BUFFER_OFSEQ(name, ty)                                                \
   static                                                                      \
@@ -1382,17 +1650,30 @@ BUFFER_GET(Buffer_getDouble, double)
     opi_arg(seq, opi_seq_type)                                                \
     cod_vec(ty) vec;                                                          \
     cod_vec_init(vec);                                                        \
-    opi_t x;                                                                  \
+    opi_t buf[OPI_SEQ_BATCH];                                                 \
+    size_t n;                                                                 \
     opi_t s = opi_seq_copy(seq);                                              \
     opi_unref(seq);                                                           \
-    while ((x = opi_seq_next(s))) {                                           \
-      if (opi_unlikely(x->type == opi_undefined_type)) {                      \
-        cod_vec_destroy(vec);                                                 \
-        opi_drop(s);                                                          \
-        return x;                                                             \
+    while ((n = opi_seq_next_batch(s, buf, OPI_SEQ_BATCH))) {                 \
+      for (size_t i = 0; i < n; ++i) {                                        \
+        opi_t x = buf[i];                                                     \
+        if (opi_unlikely(opi_typeof(x) == opi_undefined_type)) {              \
+          cod_vec_destroy(vec);                                               \
+          opi_drop(s);                                                        \
+          return x;                                                           \
+        }                                                                     \
+        if (opi_unlikely(!opi_is_num(x))) {                                   \
+          cod_vec_destroy(vec);                                               \
+          for (; i < n; ++i)                                                  \
+            opi_drop(buf[i]);                                                 \
+          opi_drop(s);                                                        \
+          return opi_undefined(opi_symbol("type-error"));                     \
+        }                                                                     \
+        ty v = opi_is_int(x) ? (ty)opi_int_get_value(x)                       \
+                             : (ty)opi_float_get_value(x);                    \
+        cod_vec_push(vec, v);                                                 \
+        opi_drop(x);                                                          \
       }                                                                       \
-      cod_vec_push(vec, OPI_NUM(x)->val);                                     \
-      opi_drop(x);                                                            \
     }                                                                         \
     opi_drop(s);                                                              \
     void delete(void *ptr, void *c) { free(ptr); }                            \
@@ -1412,128 +1693,136 @@ BUFFER_OFSEQ(Buffer_ofDoubleSeq, double)
 static
 OPI_DEF(Buffer_size,
   opi_arg(buf, opi_buffer_type)
-  opi_return(opi_num_new(OPI_BUFFER(buf)->size));
+  opi_return(opi_int_new(OPI_BUFFER(buf)->size));
 )
 
 static
 OPI_DEF(sin_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(sinl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(sin(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(cos_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(cosl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(cos(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(tan_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(tanl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(tan(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(asin_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(asinl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(asin(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(acos_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(acosl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(acos(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(atan_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(atanl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(atan(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(atan2_,
-  opi_arg(x, opi_num_type)
-  opi_arg(y, opi_num_type)
-  opi_return(opi_num_new(atan2l(OPI_NUM(x)->val, OPI_NUM(y)->val)));
+  opi_num_arg(x)
+  opi_num_arg(y)
+  opi_return(opi_float_new(atan2(opi_num_get_value(x), opi_num_get_value(y))));
 )
 
 static
 OPI_DEF(sinh_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(sinhl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(sinh(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(cosh_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(coshl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(cosh(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(tanh_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(tanhl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(tanh(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(asinh_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(asinhl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(asinh(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(acosh_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(acoshl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(acosh(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(atanh_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(atanhl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(atanh(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(floor_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(floorl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  if (opi_is_int(x))
+    opi_return(x);
+  opi_return(opi_float_new(floor(opi_float_get_value(x))));
 )
 
 static
 OPI_DEF(ceil_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(ceill(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  if (opi_is_int(x))
+    opi_return(x);
+  opi_return(opi_float_new(ceil(opi_float_get_value(x))));
 )
 
 static
 OPI_DEF(trunc_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(truncl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  if (opi_is_int(x))
+    opi_return(x);
+  opi_return(opi_float_new(trunc(opi_float_get_value(x))));
 )
 
 static
 OPI_DEF(round_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(roundl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  if (opi_is_int(x))
+    opi_return(x);
+  opi_return(opi_float_new(round(opi_float_get_value(x))));
 )
 
 static
 OPI_DEF(sqrt_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(sqrtl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(sqrt(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(cbrt_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(cbrtl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(cbrt(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(finite_,
-  opi_arg(x, opi_num_type)
-  if (finitel(OPI_NUM(x)->val))
+  opi_num_arg(x)
+  if (isfinite(opi_num_get_value(x)))
     opi_return(x);
   else
     opi_return(opi_false);
@@ -1541,8 +1830,8 @@ OPI_DEF(finite_,
 
 static
 OPI_DEF(isnan_,
-  opi_arg(x, opi_num_type)
-  if (isnanl(OPI_NUM(x)->val))
+  opi_num_arg(x)
+  if (isnan(opi_num_get_value(x)))
     opi_return(opi_true);
   else
     opi_return(opi_false);
@@ -1550,8 +1839,8 @@ OPI_DEF(isnan_,
 
 static
 OPI_DEF(isinf_,
-  opi_arg(x, opi_num_type)
-  if (isinfl(OPI_NUM(x)->val))
+  opi_num_arg(x)
+  if (isinf(opi_num_get_value(x)))
     opi_return(opi_true);
   else
     opi_return(opi_false);
@@ -1559,47 +1848,53 @@ OPI_DEF(isinf_,
 
 static
 OPI_DEF(max_,
-  opi_arg(x, opi_num_type)
-  opi_arg(y, opi_num_type)
-  opi_return(opi_num_new(fmaxl(OPI_NUM(x)->val, OPI_NUM(y)->val)));
+  opi_num_arg(x)
+  opi_num_arg(y)
+  if (opi_is_int(x) && opi_is_int(y))
+    opi_return(opi_int_get_value(x) > opi_int_get_value(y) ? x : y);
+  opi_return(opi_float_new(fmax(opi_num_get_value(x), opi_num_get_value(y))));
 )
 
 static
 OPI_DEF(min_,
-  opi_arg(x, opi_num_type)
-  opi_arg(y, opi_num_type)
-  opi_return(opi_num_new(fminl(OPI_NUM(x)->val, OPI_NUM(y)->val)));
+  opi_num_arg(x)
+  opi_num_arg(y)
+  if (opi_is_int(x) && opi_is_int(y))
+    opi_return(opi_int_get_value(x) < opi_int_get_value(y) ? x : y);
+  opi_return(opi_float_new(fmin(opi_num_get_value(x), opi_num_get_value(y))));
 )
 
 static
 OPI_DEF(hypot_,
-  opi_arg(x, opi_num_type)
-  opi_arg(y, opi_num_type)
-  opi_return(opi_num_new(hypotl(OPI_NUM(x)->val, OPI_NUM(y)->val)));
+  opi_num_arg(x)
+  opi_num_arg(y)
+  opi_return(opi_float_new(hypot(opi_num_get_value(x), opi_num_get_value(y))));
 )
 
 static
 OPI_DEF(log_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(logl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(log(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(log10_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(log10l(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(log10(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(log2_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(log2l(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  opi_return(opi_float_new(log2(opi_num_get_value(x))));
 )
 
 static
 OPI_DEF(abs_,
-  opi_arg(x, opi_num_type)
-  opi_return(opi_num_new(fabsl(OPI_NUM(x)->val)));
+  opi_num_arg(x)
+  if (opi_is_int(x))
+    opi_return(opi_int_new(imaxabs(opi_int_get_value(x))));
+  opi_return(opi_float_new(fabs(opi_float_get_value(x))));
 )
 
 static
@@ -1607,7 +1902,7 @@ OPI_DEF(Table_insert,
   opi_arg(x, opi_pair_type)
   opi_arg(tab, opi_table_type)
   opi_t err;
-  if (tab->rc != 1)
+  if (tab->rc != 1 && !opi_table_is_persistent(tab))
     opi_warning("copy table\n");
   opi_t ret = tab->rc > 1 ? opi_table_copy(tab) : tab;
   if (!opi_table_insert(ret, x, TRUE, &err)) {
@@ -1617,6 +1912,33 @@ OPI_DEF(Table_insert,
   opi_return(ret);
 )
 
+static
+OPI_DEF(Table_size,
+  opi_arg(tab, opi_table_type)
+  opi_return(opi_int_new(opi_table_size(tab)));
+)
+
+static
+OPI_DEF(Table_remove,
+  opi_arg(key, NULL)
+  opi_arg(tab, opi_table_type)
+  opi_t err;
+  if (tab->rc != 1 && !opi_table_is_persistent(tab))
+    opi_warning("copy table\n");
+  opi_t ret = tab->rc > 1 ? opi_table_copy(tab) : tab;
+  if (!opi_table_remove(ret, key, &err)) {
+    opi_drop(ret);
+    opi_return(err);
+  }
+  opi_return(ret);
+)
+
+static
+OPI_DEF(Table_persistent,
+  opi_arg(l, NULL)
+  opi_return(opi_table_persistent(l, FALSE));
+)
+
 int
 opium_library(OpiBuilder *bldr)
 {
@@ -1632,6 +1954,7 @@ opium_library(OpiBuilder *bldr)
   opi_builder_def_const(bldr, "Seq.zip", opi_fn_new(Seq_zip, 2));
   opi_builder_def_const(bldr, "Seq.filter", opi_fn_new(Seq_filter, 2));
   opi_builder_def_const(bldr, "Seq.foldl", opi_fn_new(Seq_foldl, 3));
+  opi_builder_def_const(bldr, "Seq.length", opi_fn_new(Seq_length, 1));
   opi_builder_def_const(bldr, "Seq.scanl", opi_fn_new(Seq_scanl, 3));
   opi_builder_def_const(bldr, "Seq.reduce", opi_fn_new(Seq_reduce, 2));
   opi_builder_def_const(bldr, "Seq.unfold", opi_fn_new(Seq_unfold, 2));
@@ -1650,7 +1973,10 @@ opium_library(OpiBuilder *bldr)
   opi_builder_def_const(bldr, "Array.ofSeq", opi_fn_new(Array_ofSeq, 1));
   opi_builder_def_const(bldr, "Array.toSeq", opi_fn_new(Array_toSeq, 1));
 
+  opi_builder_def_const(bldr, "Table.size", opi_fn_new(Table_size, 1));
   opi_builder_def_const(bldr, "Table.insert", opi_fn_new(Table_insert, 2));
+  opi_builder_def_const(bldr, "Table.remove", opi_fn_new(Table_remove, 2));
+  opi_builder_def_const(bldr, "Table.persistent", opi_fn_new(Table_persistent, 1));
 
   opi_builder_def_const(bldr, "Buffer.malloc", opi_fn_new(Buffer_malloc, 1));
   opi_builder_def_const(bldr, "Buffer.calloc", opi_fn_new(Buffer_calloc, 2));
@@ -1695,7 +2021,7 @@ opium_library(OpiBuilder *bldr)
   opi_builder_def_const(bldr, "__base_rewind", opi_fn_new(base_rewind, 1));
 
   fpos_type = opi_type_new("FPos");
-  opi_type_set_delete_cell(fpos_type, OPI_FREE_CELL);
+  opi_type_set_delete_cell(fpos_type, fpos_delete);
   opi_builder_def_type(bldr, "FPos", fpos_type);
   opi_builder_def_const(bldr, "__base_getpos", opi_fn_new(base_getpos, 1));
   opi_builder_def_const(bldr, "__base_setpos", opi_fn_new(base_setpos, 2));
@@ -0,0 +1,104 @@
+/*
+ * Compare string hashing backends on Table insert and lookup.
+ *
+ * usage: table-hash [--siphash] [<nkeys> [<key-length>]]
+ *
+ * Run once with and once without --siphash: the backend is fixed for the
+ * lifetime of the process (symbols are hashed with it too).
+ */
+#include "opium/opium.h"
+#include "opium/hash-map.h"
+
+#include <string.h>
+#include <time.h>
+
+#define LOOKUP_ROUNDS 5
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static opi_t*
+make_keys(size_t n, size_t keylen)
+{
+  opi_t *keys = malloc(sizeof(opi_t) * n);
+  char *buf = malloc(keylen + 32);
+  for (size_t i = 0; i < n; ++i) {
+    int len = sprintf(buf, "key-%zu-", i);
+    for (; (size_t)len < keylen; ++len)
+      buf[len] = 'a' + (i + len) % 26;
+    opi_inc_rc(keys[i] = opi_str_new_with_len(buf, len));
+  }
+  free(buf);
+  return keys;
+}
+
+static void
+free_keys(opi_t *keys, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    opi_unref(keys[i]);
+  free(keys);
+}
+
+int
+main(int argc, char **argv)
+{
+  int use_siphash = FALSE;
+  if (argc > 1 && strcmp(argv[1], "--siphash") == 0) {
+    use_siphash = TRUE;
+    argc--, argv++;
+  }
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  size_t keylen = argc > 2 ? strtoull(argv[2], NULL, 10) : 16;
+  if (n == 0) {
+    fprintf(stderr, "usage: table-hash [--siphash] [<nkeys> [<key-length>]]\n");
+    return EXIT_FAILURE;
+  }
+
+  opi_init(OPI_INIT_DEFAULT | (use_siphash ? OPI_INIT_SIPHASH : 0));
+
+  // lookups go through separate (equal) strings, as they would in a program
+  opi_t *keys = make_keys(n, keylen);
+  opi_t *probes = make_keys(n, keylen);
+
+  double t0 = now();
+  size_t acc = 0;
+  for (size_t i = 0; i < n; ++i)
+    acc += opi_hashof(keys[i]);
+  double t_hash = now() - t0;
+
+  opi_t tab = opi_table(opi_nil, TRUE);
+  opi_inc_rc(tab);
+  t0 = now();
+  for (size_t i = 0; i < n; ++i)
+    opi_table_insert(tab, opi_cons(keys[i], opi_nil), TRUE, NULL);
+  double t_insert = now() - t0;
+
+  size_t hits = 0;
+  t0 = now();
+  for (int r = 0; r < LOOKUP_ROUNDS; ++r) {
+    for (size_t i = 0; i < n; ++i) {
+      opi_t err;
+      hits += opi_table_at(tab, probes[i], &err) != NULL;
+    }
+  }
+  double t_lookup = now() - t0;
+
+  opi_assert(hits == n * LOOKUP_ROUNDS);
+  printf("%s: %zu keys of length %zu (%zx)\n",
+      use_siphash ? "siphash" : "wyhash", n, keylen, acc);
+  printf("  hash    %7.1f ns/key\n", t_hash * 1e9 / n);
+  printf("  insert  %7.1f ns/key\n", t_insert * 1e9 / n);
+  printf("  lookup  %7.1f ns/key\n", t_lookup * 1e9 / (n * LOOKUP_ROUNDS));
+
+  opi_unref(tab);
+  free_keys(keys, n);
+  free_keys(probes, n);
+  opi_cleanup();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#ifndef OPIUM_HAMT_H
+#define OPIUM_HAMT_H
+
+#include "opium/opium.h"
+
+/*
+ * Persistent hash array mapped trie.
+ *
+ * Nodes are reference counted and shared between copies, so a copy is O(1)
+ * and an update copies only the path from the root to the changed entry.
+ * Nodes which are not shared are updated in place.
+ */
+typedef struct OpiHamtNode_s OpiHamtNode;
+
+typedef struct OpiHamt_s {
+  size_t size;
+  OpiHamtNode *root;
+} OpiHamt;
+
+void
+opi_hamt_init(OpiHamt *hamt);
+
+void
+opi_hamt_destroy(OpiHamt *hamt);
+
+/*
+ * Initialize `dst` sharing all the nodes with `src`.
+ */
+void
+opi_hamt_share(OpiHamt *dst, OpiHamt *src);
+
+/*
+ * Lookup for the key. Returns NULL if there is no such key.
+ */
+opi_t
+opi_hamt_find(OpiHamt *hamt, opi_t key, size_t hash);
+
+/*
+ * Insert new element. If the key is already present, its value is replaced
+ * when `replace` is set; otherwise FALSE is returned.
+ */
+int
+opi_hamt_insert(OpiHamt *hamt, opi_t key, size_t hash, opi_t val, int replace);
+
+/*
+ * Remove element. Returns FALSE if there is no such key.
+ */
+int
+opi_hamt_erase(OpiHamt *hamt, opi_t key, size_t hash);
+
+void
+opi_hamt_foreach(OpiHamt *hamt, void (*fn)(opi_t key, opi_t val, void *data),
+    void *data);
+
+#endif
@@ -3,41 +3,111 @@
 
 #include "opium/opium.h"
 
+/*
+ * Hash a string with the backend selected by opi_hash_init(). Both backends
+ * are keyed with a random per-process seed, so hashes (and iteration order of
+ * tables) differ between runs.
+ */
 uint64_t
 opi_hash(const char* p, size_t n);
 
+/* wyhash: fast, but not meant to withstand deliberate collision flooding. */
+uint64_t
+opi_hash_fast(const char *p, size_t n);
+
+/* SipHash-2-4: slower, safe to use on keys coming from untrusted input. */
+uint64_t
+opi_hash_sip(const char *p, size_t n);
+
+void
+opi_hash_init(int use_siphash);
+
+/*
+ * Spread the bits of a weak hash (bits of a number, an address) over the whole
+ * word before it is split into bucket index and tag bits.
+ */
+static inline size_t
+opi_hash_mix(size_t hash)
+{
+  __uint128_t r = (__uint128_t)hash * 0x9E3779B97F4A7C15ull;
+  return (size_t)r ^ (size_t)(r >> 64);
+}
+
 typedef struct OpiHashMapElt_s {
   size_t hash;
   opi_t key;
   opi_t val;
 } OpiHashMapElt;
 
+/*
+ * Open addressing hash map in the manner of SwissTable: slots are grouped by
+ * OPI_HASH_MAP_GROUP, and a parallel array of control bytes tells for each
+ * slot whether it is empty, deleted, or full (then it keeps 7 bits of the
+ * hash), so a whole group is scanned at once before touching any keys.
+ *
+ * Capacity is either zero (nothing allocated) or a power of two not less than
+ * the group size.
+ */
+#define OPI_HASH_MAP_GROUP 16
+
+enum {
+  OPI_HASH_MAP_EMPTY = -128,
+  OPI_HASH_MAP_DELETED = -2,
+};
+
 typedef struct OpiHashMap_s {
   size_t size;
   size_t cap;
+  size_t growth_left; // insertions into empty slots left before rehash
+  int8_t *ctrl; // cap + OPI_HASH_MAP_GROUP bytes, first group is mirrored
   OpiHashMapElt *data;
 } OpiHashMap;
 
+/*
+ * Initialize empty map able to hold at least `reserve` elements before
+ * rehashing.
+ */
 void
-opi_hash_map_init(OpiHashMap *map);
+opi_hash_map_init(OpiHashMap *map, size_t reserve);
 
 void
 opi_hash_map_destroy(OpiHashMap *map);
 
+/*
+ * Lookup for the key. Element is stored into `elt` (if not NULL), or NULL if
+ * there is no such key.
+ */
 int
 opi_hash_map_find(OpiHashMap *map, opi_t key, size_t hash, OpiHashMapElt **elt);
 
 int
 opi_hash_map_find_is(OpiHashMap *map, opi_t key, size_t hash, OpiHashMapElt **elt);
 
+/*
+ * Insert new element or replace value of the existing one. `elt` must be the
+ * result of the preceding lookup of the same key.
+ */
 void
 opi_hash_map_insert(OpiHashMap *map, opi_t key, size_t hash, opi_t val, OpiHashMapElt *elt);
 
+/*
+ * Remove element found by the lookup.
+ */
+void
+opi_hash_map_erase(OpiHashMap *map, OpiHashMapElt *elt);
+
+/*
+ * Same as opi_hash_map_erase(), but the key and value are not released (for
+ * maps which do not own them).
+ */
+void
+opi_hash_map_forget(OpiHashMap *map, OpiHashMapElt *elt);
+
 static inline size_t
 opi_hash_map_next(OpiHashMap *map, size_t iter)
 {
   for (size_t i = iter + 1; i < map->cap; ++i) {
-    if (map->data[i].key != NULL)
+    if (map->ctrl[i] >= 0)
       return i;
   }
   return map->cap;
@@ -47,7 +117,7 @@ static inline size_t
 opi_hash_map_begin(OpiHashMap *map)
 {
   for (size_t i = 0; i < map->cap; ++i) {
-    if (map->data[i].key != NULL)
+    if (map->ctrl[i] >= 0)
       return i;
   }
   return map->cap;
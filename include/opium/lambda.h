@@ -3,51 +3,10 @@
 
 #include "opium/opium.h"
 
-typedef struct OpiRecRef_s {
-  opi_t val;
-  void (*destroy)(void*);
-  void (*free)(void*);
-} OpiRecRef;
-
-typedef struct OpiRecScope_s {
-  size_t rc;
-  size_t nrefs;
-  OpiRecRef refs[];
-} OpiRecScope;
-
-static inline OpiRecScope*
-opi_rec_scope(size_t nrefs)
-{
-  OpiRecScope *scp = malloc(sizeof(OpiRecScope) + sizeof(OpiRecRef) * nrefs);
-  scp->nrefs = nrefs;
-  return scp;
-}
-
-static inline void
-opi_rec_scope_finalize(OpiRecScope *scp)
-{
-  for (size_t i = 0; i < scp->nrefs; ++i)
-    scp->refs[i].val->rc = 1;
-  scp->rc = scp->nrefs;
-}
-
-static inline void
-opi_rec_scope_set(OpiRecScope *scp, size_t iref, opi_t val,
-    void (*destroy)(void*), void (*free)(void*))
-{
-  OpiRecRef *ref = scp->refs + iref;
-  ref->val = val;
-  ref->destroy = destroy;
-  ref->free = free;
-}
-
-void
-opi_scope_dropout(OpiRecScope *scp);
-
 typedef struct {
   OpiBytecode *bc;
   OpiIr *ir;
-  OpiRecScope *scp;
+  size_t scpidx; // index in the recursive scope (if any)
   size_t ncaps;
   opi_t caps[];
 } OpiLambda;
@@ -59,7 +18,7 @@ opi_lambda_allocate(size_t ncaps)
     return opi_h2w();
   if (ncaps < 5)
     return opi_h6w();
-  return malloc(sizeof(OpiLambda) + sizeof(opi_t) * ncaps);
+  return opi_alloc(sizeof(OpiLambda) + sizeof(opi_t) * ncaps);
 }
 
 void
@@ -71,6 +30,30 @@ opi_lam_destroy(OpiFn *fn);
 void
 opi_lambda_delete(OpiFn *fn);
 
+/*
+ * Called instead of queueing a member of a recursive scope for deletion: it
+ * only drops out of the scope, and once the whole scope is dead, the scope is
+ * queued (as this member).
+ */
+void
+opi_lambda_dropout(OpiFn *fn);
+
+void
+opi_lambda_suspect(OpiFn *fn);
+
+/*
+ * Load capture. Captures with zero RC are siblings from the recursive scope
+ * which have dropped out of it, and may get resurrected now.
+ */
+static inline opi_t
+opi_lambda_ldcap(OpiLambda *lam, size_t idx)
+{
+  opi_t x = lam->caps[idx];
+  if (opi_unlikely(opi_get_rc(x) == 0))
+    opi_lambda_suspect(OPI_FN(x));
+  return x;
+}
+
 opi_t
 opi_lambda_fn(void);
 
@@ -80,4 +63,15 @@ opi_is_lambda(opi_t cell)
   return opi_fn_get_handle(cell) == opi_lambda_fn;
 }
 
+/*
+ * Handle of a lambda whose body contains yield: application returns a Seq
+ * driving the body.
+ */
+opi_t
+opi_generator_fn(void);
+
+static inline opi_fn_handle_t
+opi_lambda_handle(OpiBytecode *bc)
+{ return bc->is_generator ? opi_generator_fn : opi_lambda_fn; }
+
 #endif
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <math.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -97,8 +98,11 @@ typedef struct OpiHeader_s OpiHeader;
 typedef OpiHeader *opi_t;
 #define OPI(x) ((opi_t)(x))
 
-typedef struct OpiNum_s OpiNum;
-#define OPI_NUM(x) ((OpiNum*)(x))
+typedef struct OpiInt_s OpiInt;
+#define OPI_INT(x) ((OpiInt*)(x))
+
+typedef struct OpiFloat_s OpiFloat;
+#define OPI_FLOAT(x) ((OpiFloat*)(x))
 
 typedef struct OpiUndefined_s OpiUndefined;
 #define OPI_UNDEFINED(x) ((OpiUndefined*)(x))
@@ -139,6 +143,23 @@ typedef struct OpiSeq_s OpiSeq;
 OPI_EXTERN
 opi_t* opi_sp;
 
+/*
+ * Limit of the argument-stack.
+ *
+ * Function application fails with `stack-overflow` once opi_sp goes past this
+ * limit. Stack allocated by opi_init() (see OPI_INIT_STACK) reserves
+ * OPI_STACK_SIZE entries (physical pages are taken on first use), followed by
+ * OPI_STACK_SLACK entries to hold arguments of the overflowing call and a guard
+ * page. Users providing their own stack may set it as well.
+ */
+OPI_EXTERN
+opi_t* opi_stack_limit;
+
+#ifndef OPI_STACK_SIZE
+# define OPI_STACK_SIZE 0x100000
+#endif
+#define OPI_STACK_SLACK 0x10000
+
 /*
  * Pointer to the "current" function object.
  *
@@ -167,8 +188,12 @@ size_t opi_nargs;
  */
 enum {
   /* If enabled, opi_init() will take care to allocate an argument-stack.
-   * Otherwize, user must do it himself, and set opi_sp to point on it. */
+   * Otherwize, user must do it himself, and set opi_sp to point on it (and
+   * opi_stack_limit to the last usable entry minus OPI_STACK_SLACK). */
   OPI_INIT_STACK = 0x1,
+  /* Hash strings with SipHash instead of the faster default hash. Use it when
+   * table keys may come from untrusted input. */
+  OPI_INIT_SIPHASH = 0x2,
   /* Default flags to opi_init(). */
   OPI_INIT_DEFAULT = OPI_INIT_STACK,
 };
@@ -286,6 +311,19 @@ opi_type_set_equal(opi_type_t ty, int (*fn)(opi_type_t,opi_t,opi_t));
 void
 opi_type_set_hash(opi_type_t ty, size_t (*fn)(opi_type_t,opi_t));
 
+/*
+ * Set function enumerating references owned by a cell (used by the cycle
+ * collector). By default declared fields are enumerated; types hiding other
+ * references must either set it or let them be ignored (cycles through such
+ * cells are not collected then).
+ */
+void
+opi_type_set_traverse(opi_type_t ty,
+    void (*fn)(opi_type_t,opi_t,void(*)(opi_t,void*),void*));
+
+void
+opi_traverse(opi_t x, void (*visit)(opi_t,void*), void *data);
+
 int
 opi_type_is_hashable(opi_type_t ty);
 
@@ -400,6 +438,44 @@ opi_trait_get_impl(OpiTrait *trait, opi_type_t type, int metoffs);
 opi_t
 opi_trait_get_generic(OpiTrait *trait, int metoffs);
 
+/*
+ * Inline cache of trait method lookups (per call site).
+ *
+ * Entries are keyed by type and stay valid until any trait implementation is
+ * changed or released (which bumps opi_trait_epoch). Entries do not own
+ * references. Zero-initialized cache is empty.
+ */
+#define OPI_TRAIT_CACHE_SIZE 4
+
+typedef struct OpiTraitCache_s {
+  size_t epoch;
+  int n;
+  struct {
+    opi_type_t type;
+    opi_t impl; // NULL if type does not implement the trait
+  } ents[OPI_TRAIT_CACHE_SIZE];
+} OpiTraitCache;
+
+OPI_EXTERN
+size_t opi_trait_epoch;
+
+opi_t
+opi_trait_cache_miss(OpiTraitCache *cache, OpiTrait *trait, opi_type_t type,
+    int metoffs);
+
+static inline opi_t
+opi_trait_cache_get_impl(OpiTraitCache *cache, OpiTrait *trait,
+    opi_type_t type, int metoffs)
+{
+  if (opi_likely(cache->epoch == opi_trait_epoch)) {
+    for (int i = 0; i < cache->n; ++i) {
+      if (cache->ents[i].type == type)
+        return cache->ents[i].impl;
+    }
+  }
+  return opi_trait_cache_miss(cache, trait, type, metoffs);
+}
+
 OPI_EXTERN
 OpiTrait *opi_trait_add,
          *opi_trait_sub,
@@ -430,17 +506,43 @@ opi_traits_cleanup(void);
 typedef uint32_t opi_rc_t;
 typedef uint32_t opi_meta_t;
 
-#define OPI_SCPID_NONE 0xFFFFFFFF
+#define OPI_META_NONE 0xFFFFFFFF
 
 struct OpiHeader_s {
   OpiType *type;
-  opi_meta_t scpid;
+  opi_meta_t meta; // rec-scope id of lambdas, length of lists, etc
   opi_rc_t rc;
 };
 
 #define opi_as(cell, type) ((type*)cell)[0]
 #define opi_as_ptr(cell) ((void*)cell)
 
+/* Immediate cells: small Ints are encoded directly in the pointer as
+ * (value << 1) | OPI_IMM_TAG. Such cells have no header and are never
+ * allocated, reference-counted or deleted. */
+#define OPI_IMM_TAG 1
+#define OPI_IMM_MIN (-((intptr_t)1 << (sizeof(intptr_t)*8 - 2)))
+#define OPI_IMM_MAX (((intptr_t)1 << (sizeof(intptr_t)*8 - 2)) - 1)
+
+OPI_EXTERN opi_type_t
+opi_int_type;
+
+static inline int __attribute__((always_inline))
+opi_is_imm(opi_t x)
+{ return (uintptr_t)x & OPI_IMM_TAG; }
+
+static inline opi_t __attribute__((always_inline))
+opi_imm_new(intptr_t x)
+{ return (opi_t)(((uintptr_t)x << 1) | OPI_IMM_TAG); }
+
+static inline intptr_t __attribute__((always_inline))
+opi_imm_get_value(opi_t x)
+{ return (intptr_t)x >> 1; }
+
+static inline opi_type_t __attribute__((always_inline))
+opi_typeof(opi_t x)
+{ return opi_is_imm(x) ? opi_int_type : x->type; }
+
 void
 opi_display(opi_t x, FILE *out);
 
@@ -457,37 +559,89 @@ opi_eq(opi_t x, opi_t y);
 int
 opi_equal(opi_t x, opi_t y);
 
+#ifdef OPI_MEM_CENSUS
+/*
+ * Census of live cells per type.
+ */
+void
+opi_census_add(opi_type_t ty, int d);
+
+void
+opi_type_census(void (*fn)(opi_type_t ty, size_t nlive, void *data), void *data);
+#endif
+
 static inline void
 opi_init_cell(void *x_, opi_type_t ty)
 {
   opi_t restrict x = (opi_t)x_;
   x->type = ty;
   x->rc = 0;
-  x->scpid = OPI_SCPID_NONE;
+  x->meta = OPI_META_NONE;
+#ifdef OPI_MEM_CENSUS
+  opi_census_add(ty, +1);
+#endif
 }
 
+/*
+ * Deferred freeing.
+ *
+ * opi_delete() pushes dead cell into the queue, which is then drained by
+ * portions of OPI_FREE_BUDGET cells: right away (unless already draining), and
+ * at safe points of the VM. Cascades of frees are thus iterative (no risk of
+ * C-stack overflow) and dropping a huge structure does not stop the world.
+ */
+#define OPI_FREE_BUDGET 0x400
+
+typedef cod_vec(opi_t) OpiFreeQueue;
+
+OPI_EXTERN
+OpiFreeQueue opi_free_queue;
+
+// set while opi_drain_frees() is running
+OPI_EXTERN
+int opi_free_queue_draining;
+
 void
 opi_delete(opi_t x);
 
+/*
+ * Free up to <budget> cells from the queue.
+ *
+ * Return number of cells freed.
+ */
+size_t
+opi_drain_frees(size_t budget);
+
+static inline void
+opi_drain_frees_safepoint(void)
+{
+  if (opi_unlikely(opi_free_queue.len > 0) && !opi_free_queue_draining)
+    opi_drain_frees(OPI_FREE_BUDGET);
+}
+
 static inline opi_rc_t
 opi_inc_rc(opi_t x)
-{ return ++x->rc; }
+{ return opi_is_imm(x) ? 1 : ++x->rc; }
 
 static inline opi_rc_t
 opi_dec_rc(opi_t x)
-{ return --x->rc; }
+{ return opi_is_imm(x) ? 1 : --x->rc; }
+
+static inline opi_rc_t
+opi_get_rc(opi_t x)
+{ return opi_is_imm(x) ? 1 : x->rc; }
 
 static inline void
 opi_drop(opi_t x)
 {
-  if (x->rc == 0)
+  if (!opi_is_imm(x) && x->rc == 0)
     opi_delete(x);
 }
 
 static inline void
 opi_unref(opi_t x)
 {
-  if (opi_dec_rc(x) == 0)
+  if (!opi_is_imm(x) && --x->rc == 0)
     opi_delete(x);
 }
 
@@ -527,21 +681,101 @@ opi_h6w();
 void
 opi_h6w_free(void *ptr);
 
+/*
+ * Slab allocator for small objects of arbitrary size.
+ *
+ * Requests are rounded up to a power of two (from 16 up to OPI_SLAB_MAX
+ * bytes) and served from per-thread free lists; larger ones go to malloc().
+ * The same size must be supplied to opi_free().
+ */
+#define OPI_SLAB_MIN_SHIFT 4
+#define OPI_SLAB_NCLASSES 5
+#define OPI_SLAB_MAX (1 << (OPI_SLAB_MIN_SHIFT + OPI_SLAB_NCLASSES - 1))
+
+void*
+opi_alloc(size_t size);
+
+void
+opi_free(void *ptr, size_t size);
+
+typedef struct OpiSlabStats_s {
+  size_t size; // cell size
+  size_t nslabs;
+  size_t nallocs;
+  size_t nfrees;
+} OpiSlabStats;
+
+/*
+ * Get statistics of the calling thread for each size class.
+ */
+void
+opi_slab_get_stats(OpiSlabStats stats[OPI_SLAB_NCLASSES]);
+
+/*
+ * Statistics of h2w/h6w cells.
+ */
+typedef struct OpiCellStats_s {
+  size_t nallocs;
+  size_t nfrees;
+  size_t live;
+  size_t peak; // maximal number of live cells
+  size_t nchunks; // pool chunks currently mapped
+} OpiCellStats;
+
+typedef struct OpiMemStats_s {
+  OpiCellStats h2w, h6w;
+  size_t nursery_chunks; // chunks of the nursery in use
+  OpiSlabStats slabs[OPI_SLAB_NCLASSES];
+} OpiMemStats;
+
+void
+opi_get_memstats(OpiMemStats *stats);
+
+/*
+ * Print memory statistics (and live cells of each type, if built with
+ * OPI_MEM_CENSUS).
+ */
+void
+opi_memstats_dump(FILE *out);
+
+/*
+ * Return unused memory to the OS: release empty pool chunks, free pages of
+ * unused nursery chunks and trim malloc heap.
+ *
+ * Return number of bytes released by pools and nursery.
+ */
+size_t
+opi_trim_memory(void);
+
 /* ==========================================================================
- * Reurcive scope
+ * Recursive scope
+ *
+ * Closures of a `let rec` refer to each other without owning references, so
+ * they are held together by a scope: a member whose RC drops to zero only
+ * drops out of the scope, and all members are destroyed together once every
+ * one of them has dropped out. Members refer to their scope by id stored in
+ * the cell header (OpiHeader.meta).
+ *
+ * A member that has dropped out can only be resurrected after a sibling loads
+ * it from its captures, which marks it as a suspect. So once every member has
+ * dropped out, only the suspects are checked for being alive again.
  */
 typedef struct OpiRecNode_s {
   opi_t val;
   void (*destroy)(opi_t);
   void (*free)(opi_t);
+  int dropped;
+  int suspect;
+  size_t next_suspect; // index + 1 of the next suspect, 0 at the end
 } OpiRecNode;
 
 typedef struct OpiRecScp_s OpiRecScp;
 struct OpiRecScp_s {
-  size_t id;
+  uint32_t id;
   OpiRecScp *next;
 
-  size_t rc;
+  size_t rc; // number of members that have not dropped out
+  size_t suspects; // index + 1 of the first suspect, 0 if none
   size_t n;
   OpiRecNode *nodes;
 };
@@ -555,6 +789,12 @@ opi_rec_scp_cleanup(void);
 OpiRecScp*
 opi_rec_scp_alloc(size_t size);
 
+void
+opi_rec_scp_free(OpiRecScp *scp);
+
+OpiRecScp*
+opi_rec_scp_from_id(uint32_t id);
+
 static inline void
 opi_rec_scp_set(OpiRecScp *restrict scp, size_t i, opi_t val,
     void (*destroy)(opi_t), void (*free)(opi_t))
@@ -562,6 +802,9 @@ opi_rec_scp_set(OpiRecScp *restrict scp, size_t i, opi_t val,
   scp->nodes[i].val = val;
   scp->nodes[i].destroy = destroy;
   scp->nodes[i].free = free;
+  scp->nodes[i].dropped = FALSE;
+  scp->nodes[i].suspect = FALSE;
+  val->meta = scp->id;
 }
 
 static inline void
@@ -572,8 +815,36 @@ opi_rec_scp_finalize(OpiRecScp *restrict scp)
   scp->rc = scp->n;
 }
 
-OpiRecScp*
-opi_rec_scp_from_id(uint32_t id);
+static inline int
+opi_is_rec_sibling(opi_t x, opi_t y)
+{
+  return !opi_is_imm(y) && y->type == x->type && x->meta != OPI_META_NONE &&
+         x->meta == y->meta;
+}
+
+/*
+ * Called when RC of the i-th member drops to zero.
+ *
+ * Return TRUE if the whole scope is dead, then it is to be destroyed with
+ * opi_rec_scp_destroy().
+ */
+int
+opi_rec_scp_dropout(OpiRecScp *scp, size_t i);
+
+/*
+ * Called when the i-th member is loaded from captures of a sibling while its
+ * RC is zero.
+ */
+void
+opi_rec_scp_suspect(OpiRecScp *scp, size_t i);
+
+/*
+ * Destroy and free all members of a dead scope, and the scope itself.
+ * <queued> is the member the scope was put in the free queue as (it is
+ * already counted out of the census).
+ */
+void
+opi_rec_scp_destroy(OpiRecScp *scp, opi_t queued);
 
 /* ==========================================================================
  * Stack
@@ -594,16 +865,48 @@ static inline opi_t
 opi_get(size_t offs)
 { return *(opi_sp - offs); }
 
+/*
+ * Check if @n more entries can be pushed.
+ */
+static inline int
+opi_stack_fits(size_t n)
+{ return opi_sp + n <= opi_stack_limit; }
+
+/*
+ * Drop @nargs arguments from the stack and return `stack-overflow` error.
+ */
+opi_t
+opi_stack_overflow(size_t nargs);
+
+/*
+ * Map @size bytes for a stack followed by a guard page. Pages are committed on
+ * first use. Total size of the mapping is returned via @mapsize.
+ */
+void*
+opi_stack_map(size_t size, size_t *mapsize);
+
 /* ==========================================================================
- * Num
+ * Numbers
+ *
+ * Int is a fixed-width integer: an immediate, or a boxed intmax_t outside of
+ * the immediate range. Float is a boxed double.
+ *
+ * Arithmetic on two Ints stays in integers (wrapping on overflow), except for
+ * division and remainder which yield a Float when the result is not integral.
+ * Any Float operand turns the whole operation into floating point.
  */
-struct OpiNum_s {
+struct OpiInt_s {
   OpiHeader header;
-  long double val;
+  intmax_t val;
+};
+
+struct OpiFloat_s {
+  OpiHeader header;
+  double val;
 };
 
 OPI_EXTERN opi_type_t
-opi_num_type;
+opi_float_type;
 
 void
 opi_num_init(void);
@@ -612,17 +915,117 @@ void
 opi_num_cleanup(void);
 
 static inline opi_t __attribute__((hot, flatten))
-opi_num_new(long double x)
+opi_int_new(intmax_t x)
 {
-  OpiNum *num = (OpiNum*)opi_h2w();
-  opi_init_cell(num, opi_num_type);
+  if (opi_likely(x >= OPI_IMM_MIN && x <= OPI_IMM_MAX))
+    return opi_imm_new(x);
+  OpiInt *num = (OpiInt*)opi_h2w();
+  opi_init_cell(num, opi_int_type);
   num->val = x;
   return (opi_t)num;
 }
 
-static inline long double __attribute__((hot, always_inline))
+static inline intmax_t __attribute__((hot, always_inline))
+opi_int_get_value(opi_t cell)
+{
+  if (opi_is_imm(cell))
+    return opi_imm_get_value(cell);
+  return opi_as(cell, OpiInt).val;
+}
+
+static inline opi_t __attribute__((hot, flatten))
+opi_float_new(double x)
+{
+  OpiFloat *num = (OpiFloat*)opi_h2w();
+  opi_init_cell(num, opi_float_type);
+  num->val = x;
+  return (opi_t)num;
+}
+
+static inline double __attribute__((hot, always_inline))
+opi_float_get_value(opi_t cell)
+{ return opi_as(cell, OpiFloat).val; }
+
+static inline int __attribute__((always_inline))
+opi_is_int(opi_t x)
+{ return opi_is_imm(x) || x->type == opi_int_type; }
+
+static inline int __attribute__((always_inline))
+opi_is_num(opi_t x)
+{ return opi_is_imm(x) || x->type == opi_int_type || x->type == opi_float_type; }
+
+/*
+ * Get value of Int or Float as a double.
+ */
+static inline double __attribute__((hot, always_inline))
 opi_num_get_value(opi_t cell)
-{ return opi_as(cell, OpiNum).val; }
+{
+  if (opi_is_int(cell))
+    return opi_int_get_value(cell);
+  return opi_float_get_value(cell);
+}
+
+/*
+ * Parse number literal: Int if it has neither fraction nor exponent (and fits
+ * into intmax_t), Float otherwise.
+ *
+ * Return NULL if no number was parsed.
+ */
+opi_t
+opi_num_parse(const char *str, char **endptr);
+
+/*
+ * Arithmetic on numbers. Both arguments must be Int or Float.
+ */
+static inline opi_t __attribute__((hot))
+opi_num_add(opi_t x, opi_t y)
+{
+  if (opi_is_int(x) & opi_is_int(y))
+    return opi_int_new((uintmax_t)opi_int_get_value(x) + (uintmax_t)opi_int_get_value(y));
+  return opi_float_new(opi_num_get_value(x) + opi_num_get_value(y));
+}
+
+static inline opi_t __attribute__((hot))
+opi_num_sub(opi_t x, opi_t y)
+{
+  if (opi_is_int(x) & opi_is_int(y))
+    return opi_int_new((uintmax_t)opi_int_get_value(x) - (uintmax_t)opi_int_get_value(y));
+  return opi_float_new(opi_num_get_value(x) - opi_num_get_value(y));
+}
+
+static inline opi_t __attribute__((hot))
+opi_num_mul(opi_t x, opi_t y)
+{
+  if (opi_is_int(x) & opi_is_int(y))
+    return opi_int_new((uintmax_t)opi_int_get_value(x) * (uintmax_t)opi_int_get_value(y));
+  return opi_float_new(opi_num_get_value(x) * opi_num_get_value(y));
+}
+
+static inline opi_t __attribute__((hot))
+opi_num_div(opi_t x, opi_t y)
+{
+  if (opi_is_int(x) & opi_is_int(y)) {
+    intmax_t a = opi_int_get_value(x);
+    intmax_t b = opi_int_get_value(y);
+    if (b != 0 && !(b == -1 && a == INTMAX_MIN) && a % b == 0)
+      return opi_int_new(a / b);
+  }
+  return opi_float_new(opi_num_get_value(x) / opi_num_get_value(y));
+}
+
+static inline opi_t __attribute__((hot))
+opi_num_mod(opi_t x, opi_t y)
+{
+  if (opi_is_int(x) & opi_is_int(y)) {
+    intmax_t a = opi_int_get_value(x);
+    intmax_t b = opi_int_get_value(y);
+    if (b == -1)
+      return opi_int_new(0);
+    if (b != 0)
+      return opi_int_new(a % b);
+  }
+  return opi_float_new(fmod(opi_num_get_value(x), opi_num_get_value(y)));
+}
 
 /* ==========================================================================
  * Symbol
@@ -720,6 +1123,17 @@ opi_str_drain_with_len(char *str, size_t len);
 opi_t
 opi_str_from_char(char c);
 
+/*
+ * Get the unique string with the same contents, registering `str` as such if
+ * there is none yet. Two interned strings are compared by address. The table
+ * of interned strings does not keep them alive: a string leaves it when
+ * deleted.
+ */
+opi_t
+opi_str_intern(opi_t str);
+
+#define OPI_STR_INTERNED 1 // OpiHeader.meta of interned strings
+
 static inline const char* __attribute__((pure, deprecated))
 opi_str_get_value(opi_t x)
 { return opi_as(x, OpiStr).str; }
@@ -786,12 +1200,29 @@ opi_pair_init(void);
 void
 opi_pair_cleanup(void);
 
+/*
+ * Set fields of a pair. Also used to reuse a live pair in place (which is
+ * then not counted by the census once more).
+ */
 static inline void
-_opi_cons_at(opi_t car, opi_t cdr, OpiPair *p)
+_opi_pair_set(opi_t car, opi_t cdr, OpiPair *p)
 {
   opi_inc_rc(p->car = car);
   opi_inc_rc(p->cdr = cdr);
+  // count the list as it is built (see opi_length())
+  if (opi_typeof(cdr) != opi_pair_type)
+    p->header.meta = 1;
+  else if (opi_likely(cdr->meta < OPI_META_NONE - 1))
+    p->header.meta = cdr->meta + 1;
+  else
+    p->header.meta = OPI_META_NONE;
+}
+
+static inline void
+_opi_cons_at(opi_t car, opi_t cdr, OpiPair *p)
+{
   opi_init_cell(p, opi_pair_type);
+  _opi_pair_set(car, cdr, p);
 }
 
 static inline opi_t
@@ -813,8 +1244,13 @@ opi_cdr(opi_t x)
 static inline __attribute__((pure)) size_t
 opi_length(opi_t x)
 {
+  if (opi_typeof(x) != opi_pair_type)
+    return 0;
+  if (opi_likely(x->meta != OPI_META_NONE))
+    return x->meta;
+
   size_t len = 0;
-  while (x->type == opi_pair_type) {
+  while (opi_typeof(x) == opi_pair_type) {
     len += 1;
     x = opi_cdr(x);
   }
@@ -836,6 +1272,20 @@ opi_table_cleanup(void);
 opi_t
 opi_table(opi_t l, int replace);
 
+/*
+ * Create table backed by a persistent hash trie: copies of such a table share
+ * structure, so updating a shared table costs O(log n) instead of rehashing
+ * every entry.
+ */
+opi_t
+opi_table_persistent(opi_t l, int replace);
+
+int
+opi_table_is_persistent(opi_t tab);
+
+size_t
+opi_table_size(opi_t tab);
+
 opi_t
 opi_table_at(opi_t tab, opi_t key, opi_t *err);
 
@@ -845,6 +1295,9 @@ opi_table_pairs(opi_t tab);
 int
 opi_table_insert(opi_t tab, opi_t pair, int replace, opi_t *err);
 
+int
+opi_table_remove(opi_t tab, opi_t key, opi_t *err);
+
 opi_t
 opi_table_copy(opi_t tab);
 
@@ -924,6 +1377,8 @@ static inline opi_t
 opi_fn_apply(opi_t cell, size_t nargs)
 {
   OpiFn *fn = (OpiFn*)cell;
+  if (opi_unlikely(opi_sp > opi_stack_limit))
+    return opi_stack_overflow(nargs);
   opi_nargs = nargs;
   opi_current_fn = OPI_FN(cell);
   return fn->handle();
@@ -1019,25 +1474,69 @@ typedef struct OpiSeqCfg_s {
   opi_t    (* next )(OpiIter *iter);
   OpiIter* (* copy )(OpiIter *iter);
   void     (* dtor )(OpiIter *iter);
+  // Optional: store up to n next elements in out and return their number
+  // (zero at the end). An error (undefined) is always the last element.
+  size_t   (* next_batch )(OpiIter *iter, opi_t *out, size_t n);
 } OpiSeqCfg;
 
+// number of elements pulled at once by consumers draining a sequence
+#ifndef OPI_SEQ_BATCH
+# define OPI_SEQ_BATCH 256
+#endif
+
+// don't bother trimming caches shorter than this
+#ifndef OPI_SEQ_TRIM_MIN
+# define OPI_SEQ_TRIM_MIN 0x100
+#endif
+
+/*
+ * Elements produced by an iterator, shared by all copies of a sequence.
+ *
+ * The array holds a sliding window of the stream starting at element number
+ * base: once it grows to trim_at elements, the ones consumed by every copy are
+ * released (see opi_seq_cache_trim()). So copies consumed at different speeds
+ * only keep the elements between the slowest and the fastest one.
+ *
+ * Elements are handed out borrowed: ones returned by the last call to
+ * opi_seq_next() or opi_seq_next_batch() on a copy are kept until the next
+ * call on that copy, even if other copies have consumed them.
+ *
+ * Iterator methods are kept here as well: all the copies use the same ones,
+ * and it keeps OpiSeq small enough for an H6w cell.
+ */
 typedef struct OpiSeqCache_s {
   size_t rc;
+  OpiSeqCfg cfg;
   opi_t arr;
   uint32_t end_cnt;
+  uint32_t base; // number of the first element in arr
+  size_t trim_at;
+  OpiSeq *seqs; // copies using the cache
 } OpiSeqCache;
 
 static inline OpiSeqCache*
 opi_seq_cache_new(opi_t arr, int end_cnt)
 {
-  OpiSeqCache *cache = opi_h2w();
+  OpiSeqCache *cache = opi_alloc(sizeof(OpiSeqCache));
   cache->arr = arr;
   opi_inc_rc(arr);
   cache->end_cnt = (uint32_t)end_cnt;
+  cache->base = 0;
+  cache->trim_at = OPI_SEQ_TRIM_MIN;
+  cache->seqs = NULL;
   cache->rc = 0;
   return cache;
 }
 
+/*
+ * Release elements consumed by all copies.
+ *
+ * Note: references to the cache other than from the copies (e.g. taken by
+ * opi_seq_force()) pin the whole array.
+ */
+void
+opi_seq_cache_trim(OpiSeqCache *cache);
+
 static inline void
 opi_seq_cache_ref(OpiSeqCache *cache)
 { cache->rc += 1; }
@@ -1052,16 +1551,17 @@ opi_seq_cache_unref(OpiSeqCache *cache)
 {
   if (--cache->rc == 0) {
     opi_unref(cache->arr);
-    opi_h2w_free(cache);
+    opi_free(cache, sizeof(OpiSeqCache));
   }
 }
 
 struct OpiSeq_s {
   OpiHeader header;
   OpiIter *restrict iter;
-  OpiSeqCfg cfg;
   OpiSeqCache *cache;
+  OpiSeq *cprev, *cnext; // other copies using the cache
   uint32_t cnt;
+  uint32_t held; // first element returned by the last call
   int32_t is_free;
 };
 
@@ -1086,22 +1586,25 @@ opi_seq_next(opi_t x)
 {
   OpiSeq *seq = (OpiSeq*)x;
 
+  seq->held = seq->cnt;
   if (opi_unlikely(seq->cnt == seq->cache->end_cnt))
     return NULL;
 
   opi_t arr = seq->cache->arr;
-  if (seq->cnt < OPI_ARRAY(arr)->len) {
+  size_t i = seq->cnt - seq->cache->base;
+  if (i < OPI_ARRAY(arr)->len) {
     /*
      * Get element from cache.
      */
-    opi_t elt = OPI_ARRAY(arr)->data[seq->cnt++];
+    opi_t elt = OPI_ARRAY(arr)->data[i];
+    seq->cnt++;
     return elt;
 
   } else {
     /*
      * Evaluate handle.
      */
-    opi_t elt = seq->cfg.next(seq->iter);
+    opi_t elt = seq->cache->cfg.next(seq->iter);
     if (opi_unlikely(elt == NULL)) {
       seq->cache->end_cnt = seq->cnt;
       return NULL;
@@ -1113,22 +1616,45 @@ opi_seq_next(opi_t x)
     int is_free = seq->is_free;
     if (!is_free) {
       is_free = seq->cache->rc == 1;
-      if (!is_free)
+      if (!is_free) {
         opi_array_push(arr, elt);
-      else
+        if (opi_unlikely(OPI_ARRAY(arr)->len >= seq->cache->trim_at))
+          opi_seq_cache_trim(seq->cache);
+      } else {
         seq->is_free = TRUE;
+      }
     } else {
       assert(seq->cache->rc == 1);
     }
     return elt;
   }
 
-  return seq->cfg.next(seq->iter);
+  return seq->cache->cfg.next(seq->iter);
 }
 
 opi_t
 opi_seq_copy(opi_t x);
 
+/*
+ * Get up to @n next elements of the sequence (at least one unless it has
+ * ended). Elements are produced in blocks only if the iterator implements
+ * next_batch; otherwise, this is a single opi_seq_next().
+ *
+ * Return number of elements stored in @out.
+ */
+size_t
+opi_seq_next_batch(opi_t x, opi_t *out, size_t n);
+
+/*
+ * Take iterator out of the sequence if no one else can observe it, i.e. the
+ * sequence and its cache are not shared and there are no cached elements
+ * ahead. On success, the (only) reference to the sequence is released.
+ *
+ * Return TRUE on success, FALSE otherwise.
+ */
+int
+opi_seq_steal(opi_t x, OpiIter **iter, OpiSeqCfg *cfg);
+
 /*
  * Evaluate full sequence.
  *
@@ -1165,12 +1691,51 @@ OpiBuffer*
 opi_buffer_new(void *ptr, size_t size, void (*free)(void* ptr,void* c), void *c);
 static void OPI_BUFFER_FREE(void *ptr, void *c) { free(ptr); }
 
+/* ==========================================================================
+ * Cycle collector
+ *
+ * Reference cycles can only be built by mutation, i.e. through Var cells. Vars
+ * assigned by opi_var_set() are recorded as candidate roots, and
+ * opi_collect_cycles() runs trial deletion over the cells reachable from them:
+ * references from inside this subgraph are subtracted from RCs, and whatever
+ * is not reachable from a cell with remaining (external) references is
+ * garbage. Such cycles are broken by clearing the Vars in them.
+ *
+ * Cells with RC of zero are considered to be referenced externally (from
+ * registers of the VM).
+ */
+#ifdef OPI_CYCLE_COLLECTOR
+#define OPI_GCIDX_NONE SIZE_MAX
+
+void
+opi_cycles_init(void);
+
+void
+opi_cycles_cleanup(void);
+
+void
+opi_cycles_track(opi_t var);
+
+void
+opi_cycles_untrack(opi_t var);
+#endif
+
+/*
+ * Return number of cells found in garbage cycles (always zero if built without
+ * OPI_CYCLE_COLLECTOR).
+ */
+size_t
+opi_collect_cycles(void);
+
 /* ==========================================================================
  * Mutable Variable
  */
 struct OpiVar_s {
   OpiHeader header;
   opi_t val;
+#ifdef OPI_CYCLE_COLLECTOR
+  size_t gcidx; // index among candidate roots of the cycle collector
+#endif
 };
 
 OPI_EXTERN
@@ -1188,6 +1753,9 @@ opi_var_new(opi_t x)
   OpiVar *var = opi_h2w();
   var->val = x;
   opi_inc_rc(x);
+#ifdef OPI_CYCLE_COLLECTOR
+  var->gcidx = OPI_GCIDX_NONE;
+#endif
   opi_init_cell(var, opi_var_type);
   return OPI(var);
 }
@@ -1198,6 +1766,10 @@ opi_var_set(opi_t var, opi_t x)
   opi_inc_rc(x);
   opi_unref(OPI_VAR(var)->val);
   OPI_VAR(var)->val = x;
+#ifdef OPI_CYCLE_COLLECTOR
+  if (!opi_is_imm(x) && OPI_VAR(var)->gcidx == OPI_GCIDX_NONE)
+    opi_cycles_track(var);
+#endif
 }
 
 /* ==========================================================================
@@ -1223,6 +1795,7 @@ typedef enum OpiAstTag_e {
   OPI_AST_ISOF,
   OPI_AST_CTOR,
   OPI_AST_SETVAR,
+  OPI_AST_YIELD,
 } OpiAstTag;
 
 typedef enum OpiPatternTag_e {
@@ -1386,6 +1959,9 @@ opi_ast_when(OpiAst *test_expr,
 OpiAst*
 opi_ast_return(OpiAst *val);
 
+OpiAst*
+opi_ast_yield(OpiAst *val);
+
 OpiAst*
 opi_ast_binop(int opc, OpiAst *lhs, OpiAst *rhs);
 
@@ -1478,6 +2054,7 @@ struct OpiBuilder_s {
   int frame_offset;
   cod_vec(OpiDecl) decls;
   OpiAlist *alist;
+  int is_generator; // function body contains yield
 
   struct cod_strvec *srcdirs;
   struct cod_strvec *loaded;
@@ -1577,6 +2154,7 @@ typedef enum OpiIrTag_e {
   OPI_IR_RETURN,
   OPI_IR_BINOP,
   OPI_IR_SETVAR,
+  OPI_IR_YIELD,
 } OpiIrTag;
 
 typedef struct OpiIrPattern_s OpiIrPattern;
@@ -1607,7 +2185,7 @@ struct OpiIr_s {
     opi_t cnst;
     size_t var;
     struct { OpiIr *fn, **args; size_t nargs; char eflag; OpiLocation *loc; } apply;
-    struct { OpiIr **caps; size_t ncaps, nargs; OpiIr *body; } fn;
+    struct { OpiIr **caps; size_t ncaps, nargs; OpiIr *body; int is_generator; } fn;
     struct { OpiIr **vals; size_t n; int is_vars; } let;
     struct { OpiIr *test, *then, *els; } iff;
     struct { OpiIr **exprs; size_t n; int drop; } block;
@@ -1683,7 +2261,7 @@ void
 opi_ir_emit(OpiIr *ir, OpiBytecode *bc);
 
 OpiBytecode*
-opi_emit_free_fn_body(OpiIr *ir, int nargs);
+opi_emit_free_fn_body(OpiIr *ir, int nargs, int is_generator);
 
 OpiIr*
 opi_ir_const(opi_t x);
@@ -1719,6 +2297,9 @@ opi_ir_match(OpiIrPattern *pattern, OpiIr *expr, OpiIr *then, OpiIr *els);
 OpiIr*
 opi_ir_return(OpiIr *val);
 
+OpiIr*
+opi_ir_yield(OpiIr *val);
+
 OpiIr*
 opi_ir_binop(int opc, OpiIr *lhs, OpiIr *rhs);
 
@@ -1747,6 +2328,13 @@ typedef enum OpiOpc_e {
   OPI_OPC_RET,
 #define OPI_RET_REG_VAL(insn) (insn)->reg[0]
 
+  // suspend generator; lives are the counted values to release if it is
+  // never resumed (see opi_bytecode_yield_lives())
+  OPI_OPC_YIELD,
+#define OPI_YIELD_REG_VAL(insn) (insn)->reg[0]
+#define OPI_YIELD_ARG_NLIVES(insn) (insn)->reg[1]
+#define OPI_YIELD_ARG_LIVES(insn) (insn)->ptr[2]
+
   OPI_OPC_PUSH,
 #define OPI_PUSH_REG_VAL(insn) (insn)->reg[0]
 
@@ -1822,7 +2410,12 @@ typedef enum OpiOpc_e {
   OPI_OPC_CONS = OPI_OPC_BINOP_START,
   OPI_OPC_ADD, OPI_OPC_SUB, OPI_OPC_MUL, OPI_OPC_DIV, OPI_OPC_FMOD,
   OPI_OPC_NUMEQ, OPI_OPC_NUMNE, OPI_OPC_LT, OPI_OPC_GT, OPI_OPC_LE, OPI_OPC_GE,
-  OPI_OPC_BINOP_END = OPI_OPC_GE,
+  // Same operators for operands statically known to be numbers (no type
+  // checks, no trait dispatch). Keep in the same order as above.
+  OPI_OPC_ADD_NN, OPI_OPC_SUB_NN, OPI_OPC_MUL_NN, OPI_OPC_DIV_NN, OPI_OPC_FMOD_NN,
+  OPI_OPC_NUMEQ_NN, OPI_OPC_NUMNE_NN, OPI_OPC_LT_NN, OPI_OPC_GT_NN, OPI_OPC_LE_NN,
+  OPI_OPC_GE_NN,
+  OPI_OPC_BINOP_END = OPI_OPC_GE_NN,
 #define OPI_BINOP_REG_OUT(insn) (insn)->reg[0]
 #define OPI_BINOP_REG_LHS(insn) (insn)->reg[1]
 #define OPI_BINOP_REG_RHS(insn) (insn)->reg[2]
@@ -1840,14 +2433,35 @@ typedef enum OpiOpc_e {
   OPI_OPC_DEREF,
 #define OPI_DEREF_REG_OUT(insn) (insn)->reg[0]
 #define OPI_DEREF_REG_VAR(insn) (insn)->reg[1]
+
+  /* Superinstructions (created by opi_bytecode_fuse()). */
+  // CONST + PUSH of the same value; uses OPI_CONST_* accessors
+  OPI_OPC_CONSTPUSH,
+  // PARAM + INCRC of the same value; uses OPI_PARAM_* accessors
+  OPI_OPC_PARAMRC,
+  // APPLY + INCRC of the result; uses OPI_APPLY_* accessors
+  OPI_OPC_APPLYRC,
+  // DECRC + PUSH of the same value; uses OPI_PUSH_* accessors
+  OPI_OPC_DECPUSH,
+  // TESTTY + IF on the test result
+  OPI_OPC_TESTTYIF,
+#define OPI_TESTTYIF_REG_CELL(insn) (insn)->reg[0]
+#define OPI_TESTTYIF_ARG_ELSE(insn) (insn)->ptr[1]
+#define OPI_TESTTYIF_ARG_TYPE(insn) (insn)->ptr[2]
 } OpiOpc;
 
+// total number of opcodes (keep in sync with the last opcode)
+#define OPI_OPC_COUNT (OPI_OPC_TESTTYIF + 1)
+
 typedef struct OpiFlatInsn_s {
   OpiOpc opc;
   union {
     uintptr_t reg[3];
     void *restrict ptr[3];
   };
+#ifdef OPI_THREADED_DISPATCH
+  const void *label; // address of the handler inside opi_vm()
+#endif
 } OpiFlatInsn;
 
 struct OpiInsn_s {
@@ -1909,6 +2523,9 @@ opi_insn_applyi(int ret, int fn, size_t nargs);
 OpiInsn*
 opi_insn_ret(int val);
 
+OpiInsn*
+opi_insn_yield(int val);
+
 OpiInsn*
 opi_insn_push(int val);
 
@@ -2008,6 +2625,7 @@ typedef struct OpiValInfo_s {
   OpiInsn *creatat; // isntruction created the value
   int is_var; // weather the value is a mutable variable
   opi_type_t vtype;
+  int is_num; // value is known to be a number (either Int or Float)
 } OpiValInfo;
 
 struct OpiBytecode_s {
@@ -2019,7 +2637,11 @@ struct OpiBytecode_s {
   OpiInsn *tail;
   OpiInsn *point;
   OpiFlatInsn *tape;
+  OpiTraitCache *tcache; // inline caches for trait dispatch (allocated lazily)
   int is_generator;
+  size_t nfused; // number of superinstructions created by opi_bytecode_fuse()
+  size_t ncalls; // number of calls (used to trigger JIT)
+  void *jit; // native code (NULL if not compiled)
 };
 
 OpiBytecode*
@@ -2037,14 +2659,30 @@ opi_bytecode_fix_lifetimes(OpiBytecode *bc);
 void
 opi_bytecode_cleanup(OpiBytecode *bc);
 
+void
+opi_bytecode_yield_lives(OpiBytecode *bc);
+
+size_t
+opi_bytecode_fuse(OpiBytecode *bc);
+
 OpiFlatInsn*
 opi_bytecode_flatten(OpiBytecode *bc);
 
+/*
+ * Get inline caches of the instruction on the tape: [0] for dispatch by the
+ * first argument and [1] for dispatch by the second one.
+ */
+OpiTraitCache*
+opi_bytecode_get_trait_cache(OpiBytecode *bc, const OpiFlatInsn *ip);
+
 static void
 opi_bytecode_finalize(OpiBytecode *bc)
 {
   opi_bytecode_fix_lifetimes(bc);
   opi_bytecode_cleanup(bc);
+  if (bc->is_generator)
+    opi_bytecode_yield_lives(bc);
+  opi_bytecode_fuse(bc);
   bc->tape = opi_bytecode_flatten(bc);
 }
 
@@ -2059,6 +2697,13 @@ static inline int
 opi_bytecode_value_is_global(OpiBytecode *bc, int vid)
 { return bc->vinfo[vid].type == OPI_VAL_GLOBAL; }
 
+static inline int
+opi_bytecode_value_is_num(OpiBytecode *bc, int vid)
+{
+  opi_type_t ty = bc->vinfo[vid].vtype;
+  return bc->vinfo[vid].is_num || ty == opi_int_type || ty == opi_float_type;
+}
+
 void
 opi_bytecode_set_vtype(OpiBytecode *bc, int vid, opi_type_t type);
 
@@ -2098,6 +2743,9 @@ opi_bytecode_applyi_arr(OpiBytecode *bc, int fn, size_t nargs, const int *args);
 void
 opi_bytecode_ret(OpiBytecode *bc, int val);
 
+void
+opi_bytecode_yield(OpiBytecode *bc, int val);
+
 void
 opi_bytecode_push(OpiBytecode *bc, int val);
 
@@ -2183,13 +2831,92 @@ opi_bytecode_deref(OpiBytecode *bc, int var);
 
 /* ==========================================================================
  * VM and evaluation
+ *
+ * Registers of all activations of the VM live on a common register stack.
+ * With OPI_FRAME_STACK, calls of lambdas from the bytecode push a frame onto
+ * the VM frame stack and continue in the same activation instead of recursing
+ * in C, so depth of recursion is only limited by OPI_VM_NFRAMES.
  */
+#ifndef OPI_VM_NREGS
+# define OPI_VM_NREGS 0x400000
+#endif
+#ifndef OPI_VM_NFRAMES
+# define OPI_VM_NFRAMES 0x100000
+#endif
+
+void
+opi_vm_init(void);
+
+void
+opi_vm_cleanup(void);
+
 opi_t
 opi_vm(OpiBytecode *bc);
 
+/*
+ * Run generator body with registers regs (bc->nvals of them) starting after
+ * the YIELD *ip (or from the beginning if it is NULL).
+ *
+ * On YIELD, store the instruction in *ip and return the yielded value; on
+ * return from the body, set *ip to NULL.
+ */
+opi_t
+opi_vm_resume(OpiBytecode *bc, opi_t *regs, OpiFlatInsn **ip);
+
+#ifdef OPI_THREADED_DISPATCH
+const void*
+opi_vm_label(OpiOpc opc);
+#endif
+
 opi_t
 opi_apply_partial(opi_t f, int nargs);
 
+/* ==========================================================================
+ * JIT
+ */
+#ifdef OPI_USE_LIBJIT
+// number of calls after which a function is compiled
+#ifndef OPI_JIT_THRESHOLD
+# define OPI_JIT_THRESHOLD 0x100
+#endif
+
+/*
+ * Marker returned by compiled code to request a tail call of
+ * opi_current_fn (see opi_lambda_fn()).
+ */
+OPI_EXTERN
+opi_t opi_jit_tailcall;
+
+void
+opi_jit_init(void);
+
+void
+opi_jit_cleanup(void);
+
+/*
+ * Compile bytecode into native code and store it in bc->jit.
+ *
+ * Return TRUE on success, FALSE otherwise.
+ */
+int
+opi_jit_compile(OpiBytecode *bc);
+
+/*
+ * Count a call of the function and compile it once it becomes hot.
+ *
+ * Return TRUE if native code is available.
+ */
+static inline int
+opi_jit_ready(OpiBytecode *bc)
+{
+  if (bc->jit)
+    return TRUE;
+  if (opi_likely(++bc->ncalls != OPI_JIT_THRESHOLD))
+    return FALSE;
+  return opi_jit_compile(bc);
+}
+#endif
+
 /*
  * Function application.
  *
@@ -2228,12 +2955,20 @@ opi_apply(opi_t f, size_t nargs)
     return opi_undefined(opi_symbol(error_string)); \
   } while (0)
 
-#define OPI_ARG(ident, arg_type)                           \
-  opi_assert(opi_this.iarg < opi_this.nargs);              \
-  opi_t ident = opi_this_arg[opi_this.iarg++];             \
-  if (arg_type && opi_unlikely(ident->type != arg_type)) { \
-    OPI_UNREF_ARGS()                                       \
-    OPI_THROW("type-error");                               \
+#define OPI_ARG(ident, arg_type)                                 \
+  opi_assert(opi_this.iarg < opi_this.nargs);                    \
+  opi_t ident = opi_this_arg[opi_this.iarg++];                   \
+  if (arg_type && opi_unlikely(opi_typeof(ident) != arg_type)) { \
+    OPI_UNREF_ARGS()                                             \
+    OPI_THROW("type-error");                                     \
+  }
+
+#define OPI_NUM_ARG(ident)                                       \
+  opi_assert(opi_this.iarg < opi_this.nargs);                    \
+  opi_t ident = opi_this_arg[opi_this.iarg++];                   \
+  if (opi_unlikely(!opi_is_num(ident))) {                        \
+    OPI_UNREF_ARGS()                                             \
+    OPI_THROW("type-error");                                     \
   }
 
 #define OPI_RETURN(return_value)             \
@@ -2266,6 +3001,7 @@ opi_drop_args(int nargs)
   }
 
 #define opi_arg OPI_ARG
+#define opi_num_arg OPI_NUM_ARG
 #define opi_throw OPI_THROW
 #define opi_return OPI_RETURN
 
@@ -72,6 +72,8 @@ help_and_exit(char *argv0, int err)
   fprintf(stderr, "          -I  <path>  Add path to the list of directories to be searched for\n");
   fprintf(stderr, "                      imported files.\n");
   fprintf(stderr, "  --show-bytecode     Show final bytecode.\n");
+  fprintf(stderr, "  --memstats          Print memory statistics on exit.\n");
+  fprintf(stderr, "  --siphash           Hash strings with SipHash (for untrusted input).\n");
   exit(err);
 }
 
@@ -82,6 +84,8 @@ main(int argc, char **argv, char **env)
   cod_strvec_init(&srcdirs);
   int show_bytecode = FALSE;
   int use_base = TRUE;
+  int show_memstats = FALSE;
+  int init_flags = OPI_INIT_DEFAULT;
 
   char *opium_path = getenv("OPIUM_PATH");
   if (opium_path)
@@ -91,6 +95,8 @@ main(int argc, char **argv, char **env)
     { "help", FALSE, NULL, 'h' },
     { "show-bytecode", FALSE, NULL, 0x01 },
     { "no-base", FALSE, NULL, 0x02 },
+    { "memstats", FALSE, NULL, 0x03 },
+    { "siphash", FALSE, NULL, 0x04 },
     { 0, 0, 0, 0 }
   };
   int opt;
@@ -111,6 +117,14 @@ main(int argc, char **argv, char **env)
         use_base = FALSE;
         break;
 
+      case 0x03:
+        show_memstats = TRUE;
+        break;
+
+      case 0x04:
+        init_flags |= OPI_INIT_SIPHASH;
+        break;
+
       default:
         help_and_exit(argv[0], EXIT_FAILURE);
     }
@@ -133,7 +147,7 @@ main(int argc, char **argv, char **env)
   opi_assert(dir);
 
   /*opi_debug("initialize environment\n");*/
-  opi_init(OPI_INIT_DEFAULT);
+  opi_init(init_flags);
 
   OpiContext ctx;
   opi_context_init(&ctx);
@@ -280,12 +294,12 @@ main(int argc, char **argv, char **env)
       }
 
       if (show_bytecode) {
-        opi_debug("bytecode:\n");
+        opi_debug("bytecode (fused %zu):\n", bc->nfused);
         opi_insn_dump(bc->head, stdout);
       }
 
       opi_t ret = opi_vm(bc);
-      if (ret->type == opi_undefined_type) {
+      if (opi_typeof(ret) == opi_undefined_type) {
         opi_error("unhandled error: ");
         opi_display(OPI_UNDEFINED(ret)->what, OPI_ERROR);
         putc('\n', OPI_ERROR);
@@ -323,12 +337,12 @@ main(int argc, char **argv, char **env)
       goto cleanup;
 
     if (show_bytecode) {
-      opi_debug("bytecode:\n");
+      opi_debug("bytecode (fused %zu):\n", bc->nfused);
       opi_insn_dump(bc->head, stdout);
     }
 
     opi_t ret = opi_vm(bc);
-    if (ret->type == opi_undefined_type) {
+    if (opi_typeof(ret) == opi_undefined_type) {
       opi_error("unhandled error: ");
       opi_display(OPI_UNDEFINED(ret)->what, OPI_ERROR);
       putc('\n', OPI_ERROR);
@@ -347,6 +361,9 @@ main(int argc, char **argv, char **env)
   }
 
 cleanup:
+  if (show_memstats)
+    opi_memstats_dump(stderr);
+
   opi_builder_destroy(&builder);
   opi_context_destroy(&ctx);
   opi_cleanup();
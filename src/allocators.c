@@ -1,56 +1,578 @@
 #include "opium/opium.h"
 #include <gc.h>
 
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#if !defined(OPI_DEBUG_MODE) && defined(OPI_NURSERY)
+/*
+ * Nursery.
+ *
+ * Cells are bump-allocated from fixed-size chunks of a single arena. Freeing
+ * a cell only decrements live-counter of its chunk, and the chunk is recycled
+ * once all its cells are dead. Cells are never moved, so a survivor pins its
+ * chunk; when there are no free chunks left, allocation falls back to pools.
+ */
+#define NURSERY_CHUNK_SIZE 0x4000
+#define NURSERY_NCHUNKS 0x100
+
+static struct {
+  char *base;
+  char *bump, *end;
+  int cur; // current chunk
+  int free; // list of free chunks (-1 if empty)
+  struct {
+    size_t live;
+    int next;
+  } chunks[NURSERY_NCHUNKS];
+} g_nursery;
+
+static void
+nursery_init(void)
+{
+  // mapped (rather than malloc'ed) to be page-aligned for madvise()
+  g_nursery.base = mmap(NULL, NURSERY_CHUNK_SIZE * NURSERY_NCHUNKS,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (g_nursery.base == MAP_FAILED)
+    opi_die("failed to allocate nursery (%s)", strerror(errno));
+  for (int i = 0; i < NURSERY_NCHUNKS; ++i) {
+    g_nursery.chunks[i].live = 0;
+    g_nursery.chunks[i].next = i + 1 < NURSERY_NCHUNKS ? i + 1 : -1;
+  }
+  g_nursery.cur = 0;
+  g_nursery.free = 1;
+  g_nursery.bump = g_nursery.base;
+  g_nursery.end = g_nursery.base + NURSERY_CHUNK_SIZE;
+}
+
+static size_t
+nursery_chunks_in_use(void)
+{
+  size_t n = NURSERY_NCHUNKS;
+  for (int c = g_nursery.free; c >= 0; c = g_nursery.chunks[c].next)
+    n -= 1;
+  return n;
+}
+
+static void
+nursery_destroy(void)
+{
+  munmap(g_nursery.base, NURSERY_CHUNK_SIZE * NURSERY_NCHUNKS);
+  g_nursery.base = NULL;
+}
+
+static size_t
+nursery_trim(void)
+{
+  size_t n = 0;
+  for (int c = g_nursery.free; c >= 0; c = g_nursery.chunks[c].next) {
+    madvise(g_nursery.base + NURSERY_CHUNK_SIZE * c, NURSERY_CHUNK_SIZE, MADV_DONTNEED);
+    n += 1;
+  }
+  return n * NURSERY_CHUNK_SIZE;
+}
+
+static int
+nursery_next_chunk(void)
+{
+  int c = g_nursery.free;
+  if (c < 0)
+    return FALSE;
+  g_nursery.free = g_nursery.chunks[c].next;
+  g_nursery.cur = c;
+  g_nursery.bump = g_nursery.base + NURSERY_CHUNK_SIZE * c;
+  g_nursery.end = g_nursery.bump + NURSERY_CHUNK_SIZE;
+  return TRUE;
+}
+
+static inline void*
+nursery_alloc(size_t size)
+{
+  if (opi_unlikely(g_nursery.bump + size > g_nursery.end)) {
+    if (!nursery_next_chunk())
+      return NULL;
+  }
+  void *ptr = g_nursery.bump;
+  g_nursery.bump += size;
+  g_nursery.chunks[g_nursery.cur].live += 1;
+  return ptr;
+}
+
+/*
+ * Return FALSE if pointer does not belong to the nursery.
+ */
+static inline int
+nursery_free(void *ptr)
+{
+  size_t offs = (char*)ptr - g_nursery.base;
+  if (offs >= NURSERY_CHUNK_SIZE * NURSERY_NCHUNKS)
+    return FALSE;
+  int c = offs / NURSERY_CHUNK_SIZE;
+  if (--g_nursery.chunks[c].live == 0) {
+    if (c == g_nursery.cur) {
+      // reuse current chunk from the start
+      g_nursery.bump = g_nursery.base + NURSERY_CHUNK_SIZE * c;
+    } else {
+      g_nursery.chunks[c].next = g_nursery.free;
+      g_nursery.free = c;
+    }
+  }
+  return TRUE;
+}
+#endif
+
+/*
+ * Pools.
+ *
+ * Cells of fixed size are allocated from aligned chunks, so that chunk of a
+ * cell is found by masking its address. Each chunk keeps its own free list
+ * and number of live cells. Chunks with free cells are linked into the pool;
+ * chunk that becomes empty is unmapped, except for one spare chunk per pool
+ * (released by opi_trim_memory()).
+ */
+#define POOL_CHUNK_SIZE 0x10000
+
+typedef struct PoolCell_s {
+  struct PoolCell_s *next;
+} PoolCell;
+
+typedef struct PoolChunk_s {
+  struct PoolChunk_s *prev, *next; // list of chunks with free cells
+  struct PoolChunk_s *all_prev, *all_next; // list of all chunks
+  PoolCell *free;
+  char *bump; // start of never used cells
+  size_t nlive;
+  int is_avail;
+} PoolChunk;
+
+#define POOL_CHUNK_HEADER ((sizeof(PoolChunk) + 0xF) & ~(size_t)0xF)
+
+typedef struct Pool_s {
+  size_t cellsize;
+  PoolChunk *avail;
+  PoolChunk *all;
+  size_t nempty; // number of empty chunks
+  OpiCellStats stats;
+} Pool;
+
+static PoolChunk*
+chunk_new(void)
+{
+  // over-allocate to align the chunk
+  size_t size = POOL_CHUNK_SIZE * 2;
+  char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    opi_die("failed to allocate memory (%s)", strerror(errno));
+  char *start = (char*)(((uintptr_t)mem + POOL_CHUNK_SIZE - 1) & ~(uintptr_t)(POOL_CHUNK_SIZE - 1));
+  if (start != mem)
+    munmap(mem, start - mem);
+  if (start + POOL_CHUNK_SIZE != mem + size)
+    munmap(start + POOL_CHUNK_SIZE, mem + size - start - POOL_CHUNK_SIZE);
+  return (PoolChunk*)start;
+}
+
+static inline PoolChunk*
+chunk_of(void *ptr)
+{ return (PoolChunk*)((uintptr_t)ptr & ~(uintptr_t)(POOL_CHUNK_SIZE - 1)); }
+
+static void
+pool_link_avail(Pool *pool, PoolChunk *chunk)
+{
+  chunk->prev = NULL;
+  chunk->next = pool->avail;
+  if (pool->avail)
+    pool->avail->prev = chunk;
+  pool->avail = chunk;
+  chunk->is_avail = TRUE;
+}
+
+static void
+pool_unlink_avail(Pool *pool, PoolChunk *chunk)
+{
+  if (chunk->prev)
+    chunk->prev->next = chunk->next;
+  else
+    pool->avail = chunk->next;
+  if (chunk->next)
+    chunk->next->prev = chunk->prev;
+  chunk->is_avail = FALSE;
+}
+
+static void
+pool_add_chunk(Pool *pool)
+{
+  PoolChunk *chunk = chunk_new();
+  chunk->free = NULL;
+  chunk->bump = (char*)chunk + POOL_CHUNK_HEADER;
+  chunk->nlive = 0;
+  chunk->all_prev = NULL;
+  chunk->all_next = pool->all;
+  if (pool->all)
+    pool->all->all_prev = chunk;
+  pool->all = chunk;
+  pool_link_avail(pool, chunk);
+  pool->nempty += 1;
+  pool->stats.nchunks += 1;
+}
+
+static void
+pool_release_chunk(Pool *pool, PoolChunk *chunk)
+{
+  opi_assert(chunk->nlive == 0);
+  if (chunk->is_avail)
+    pool_unlink_avail(pool, chunk);
+  if (chunk->all_prev)
+    chunk->all_prev->all_next = chunk->all_next;
+  else
+    pool->all = chunk->all_next;
+  if (chunk->all_next)
+    chunk->all_next->all_prev = chunk->all_prev;
+  munmap(chunk, POOL_CHUNK_SIZE);
+  pool->nempty -= 1;
+  pool->stats.nchunks -= 1;
+}
+
+static void
+pool_init(Pool *pool, size_t cellsize)
+{
+  pool->cellsize = cellsize;
+  pool->avail = NULL;
+  pool->all = NULL;
+  pool->nempty = 0;
+  memset(&pool->stats, 0, sizeof(OpiCellStats));
+}
+
+static void
+pool_destroy(Pool *pool)
+{
+  while (pool->all) {
+    PoolChunk *chunk = pool->all;
+    pool->all = chunk->all_next;
+    munmap(chunk, POOL_CHUNK_SIZE);
+  }
+  pool_init(pool, pool->cellsize);
+}
+
+/*
+ * Release all empty chunks.
+ */
+static size_t
+pool_trim(Pool *pool)
+{
+  size_t n = 0;
+  PoolChunk *chunk = pool->avail;
+  while (chunk) {
+    PoolChunk *next = chunk->next;
+    if (chunk->nlive == 0) {
+      pool_release_chunk(pool, chunk);
+      n += 1;
+    }
+    chunk = next;
+  }
+  return n;
+}
+
+static inline void*
+pool_alloc(Pool *pool)
+{
+  if (opi_unlikely(pool->avail == NULL))
+    pool_add_chunk(pool);
+
+  PoolChunk *chunk = pool->avail;
+  void *ptr;
+  if (chunk->free) {
+    ptr = chunk->free;
+    chunk->free = chunk->free->next;
+  } else {
+    ptr = chunk->bump;
+    chunk->bump += pool->cellsize;
+  }
+
+  if (chunk->nlive++ == 0)
+    pool->nempty -= 1;
+  if (chunk->free == NULL &&
+      chunk->bump + pool->cellsize > (char*)chunk + POOL_CHUNK_SIZE)
+    pool_unlink_avail(pool, chunk);
+  return ptr;
+}
+
+static inline void
+pool_free(Pool *pool, void *ptr)
+{
+  PoolChunk *chunk = chunk_of(ptr);
+  PoolCell *cell = ptr;
+  cell->next = chunk->free;
+  chunk->free = cell;
+
+  if (opi_unlikely(!chunk->is_avail))
+    pool_link_avail(pool, chunk);
+  if (opi_unlikely(--chunk->nlive == 0)) {
+    pool->nempty += 1;
+    // keep one spare chunk
+    if (pool->nempty > 1)
+      pool_release_chunk(pool, chunk);
+  }
+}
+
+static Pool g_pool_h2w, g_pool_h6w;
+
+#define STAT_ALLOC(n)                                        \
+  do {                                                       \
+    OpiCellStats *stats = &g_pool_h##n##w.stats;             \
+    stats->nallocs += 1;                                     \
+    if (++stats->live > stats->peak)                         \
+      stats->peak = stats->live;                             \
+  } while (0)
+
+#define STAT_FREE(n)                                         \
+  do {                                                       \
+    g_pool_h##n##w.stats.nfrees += 1;                        \
+    g_pool_h##n##w.stats.live -= 1;                          \
+  } while (0)
+
 #if defined(OPI_DEBUG_MODE)
 #warning Will use malloc for all allocations.
 # define ALLOCATOR(n)                                        \
-  static                                                     \
-  struct cod_ualloc_h##n##w g_allocator_h##n##w;             \
-                                                             \
   void*                                                      \
   opi_h##n##w()                                              \
-  { return malloc(sizeof(OpiH##n##w)); }                     \
+  {                                                          \
+    STAT_ALLOC(n);                                           \
+    return malloc(sizeof(OpiH##n##w));                       \
+  }                                                          \
                                                              \
   void                                                       \
   opi_h##n##w_free(void *ptr)                                \
-  { free(ptr); }
-#else
+  {                                                          \
+    STAT_FREE(n);                                            \
+    free(ptr);                                               \
+  }
+#elif defined(OPI_NURSERY)
 # define ALLOCATOR(n)                                        \
-  static                                                     \
-  struct cod_ualloc_h##n##w g_allocator_h##n##w;             \
+  void* __attribute__((hot, flatten))                        \
+  opi_h##n##w()                                              \
+  {                                                          \
+    STAT_ALLOC(n);                                           \
+    void *ptr = nursery_alloc(sizeof(OpiH##n##w));           \
+    if (opi_likely(ptr != NULL))                             \
+      return ptr;                                            \
+    return pool_alloc(&g_pool_h##n##w);                      \
+  }                                                          \
                                                              \
+  void __attribute__((hot, flatten))                         \
+  opi_h##n##w_free(void *ptr)                                \
+  {                                                          \
+    STAT_FREE(n);                                            \
+    if (!nursery_free(ptr))                                  \
+      pool_free(&g_pool_h##n##w, ptr);                       \
+  }
+#else
+# define ALLOCATOR(n)                                        \
   void* __attribute__((hot, flatten))                        \
   opi_h##n##w()                                              \
-  { return cod_ualloc_h##n##w_alloc(&g_allocator_h##n##w); } \
+  {                                                          \
+    STAT_ALLOC(n);                                           \
+    return pool_alloc(&g_pool_h##n##w);                      \
+  }                                                          \
                                                              \
   void __attribute__((hot, flatten))                         \
   opi_h##n##w_free(void *ptr)                                \
-  { cod_ualloc_h##n##w_free(&g_allocator_h##n##w, ptr); }
+  {                                                          \
+    STAT_FREE(n);                                            \
+    pool_free(&g_pool_h##n##w, ptr);                         \
+  }
 #endif
 
-#define UALLOC_NAME h2w
-#define UALLOC_TYPE OpiH2w
-/*#define UALLOC_POOL_SIZE 0x1000*/
-#include "codeine/ualloc.h"
 ALLOCATOR(2)
-
-#define UALLOC_NAME h6w
-#define UALLOC_TYPE OpiH6w
-#define UALLOC_POOL_SIZE 0x40
-#include "codeine/ualloc.h"
 ALLOCATOR(6)
 
+/*
+ * Slabs.
+ */
+#define SLAB_SIZE 0x4000
+
+typedef struct SlabCell_s {
+  struct SlabCell_s *next;
+} SlabCell;
+
+static __thread struct {
+  SlabCell *free;
+  cod_vec(void*) slabs;
+  OpiSlabStats stats;
+} g_slab[OPI_SLAB_NCLASSES];
+
+static inline int
+slab_class(size_t size)
+{
+  if (size <= (1 << OPI_SLAB_MIN_SHIFT))
+    return 0;
+  return sizeof(long) * 8 - __builtin_clzl(size - 1) - OPI_SLAB_MIN_SHIFT;
+}
+
+static void __attribute__((noinline))
+slab_grow(int cls)
+{
+  size_t size = (size_t)1 << (cls + OPI_SLAB_MIN_SHIFT);
+  char *slab = malloc(SLAB_SIZE);
+  cod_vec_push(g_slab[cls].slabs, slab);
+  g_slab[cls].stats.nslabs += 1;
+  // thread new cells in address order
+  for (size_t offs = SLAB_SIZE; offs >= size; offs -= size) {
+    SlabCell *cell = (SlabCell*)(slab + offs - size);
+    cell->next = g_slab[cls].free;
+    g_slab[cls].free = cell;
+  }
+}
+
+void* __attribute__((hot))
+opi_alloc(size_t size)
+{
+#if defined(OPI_DEBUG_MODE)
+  return malloc(size);
+#else
+  if (opi_unlikely(size > OPI_SLAB_MAX))
+    return malloc(size);
+  int cls = slab_class(size);
+  if (opi_unlikely(g_slab[cls].free == NULL))
+    slab_grow(cls);
+  SlabCell *cell = g_slab[cls].free;
+  g_slab[cls].free = cell->next;
+  g_slab[cls].stats.nallocs += 1;
+  return cell;
+#endif
+}
+
+void __attribute__((hot))
+opi_free(void *ptr, size_t size)
+{
+#if defined(OPI_DEBUG_MODE)
+  free(ptr);
+#else
+  if (opi_unlikely(size > OPI_SLAB_MAX)) {
+    free(ptr);
+    return;
+  }
+  int cls = slab_class(size);
+  SlabCell *cell = ptr;
+  cell->next = g_slab[cls].free;
+  g_slab[cls].free = cell;
+  g_slab[cls].stats.nfrees += 1;
+#endif
+}
+
+void
+opi_slab_get_stats(OpiSlabStats stats[OPI_SLAB_NCLASSES])
+{
+  for (int i = 0; i < OPI_SLAB_NCLASSES; ++i) {
+    stats[i] = g_slab[i].stats;
+    stats[i].size = (size_t)1 << (i + OPI_SLAB_MIN_SHIFT);
+  }
+}
+
+size_t
+opi_trim_memory(void)
+{
+  size_t n = 0;
+#if !defined(OPI_DEBUG_MODE)
+  n += pool_trim(&g_pool_h2w) * POOL_CHUNK_SIZE;
+  n += pool_trim(&g_pool_h6w) * POOL_CHUNK_SIZE;
+# if defined(OPI_NURSERY)
+  n += nursery_trim();
+# endif
+#endif
+  malloc_trim(0);
+  return n;
+}
+
+#ifdef OPI_MEM_CENSUS
+static void
+census_dump_type(opi_type_t type, size_t nlive, void *out)
+{
+  if (nlive > 0)
+    fprintf(out, "%-24s %12zu\n", opi_type_get_name(type), nlive);
+}
+#endif
+
+void
+opi_get_memstats(OpiMemStats *stats)
+{
+  stats->h2w = g_pool_h2w.stats;
+  stats->h6w = g_pool_h6w.stats;
+#if !defined(OPI_DEBUG_MODE) && defined(OPI_NURSERY)
+  stats->nursery_chunks = nursery_chunks_in_use();
+#else
+  stats->nursery_chunks = 0;
+#endif
+  opi_slab_get_stats(stats->slabs);
+}
+
+void
+opi_memstats_dump(FILE *out)
+{
+  OpiMemStats stats;
+  opi_get_memstats(&stats);
+
+  fprintf(out, "%-10s %12s %12s %12s %12s %12s\n", "cells", "allocs", "frees", "live", "peak", "chunks");
+  fprintf(out, "%-10s %12zu %12zu %12zu %12zu %12zu\n", "h2w", stats.h2w.nallocs,
+      stats.h2w.nfrees, stats.h2w.live, stats.h2w.peak, stats.h2w.nchunks);
+  fprintf(out, "%-10s %12zu %12zu %12zu %12zu %12zu\n", "h6w", stats.h6w.nallocs,
+      stats.h6w.nfrees, stats.h6w.live, stats.h6w.peak, stats.h6w.nchunks);
+  fprintf(out, "nursery chunks in use: %zu\n", stats.nursery_chunks);
+
+  fprintf(out, "%-10s %12s %12s %12s %12s\n", "slabs", "allocs", "frees", "live", "slabs");
+  for (int i = 0; i < OPI_SLAB_NCLASSES; ++i) {
+    OpiSlabStats *s = stats.slabs + i;
+    fprintf(out, "%-10zu %12zu %12zu %12zu %12zu\n", s->size, s->nallocs,
+        s->nfrees, s->nallocs - s->nfrees, s->nslabs);
+  }
+
+#ifdef OPI_MEM_CENSUS
+  fprintf(out, "%-24s %12s\n", "type", "live");
+  opi_type_census(census_dump_type, out);
+#endif
+}
+
+static void
+slabs_init(void)
+{
+  for (int i = 0; i < OPI_SLAB_NCLASSES; ++i) {
+    g_slab[i].free = NULL;
+    cod_vec_init(g_slab[i].slabs);
+  }
+}
+
+static void
+slabs_destroy(void)
+{
+  for (int i = 0; i < OPI_SLAB_NCLASSES; ++i) {
+    cod_vec_iter(g_slab[i].slabs, j, x, free(x));
+    cod_vec_destroy(g_slab[i].slabs);
+    cod_vec_init(g_slab[i].slabs);
+    g_slab[i].free = NULL;
+  }
+}
+
 void
 opi_allocators_init(void)
 {
-  cod_ualloc_h2w_init(&g_allocator_h2w);
-  cod_ualloc_h6w_init(&g_allocator_h6w);
+  pool_init(&g_pool_h2w, sizeof(OpiH2w));
+  pool_init(&g_pool_h6w, sizeof(OpiH6w));
+  slabs_init();
+#if !defined(OPI_DEBUG_MODE) && defined(OPI_NURSERY)
+  nursery_init();
+#endif
 }
 
 void
 opi_allocators_cleanup(void)
 {
-  cod_ualloc_h2w_destroy(&g_allocator_h2w);
-  cod_ualloc_h6w_destroy(&g_allocator_h6w);
+  pool_destroy(&g_pool_h2w);
+  pool_destroy(&g_pool_h6w);
+#if !defined(OPI_DEBUG_MODE) && defined(OPI_NURSERY)
+  nursery_destroy();
+#endif
+  slabs_destroy();
 }
 
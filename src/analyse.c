@@ -208,6 +208,181 @@ opi_bytecode_cleanup(OpiBytecode *bc)
   }
 }
 
+/*
+ * Generators.
+ *
+ * A generator suspended at YIELD holds references to the values it has
+ * counted but not released yet; these must be released if the generator is
+ * never resumed. Bytecode has no backward jumps, so such values are exactly
+ * the ones released but not (re)acquired on some path after the YIELD.
+ */
+static void
+scan_rc(OpiInsn *begin, OpiInsn *end, char *acq, char *rel)
+{
+  for (OpiInsn *ip = begin; ip != end; ip = ip->next) {
+    switch (ip->opc) {
+      case OPI_OPC_IF:
+      {
+        struct trace then_trace, else_trace;
+        OpiInsn *cont_start = split_if(ip, &then_trace, &else_trace);
+        scan_rc(then_trace.start, then_trace.end, acq, rel);
+        scan_rc(else_trace.start, else_trace.end, acq, rel);
+        scan_rc(cont_start, end, acq, rel);
+        return;
+      }
+
+      case OPI_OPC_JMP:
+        ip = OPI_JMP_ARG_TO(ip);
+        break;
+
+      case OPI_OPC_RET:
+        return;
+
+      case OPI_OPC_INCRC:
+        acq[OPI_INCRC_REG_CELL(ip)] = TRUE;
+        break;
+
+      case OPI_OPC_DUP:
+        acq[OPI_DUP_REG_OUT(ip)] = TRUE;
+        break;
+
+      case OPI_OPC_DECRC:
+        rel[OPI_DECRC_REG_CELL(ip)] = TRUE;
+        break;
+
+      case OPI_OPC_UNREF:
+        rel[OPI_UNREF_REG_CELL(ip)] = TRUE;
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+void
+opi_bytecode_yield_lives(OpiBytecode *bc)
+{
+  char *acq = malloc(bc->nvals + 1);
+  char *rel = malloc(bc->nvals + 1);
+
+  for (OpiInsn *insn = bc->head; insn->opc != OPI_OPC_END; insn = insn->next) {
+    if (insn->opc != OPI_OPC_YIELD)
+      continue;
+
+    memset(acq, 0, bc->nvals);
+    memset(rel, 0, bc->nvals);
+    scan_rc(insn->next, bc->tail, acq, rel);
+
+    int *lives = malloc(sizeof(int) * (bc->nvals + 1));
+    size_t n = 0;
+    for (size_t vid = 0; vid < bc->nvals; ++vid) {
+      if (rel[vid] && !acq[vid])
+        lives[n++] = vid;
+    }
+    free(OPI_YIELD_ARG_LIVES(insn));
+    OPI_YIELD_ARG_LIVES(insn) = lives;
+    OPI_YIELD_ARG_NLIVES(insn) = n;
+  }
+
+  free(acq);
+  free(rel);
+}
+
+/*
+ * Superinstructions.
+ *
+ * Peephole pass merging frequent pairs of instructions into a single fused
+ * one. Jumps only target NOP-labels, so merged instructions can never be a
+ * jump destination.
+ */
+static void
+erase(OpiInsn *insn)
+{
+  insn->prev->next = insn->next;
+  insn->next->prev = insn->prev;
+  opi_insn_delete1(insn);
+}
+
+size_t
+opi_bytecode_fuse(OpiBytecode *bc)
+{
+  size_t nfused = 0;
+
+  for (OpiInsn *insn = bc->head; insn->opc != OPI_OPC_END; insn = insn->next) {
+    OpiInsn *next = insn->next;
+
+    switch (insn->opc) {
+      case OPI_OPC_CONST:
+        // %x = <const>; push %x
+        if (next->opc == OPI_OPC_PUSH &&
+            OPI_PUSH_REG_VAL(next) == OPI_CONST_REG_OUT(insn))
+        {
+          insn->opc = OPI_OPC_CONSTPUSH;
+          erase(next);
+          nfused += 1;
+        }
+        break;
+
+      case OPI_OPC_PARAM:
+        // %x = param <offs>; incrc %x
+        if (next->opc == OPI_OPC_INCRC &&
+            OPI_INCRC_REG_CELL(next) == OPI_PARAM_REG_OUT(insn))
+        {
+          insn->opc = OPI_OPC_PARAMRC;
+          erase(next);
+          nfused += 1;
+        }
+        break;
+
+      case OPI_OPC_APPLY:
+        // %x = apply/n %f; incrc %x
+        if (next->opc == OPI_OPC_INCRC &&
+            OPI_INCRC_REG_CELL(next) == OPI_APPLY_REG_OUT(insn))
+        {
+          insn->opc = OPI_OPC_APPLYRC;
+          erase(next);
+          nfused += 1;
+        }
+        break;
+
+      case OPI_OPC_DECRC:
+        // decrc %x; push %x
+        if (next->opc == OPI_OPC_PUSH &&
+            OPI_PUSH_REG_VAL(next) == OPI_DECRC_REG_CELL(insn))
+        {
+          insn->opc = OPI_OPC_DECPUSH;
+          erase(next);
+          nfused += 1;
+        }
+        break;
+
+      case OPI_OPC_TESTTY:
+      {
+        // %t = testty %x <type>; if %t else <label>
+        int test = OPI_TESTTY_REG_OUT(insn);
+        if (next->opc == OPI_OPC_IF && (int)OPI_IF_REG_TEST(next) == test &&
+            !will_be_used(next->next, test))
+        {
+          uintptr_t cell = OPI_TESTTY_REG_CELL(insn);
+          insn->opc = OPI_OPC_TESTTYIF;
+          OPI_TESTTYIF_REG_CELL(insn) = cell;
+          OPI_TESTTYIF_ARG_ELSE(insn) = OPI_IF_ARG_ELSE(next);
+          erase(next);
+          nfused += 1;
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  bc->nfused += nfused;
+  return nfused;
+}
+
 static size_t
 distance(OpiInsn *from, OpiInsn *to)
 {
@@ -229,7 +404,11 @@ opi_bytecode_flatten(OpiBytecode *bc)
   OpiInsn *insn = bc->head;
   while (insn) {
     OpiFlatInsn *finsn = buf + i++;
-    *finsn = *(OpiFlatInsn*)insn;
+    finsn->opc = insn->opc;
+    memcpy(finsn->reg, insn->reg, sizeof finsn->reg);
+#ifdef OPI_THREADED_DISPATCH
+    finsn->label = opi_vm_label(insn->opc);
+#endif
 
     if (insn->opc == OPI_OPC_JMP) {
       size_t d = distance(insn, OPI_JMP_ARG_TO(insn));
@@ -237,6 +416,9 @@ opi_bytecode_flatten(OpiBytecode *bc)
     } else if (insn->opc == OPI_OPC_IF) {
       size_t d = distance(insn, OPI_IF_ARG_ELSE(insn));
       OPI_IF_ARG_ELSE(finsn) = finsn + d;
+    } else if (insn->opc == OPI_OPC_TESTTYIF) {
+      size_t d = distance(insn, OPI_TESTTYIF_ARG_ELSE(insn));
+      OPI_TESTTYIF_ARG_ELSE(finsn) = finsn + d;
     }
 
     insn = insn->next;
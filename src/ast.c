@@ -117,6 +117,7 @@ opi_ast_delete(OpiAst *node)
       break;
 
     case OPI_AST_RETURN:
+    case OPI_AST_YIELD:
       opi_ast_delete(node->ret);
       break;
 
@@ -530,6 +531,15 @@ opi_ast_return(OpiAst *val)
   return node;
 }
 
+OpiAst*
+opi_ast_yield(OpiAst *val)
+{
+  OpiAst *node = ast_new();
+  node->tag = OPI_AST_YIELD;
+  node->ret = val;
+  return node;
+}
+
 OpiAst*
 opi_ast_eor(OpiAst *try, OpiAst *els, const char *ename)
 {
@@ -26,7 +26,11 @@ opi_bytecode()
   bc->point = bc->tail;
 
   bc->tape = NULL;
+  bc->tcache = NULL;
   bc->is_generator = FALSE;
+  bc->nfused = 0;
+  bc->ncalls = 0;
+  bc->jit = NULL;
 
   return bc;
 }
@@ -38,10 +42,24 @@ opi_bytecode_delete(OpiBytecode *bc)
   free(bc->vinfo);
   if (bc->tape)
     free(bc->tape);
+  if (bc->tcache)
+    free(bc->tcache);
   cod_vec_destroy(bc->ulist);
   free(bc);
 }
 
+OpiTraitCache*
+opi_bytecode_get_trait_cache(OpiBytecode *bc, const OpiFlatInsn *ip)
+{
+  if (opi_unlikely(bc->tcache == NULL)) {
+    size_t len = 1;
+    while (bc->tape[len - 1].opc != OPI_OPC_END)
+      len += 1;
+    bc->tcache = calloc(len * 2, sizeof(OpiTraitCache));
+  }
+  return bc->tcache + (ip - bc->tape) * 2;
+}
+
 void
 opi_bytecode_set_vtype(OpiBytecode *bc, int vid, opi_type_t type)
 {
@@ -84,6 +102,7 @@ opi_bytecode_new_val(OpiBytecode *bc, OpiValType vtype)
   bc->vinfo[bc->nvals].creatat = NULL;
   bc->vinfo[bc->nvals].is_var = FALSE;
   bc->vinfo[bc->nvals].vtype = NULL;
+  bc->vinfo[bc->nvals].is_num = FALSE;
 
   return bc->nvals++;
 }
@@ -108,7 +127,12 @@ opi_insn_delete1(OpiInsn *insn)
       free(OPI_ENDSCP_ARG_CELLS(insn));
       break;
 
+    case OPI_OPC_YIELD:
+      free(OPI_YIELD_ARG_LIVES(insn));
+      break;
+
     case OPI_OPC_CONST:
+    case OPI_OPC_CONSTPUSH:
       opi_unref(insn->ptr[1]);
       break;
 
@@ -174,6 +198,17 @@ opi_insn_dump1(OpiInsn *insn, FILE *out)
       fprintf(out, "return %%%zd", OPI_RET_REG_VAL(insn));
       break;
 
+    case OPI_OPC_YIELD:
+    {
+      int *lives = OPI_YIELD_ARG_LIVES(insn);
+      size_t n = OPI_YIELD_ARG_NLIVES(insn);
+      fprintf(out, "yield %%%zd [ ", OPI_YIELD_REG_VAL(insn));
+      for (size_t i = 0; i < n; ++i)
+        fprintf(out, "%%%d ", lives[i]);
+      fprintf(out, "]");
+      break;
+    }
+
     case OPI_OPC_PUSH:
       fprintf(out, "push %%%zd", OPI_PUSH_REG_VAL(insn));
       break;
@@ -225,7 +260,7 @@ opi_insn_dump1(OpiInsn *insn, FILE *out)
       fprintf(out, "finfn/%d %%%zu [ ", data->arity, OPI_FINFN_REG_CELL(insn));
       for (int i = 0; i < data->ncaps; ++i)
         fprintf(out, "%%%d ", data->caps[i]);
-      fprintf(out, "] {\n");
+      fprintf(out, "] (fused %zu) {\n", data->bc->nfused);
       dump_padding += 2;
       OpiBytecode *body = OPI_FINFN_ARG_DATA(insn)->bc;
       opi_insn_dump(body->head, out);
@@ -302,6 +337,36 @@ opi_insn_dump1(OpiInsn *insn, FILE *out)
           OPI_BINOP_REG_RHS(insn));
       break;
 
+    case OPI_OPC_CONSTPUSH:
+      fprintf(out, "%%%zd = ", OPI_CONST_REG_OUT(insn));
+      opi_display(OPI_CONST_ARG_CELL(insn), out);
+      fprintf(out, "; push");
+      break;
+
+    case OPI_OPC_PARAMRC:
+      fprintf(out, "%%%zd = param %zd; incrc",
+          OPI_PARAM_REG_OUT(insn),
+          OPI_PARAM_ARG_OFFS(insn));
+      break;
+
+    case OPI_OPC_APPLYRC:
+      fprintf(out, "%%%zd = apply/%zd %%%zd; incrc",
+          OPI_APPLY_REG_OUT(insn),
+          OPI_APPLY_ARG_NARGS(insn),
+          OPI_APPLY_REG_FN(insn));
+      break;
+
+    case OPI_OPC_DECPUSH:
+      fprintf(out, "decrc %%%zd; push", OPI_PUSH_REG_VAL(insn));
+      break;
+
+    case OPI_OPC_TESTTYIF:
+      fprintf(out, "if testty %%%zu <%s> else %p",
+          OPI_TESTTYIF_REG_CELL(insn),
+          opi_type_get_name(OPI_TESTTYIF_ARG_TYPE(insn)),
+          OPI_TESTTYIF_ARG_ELSE(insn));
+      break;
+
     default:
       opi_assert(!"unimplemented insn dump");
   }
@@ -364,6 +429,17 @@ opi_insn_ret(int val)
   return insn;
 }
 
+OpiInsn*
+opi_insn_yield(int val)
+{
+  OpiInsn *insn = malloc(sizeof(OpiInsn));
+  insn->opc = OPI_OPC_YIELD;
+  OPI_YIELD_REG_VAL(insn) = val;
+  OPI_YIELD_ARG_NLIVES(insn) = 0;
+  OPI_YIELD_ARG_LIVES(insn) = NULL;
+  return insn;
+}
+
 OpiInsn*
 opi_insn_push(int val)
 {
@@ -666,6 +742,9 @@ opi_insn_is_using(OpiInsn *insn, int vid)
     case OPI_OPC_RET:
       return (int)OPI_RET_REG_VAL(insn) == vid;
 
+    case OPI_OPC_YIELD:
+      return (int)OPI_YIELD_REG_VAL(insn) == vid;
+
     case OPI_OPC_PUSH:
       return (int)OPI_PUSH_REG_VAL(insn) == vid;
 
@@ -704,6 +783,21 @@ opi_insn_is_using(OpiInsn *insn, int vid)
 
     case OPI_OPC_DEREF:
       return (int)OPI_DEREF_REG_VAR(insn) == vid;
+
+    case OPI_OPC_CONSTPUSH:
+      return (int)OPI_CONST_REG_OUT(insn) == vid;
+
+    case OPI_OPC_PARAMRC:
+      return FALSE;
+
+    case OPI_OPC_APPLYRC:
+      return (int)OPI_APPLY_REG_FN(insn) == vid;
+
+    case OPI_OPC_DECPUSH:
+      return (int)OPI_PUSH_REG_VAL(insn) == vid;
+
+    case OPI_OPC_TESTTYIF:
+      return (int)OPI_TESTTYIF_REG_CELL(insn) == vid;
   }
 
   abort();
@@ -737,6 +831,9 @@ opi_insn_is_killing(OpiInsn *insn, int vid)
     case OPI_OPC_SET:
     case OPI_OPC_SETVAR:
     case OPI_OPC_DEREF:
+    case OPI_OPC_PARAMRC:
+    case OPI_OPC_APPLYRC:
+    case OPI_OPC_TESTTYIF:
       return FALSE;
 
     // ignore manual RC-management
@@ -749,9 +846,16 @@ opi_insn_is_killing(OpiInsn *insn, int vid)
     case OPI_OPC_RET:
       return (int)OPI_RET_REG_VAL(insn) == vid;
 
+    case OPI_OPC_YIELD:
+      return (int)OPI_YIELD_REG_VAL(insn) == vid;
+
     case OPI_OPC_PUSH:
+    case OPI_OPC_DECPUSH:
       return (int)OPI_PUSH_REG_VAL(insn) == vid;
 
+    case OPI_OPC_CONSTPUSH:
+      return (int)OPI_CONST_REG_OUT(insn) == vid;
+
     case OPI_OPC_FINFN:
     {
       OpiFnInsnData *data = OPI_FINFN_ARG_DATA(insn);
@@ -895,6 +999,10 @@ void
 opi_bytecode_ret(OpiBytecode *bc, int val)
 { opi_bytecode_write(bc, opi_insn_ret(val)); }
 
+void
+opi_bytecode_yield(OpiBytecode *bc, int val)
+{ opi_bytecode_write(bc, opi_insn_yield(val)); }
+
 void
 opi_bytecode_push(OpiBytecode *bc, int val)
 { opi_bytecode_write(bc, opi_insn_push(val)); }
@@ -1020,6 +1128,7 @@ opi_bytecode_binop(OpiBytecode *bc, OpiOpc opc, int lhs, int rhs)
   int out;
   switch (opc) {
     case OPI_OPC_NUMEQ ... OPI_OPC_GE:
+    case OPI_OPC_NUMEQ_NN ... OPI_OPC_GE_NN:
       out = opi_bytecode_new_val(bc, OPI_VAL_GLOBAL);
       break;
     default:
@@ -42,7 +42,7 @@ static opi_t
 car_(void)
 {
   opi_t x = opi_pop();
-  if (opi_unlikely(x->type != opi_pair_type)) {
+  if (opi_unlikely(opi_typeof(x) != opi_pair_type)) {
     opi_drop(x);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -57,7 +57,7 @@ static opi_t
 cdr_(void)
 {
   opi_t x = opi_pop();
-  if (opi_unlikely(x->type != opi_pair_type)) {
+  if (opi_unlikely(opi_typeof(x) != opi_pair_type)) {
     opi_drop(x);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -145,11 +145,11 @@ fprintf_(void)
 
   opi_t port = opi_get(1);
   opi_t fmt = opi_get(2);
-  if (opi_unlikely(port->type != opi_file_type)) {
+  if (opi_unlikely(opi_typeof(port) != opi_file_type)) {
     err = opi_undefined(opi_symbol("type-error"));
     goto error;
   }
-  if (opi_unlikely(fmt->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(fmt) != opi_str_type)) {
     err = opi_undefined(opi_symbol("type-error"));
     goto error;
   }
@@ -190,7 +190,7 @@ format(void)
   opi_inc_rc(port);
 
   opi_t fmt = opi_get(1);
-  if (opi_unlikely(fmt->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(fmt) != opi_str_type)) {
     err = opi_undefined(opi_symbol("type-error"));
     goto error;
   }
@@ -285,7 +285,7 @@ table_ref(void)
   opi_t key = opi_pop();
   opi_inc_rc(key);
 
-  if (opi_unlikely(tab->type != opi_table_type)) {
+  if (opi_unlikely(opi_typeof(tab) != opi_table_type)) {
     opi_unref(tab);
     opi_unref(key);
     return opi_undefined(opi_symbol("type-error"));
@@ -306,7 +306,7 @@ static opi_t
 pairs(void)
 {
   opi_t tab = opi_pop();
-  if (opi_unlikely(tab->type != opi_table_type)) {
+  if (opi_unlikely(opi_typeof(tab) != opi_table_type)) {
     opi_drop(tab);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -325,19 +325,19 @@ str_at(void)
   opi_t idx = opi_pop();
   opi_inc_rc(idx);
 
-  if (opi_unlikely(str->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(str) != opi_str_type)) {
     opi_unref(str);
     opi_unref(idx);
     return opi_undefined(opi_symbol("type-error"));
   }
 
-  if (opi_unlikely(idx->type != opi_num_type)) {
+  if (opi_unlikely(!opi_is_int(idx))) {
     opi_unref(str);
     opi_unref(idx);
     return opi_undefined(opi_symbol("type-error"));
   }
 
-  size_t k = opi_num_get_value(idx);
+  size_t k = opi_int_get_value(idx);
   if (opi_unlikely(k >= OPI_STR(str)->len)) {
     opi_unref(str);
     opi_unref(idx);
@@ -356,17 +356,22 @@ apply(void)
   opi_t f = opi_pop();
   opi_t l = opi_pop();
 
-  if (f->type != opi_fn_type) {
+  if (opi_typeof(f) != opi_fn_type) {
     opi_drop(f);
     opi_drop(l);
     return opi_undefined(opi_symbol("type-error"));
   }
 
   size_t nargs = opi_length(l);
+  if (opi_unlikely(!opi_stack_fits(nargs))) {
+    opi_drop(f);
+    opi_drop(l);
+    return opi_undefined(opi_symbol("stack-overflow"));
+  }
 
   opi_sp += nargs;
   size_t iarg = 1;
-  for (opi_t it = l; it->type == opi_pair_type; it = opi_cdr(it))
+  for (opi_t it = l; opi_typeof(it) == opi_pair_type; it = opi_cdr(it))
     opi_sp[-iarg++] = opi_car(it);
   opi_t ret = opi_apply(f, nargs);
 
@@ -382,7 +387,7 @@ static opi_t
 lazy(void)
 {
   opi_t x = opi_pop();
-  if (opi_unlikely(x->type != opi_fn_type)) {
+  if (opi_unlikely(opi_typeof(x) != opi_fn_type)) {
     opi_drop(x);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -397,7 +402,7 @@ static opi_t
 force(void)
 {
   opi_t lazy = opi_pop();
-  if (opi_unlikely(lazy->type != opi_lazy_type)) {
+  if (opi_unlikely(opi_typeof(lazy) != opi_lazy_type)) {
     return lazy;
     /*opi_drop(lazy);*/
     /*return opi_undefined(opi_symbol("type-error"));*/
@@ -418,7 +423,7 @@ compose_delete(OpiFn *fn)
   struct compose_data *data = fn->data;
   opi_unref(data->f);
   opi_unref(data->g);
-  free(data);
+  opi_free(data, sizeof(struct compose_data));
   opi_fn_delete(fn);
 }
 
@@ -427,7 +432,7 @@ compose_aux(void)
 {
   struct compose_data *data = opi_current_fn->data;
   opi_t tmp = opi_apply(data->g, opi_nargs);
-  if (opi_unlikely(tmp->type == opi_undefined_type))
+  if (opi_unlikely(opi_typeof(tmp) == opi_undefined_type))
     return tmp;
   opi_push(tmp);
   return opi_apply(data->f, 1);
@@ -438,7 +443,7 @@ compose(void)
 {
   opi_t f = opi_pop();
   opi_t g = opi_pop();
-  struct compose_data *data = malloc(sizeof(struct compose_data));
+  struct compose_data *data = opi_alloc(sizeof(struct compose_data));
   opi_inc_rc(data->f = f);
   opi_inc_rc(data->g = g);
   opi_t aux = opi_fn_new(compose_aux, 1);
@@ -474,7 +479,7 @@ vaarg_delete(OpiFn *fn)
 {
   struct vaarg_data *data = fn->data;
   opi_unref(data->f);
-  free(data);
+  opi_free(data, sizeof(struct vaarg_data));
   opi_fn_delete(fn);
 }
 
@@ -506,13 +511,13 @@ vaarg(void)
   opi_t nmin = opi_pop();
   opi_t f = opi_pop();
 
-  if (opi_unlikely(nmin->type != opi_num_type || f->type != opi_fn_type)) {
+  if (opi_unlikely(!opi_is_int(nmin) || opi_typeof(f) != opi_fn_type)) {
     opi_drop(nmin);
     opi_drop(f);
     return opi_undefined(opi_symbol("type-error"));
   }
 
-  size_t ari = opi_num_get_value(nmin);
+  size_t ari = opi_int_get_value(nmin);
   opi_drop(nmin);
 
   if (opi_unlikely(!opi_test_arity(opi_fn_get_arity(f), ari + 1))) {
@@ -520,7 +525,7 @@ vaarg(void)
     return opi_undefined(opi_symbol("airty-error"));
   }
 
-  struct vaarg_data *data = malloc(sizeof(struct vaarg_data));
+  struct vaarg_data *data = opi_alloc(sizeof(struct vaarg_data));
   opi_inc_rc(data->f = f);
   data->nmin = ari;
 
@@ -533,20 +538,98 @@ static opi_t
 system_(void)
 {
   opi_t cmd = opi_pop();
-  if (opi_unlikely(cmd->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(cmd) != opi_str_type)) {
     opi_drop(cmd);
     return opi_undefined(opi_symbol("type-error"));
   }
   int err = system(OPI_STR(cmd)->str);
   opi_drop(cmd);
-  return opi_num_new(err);
+  return opi_int_new(err);
+}
+
+static opi_t
+make_table(opi_t l)
+{
+  opi_t tab = opi_table(l, FALSE);
+  opi_drop(l);
+  return tab;
+}
+
+#define KV(key, val) opi_cons(opi_symbol(key), val)
+
+static opi_t
+cell_stats(const OpiCellStats *s)
+{
+  opi_t l = opi_nil;
+  l = opi_cons(KV("chunks", opi_int_new(s->nchunks)), l);
+  l = opi_cons(KV("peak", opi_int_new(s->peak)), l);
+  l = opi_cons(KV("live", opi_int_new(s->live)), l);
+  l = opi_cons(KV("frees", opi_int_new(s->nfrees)), l);
+  l = opi_cons(KV("allocs", opi_int_new(s->nallocs)), l);
+  return make_table(l);
+}
+
+#ifdef OPI_MEM_CENSUS
+static void
+census_add_type(opi_type_t type, size_t nlive, void *data)
+{
+  opi_t *l = data;
+  if (nlive > 0) {
+    opi_t kv = opi_cons(opi_str_new(opi_type_get_name(type)), opi_int_new(nlive));
+    *l = opi_cons(kv, *l);
+  }
+}
+#endif
+
+static opi_t
+Sys_memstats(void)
+{
+  OpiMemStats stats;
+  opi_get_memstats(&stats);
+
+  opi_t slabs = opi_nil;
+  for (int i = OPI_SLAB_NCLASSES - 1; i >= 0; --i) {
+    OpiSlabStats *s = stats.slabs + i;
+    opi_t l = opi_nil;
+    l = opi_cons(KV("frees", opi_int_new(s->nfrees)), l);
+    l = opi_cons(KV("allocs", opi_int_new(s->nallocs)), l);
+    l = opi_cons(KV("slabs", opi_int_new(s->nslabs)), l);
+    l = opi_cons(KV("size", opi_int_new(s->size)), l);
+    slabs = opi_cons(make_table(l), slabs);
+  }
+
+  opi_t l = opi_nil;
+#ifdef OPI_MEM_CENSUS
+  opi_t census = opi_nil;
+  opi_type_census(census_add_type, &census);
+  l = opi_cons(KV("census", make_table(census)), l);
+#endif
+  l = opi_cons(KV("slabs", slabs), l);
+  l = opi_cons(KV("nurseryChunks", opi_int_new(stats.nursery_chunks)), l);
+  l = opi_cons(KV("h6w", cell_stats(&stats.h6w)), l);
+  l = opi_cons(KV("h2w", cell_stats(&stats.h2w)), l);
+  return make_table(l);
 }
 
+#undef KV
+
+static opi_t
+Sys_trimMemory(void)
+{ return opi_int_new(opi_trim_memory()); }
+
+static opi_t
+Sys_drainFrees(void)
+{ return opi_int_new(opi_drain_frees(SIZE_MAX)); }
+
+static opi_t
+Sys_collectCycles(void)
+{ return opi_int_new(opi_collect_cycles()); }
+
 static opi_t
 shell(void)
 {
   opi_t cmd = opi_pop();
-  if (opi_unlikely(cmd->type != opi_str_type)) {
+  if (opi_unlikely(opi_typeof(cmd) != opi_str_type)) {
     opi_drop(cmd);
     return opi_undefined(opi_symbol("type-error"));
   }
@@ -594,11 +677,11 @@ static opi_t
 exit_(void)
 {
   opi_t err = opi_pop();
-  if (err->type != opi_num_type) {
+  if (!opi_is_int(err)) {
     opi_drop(err);
     return opi_undefined(opi_symbol("type-error"));
   }
-  long double e = opi_num_get_value(err);
+  intmax_t e = opi_int_get_value(err);
   opi_drop(err);
   if (e < 0 || e > 255) {
     opi_drop(err);
@@ -611,12 +694,12 @@ static opi_t
 regex(void)
 {
   opi_t pattern = opi_pop();
-  opi_assert(pattern->type == opi_str_type);
+  opi_assert(opi_typeof(pattern) == opi_str_type);
   opi_t opt = opi_pop();
-  opi_assert(opt->type == opi_num_type);
+  opi_assert(opi_is_int(opt));
 
   const char *err;
-  opi_t regex = opi_regex_new(OPI_STR(pattern)->str, OPI_NUM(opt)->val, &err);
+  opi_t regex = opi_regex_new(OPI_STR(pattern)->str, opi_int_get_value(opt), &err);
   if (regex == NULL) {
     opi_error("%s\n", err);
     abort();
@@ -719,44 +802,49 @@ number(void)
 {
   OPI_BEGIN_FN()
   OPI_ARG(str, opi_str_type)
-  char *endptr;
-  long double num = strtold(OPI_STR(str)->str, &endptr);
-  if (endptr == OPI_STR(str)->str)
+  opi_t num = opi_num_parse(OPI_STR(str)->str, NULL);
+  if (num == NULL)
     OPI_THROW("format-error");
-  OPI_RETURN(opi_num_new(num));
+  OPI_RETURN(num);
 }
 
 static
 OPI_DEF(power,
-  opi_arg(x, opi_num_type)
-  opi_arg(y, opi_num_type)
-  opi_t ret = opi_num_new(powl(OPI_NUM(x)->val, OPI_NUM(y)->val));
-  opi_unref(x);
-  opi_unref(y);
-  return ret;
+  opi_num_arg(x)
+  opi_num_arg(y)
+  if (opi_is_int(x) && opi_is_int(y) && opi_int_get_value(y) >= 0) {
+    // exponentiation by squaring (wraps on overflow, same as Int arithmetic)
+    uintmax_t b = opi_int_get_value(x), ret = 1;
+    for (intmax_t e = opi_int_get_value(y); e; e >>= 1, b *= b) {
+      if (e & 1)
+        ret *= b;
+    }
+    opi_return(opi_int_new(ret));
+  }
+  opi_return(opi_float_new(pow(opi_num_get_value(x), opi_num_get_value(y))));
 )
 
 static opi_t
 addressof(void)
 {
   opi_t x = opi_pop();
-  opi_t ret = opi_num_new((uintptr_t)x);
+  opi_t ret = opi_int_new((intptr_t)x);
   opi_drop(x);
   return ret;
 }
 
 static opi_t
-range(long double from, long double to, long double step)
+range_int(intmax_t from, intmax_t to, intmax_t step)
 {
   typedef struct {
-    long double cnt, end, step;
+    intmax_t cnt, end, step;
   } Iter;
 
   opi_t next_right(OpiIter *restrict iter) {
     Iter *self = (void*)iter;
     if (opi_unlikely(self->cnt > self->end))
       return NULL;
-    opi_t ret = opi_num_new(self->cnt);
+    opi_t ret = opi_int_new(self->cnt);
     self->cnt += self->step;
     return ret;
   }
@@ -765,49 +853,141 @@ range(long double from, long double to, long double step)
     Iter *self = (void*)iter;
     if (opi_unlikely(self->cnt < self->end))
       return NULL;
-    opi_t ret = opi_num_new(self->cnt);
+    opi_t ret = opi_int_new(self->cnt);
     self->cnt += self->step;
     return ret;
   }
 
+  size_t next_batch(OpiIter *restrict iter, opi_t *out, size_t n) {
+    Iter *self = (void*)iter;
+    intmax_t cnt = self->cnt, end = self->end, step = self->step;
+    size_t k = 0;
+    if (step > 0) {
+      for (; k < n && cnt <= end; cnt += step)
+        out[k++] = opi_int_new(cnt);
+    } else {
+      for (; k < n && cnt >= end; cnt += step)
+        out[k++] = opi_int_new(cnt);
+    }
+    self->cnt = cnt;
+    return k;
+  }
+
   OpiIter* copy(OpiIter *iter) {
     Iter *self = (void*)iter;
-    Iter *other = malloc(sizeof(Iter));
+    Iter *other = opi_alloc(sizeof(Iter));
     memcpy(other, self, sizeof(Iter));
     return (OpiIter*)other;
   }
 
-  Iter *iter = malloc(sizeof(Iter));
+  void dtor(OpiIter *iter) {
+    opi_free(iter, sizeof(Iter));
+  }
+
+  Iter *iter = opi_alloc(sizeof(Iter));
   iter->cnt = from;
   iter->end = to;
   iter->step = step;
   return opi_seq_new((OpiIter*)iter, (OpiSeqCfg) {
     .next = step > 0 ? next_right : next_left,
     .copy = copy,
-    .dtor = (void*)free
+    .dtor = dtor,
+    .next_batch = next_batch,
+  });
+}
+
+static opi_t
+range_float(double from, double to, double step)
+{
+  typedef struct {
+    double cnt, end, step;
+  } Iter;
+
+  opi_t next_right(OpiIter *restrict iter) {
+    Iter *self = (void*)iter;
+    if (opi_unlikely(self->cnt > self->end))
+      return NULL;
+    opi_t ret = opi_float_new(self->cnt);
+    self->cnt += self->step;
+    return ret;
+  }
+
+  opi_t next_left(OpiIter *restrict iter) {
+    Iter *self = (void*)iter;
+    if (opi_unlikely(self->cnt < self->end))
+      return NULL;
+    opi_t ret = opi_float_new(self->cnt);
+    self->cnt += self->step;
+    return ret;
+  }
+
+  size_t next_batch(OpiIter *restrict iter, opi_t *out, size_t n) {
+    Iter *self = (void*)iter;
+    double cnt = self->cnt, end = self->end, step = self->step;
+    size_t k = 0;
+    if (step > 0) {
+      for (; k < n && cnt <= end; cnt += step)
+        out[k++] = opi_float_new(cnt);
+    } else {
+      for (; k < n && cnt >= end; cnt += step)
+        out[k++] = opi_float_new(cnt);
+    }
+    self->cnt = cnt;
+    return k;
+  }
+
+  OpiIter* copy(OpiIter *iter) {
+    Iter *self = (void*)iter;
+    Iter *other = opi_alloc(sizeof(Iter));
+    memcpy(other, self, sizeof(Iter));
+    return (OpiIter*)other;
+  }
+
+  void dtor(OpiIter *iter) {
+    opi_free(iter, sizeof(Iter));
+  }
+
+  Iter *iter = opi_alloc(sizeof(Iter));
+  iter->cnt = from;
+  iter->end = to;
+  iter->step = step;
+  return opi_seq_new((OpiIter*)iter, (OpiSeqCfg) {
+    .next = step > 0 ? next_right : next_left,
+    .copy = copy,
+    .dtor = dtor,
+    .next_batch = next_batch,
   });
 }
 
 static
 OPI_DEF(builtin_range2,
-  opi_arg(x1_, opi_num_type)
-  opi_arg(xn_, opi_num_type)
-  long double x1 = OPI_NUM(x1_)->val;
-  long double xn = OPI_NUM(xn_)->val;
-  long double step = xn > x1 ? 1 : -1;
-  opi_return(range(x1, xn, step));
+  opi_num_arg(x1_)
+  opi_num_arg(xn_)
+  if (opi_is_int(x1_) && opi_is_int(xn_)) {
+    intmax_t x1 = opi_int_get_value(x1_);
+    intmax_t xn = opi_int_get_value(xn_);
+    opi_return(range_int(x1, xn, xn > x1 ? 1 : -1));
+  }
+  double x1 = opi_num_get_value(x1_);
+  double xn = opi_num_get_value(xn_);
+  opi_return(range_float(x1, xn, xn > x1 ? 1 : -1));
 )
 
 static
 OPI_DEF(builtin_range3,
-  opi_arg(x1_, opi_num_type)
-  opi_arg(x2_, opi_num_type)
-  opi_arg(xn_, opi_num_type)
-  long double x1 = OPI_NUM(x1_)->val;
-  long double x2 = OPI_NUM(x2_)->val;
-  long double xn = OPI_NUM(xn_)->val;
-  long double step = x2 - x1;
-  opi_return(range(x1, xn, step));
+  opi_num_arg(x1_)
+  opi_num_arg(x2_)
+  opi_num_arg(xn_)
+  if (opi_is_int(x1_) && opi_is_int(x2_) && opi_is_int(xn_)) {
+    intmax_t x1 = opi_int_get_value(x1_);
+    intmax_t x2 = opi_int_get_value(x2_);
+    intmax_t xn = opi_int_get_value(xn_);
+    opi_return(range_int(x1, xn, x2 - x1));
+  }
+  double x1 = opi_num_get_value(x1_);
+  double x2 = opi_num_get_value(x2_);
+  double xn = opi_num_get_value(xn_);
+  opi_return(range_float(x1, xn, x2 - x1));
 )
 
 static opi_t
@@ -818,6 +998,14 @@ symbol(void)
   opi_return(opi_symbol(OPI_STR(str)->str));
 }
 
+static opi_t
+intern(void)
+{
+  OPI_BEGIN_FN()
+  OPI_ARG(str, opi_str_type)
+  opi_return(opi_str_intern(str));
+}
+
 void
 opi_builtins(OpiBuilder *bldr)
 {
@@ -831,6 +1019,7 @@ opi_builtins(OpiBuilder *bldr)
   opi_builder_def_const(bldr, "Table", opi_fn_new(Table, 1));
   opi_builder_def_const(bldr, "number", opi_fn_new(number, 1));
   opi_builder_def_const(bldr, "symbol", opi_fn_new(symbol, 1));
+  opi_builder_def_const(bldr, "intern", opi_fn_new(intern, 1));
 
   opi_builder_def_const(bldr, "regex", opi_fn_new(regex, 2));
 
@@ -863,6 +1052,11 @@ opi_builtins(OpiBuilder *bldr)
 
   opi_builder_def_const(bldr, "exit", opi_fn_new(exit_, 1));
 
+  opi_builder_def_const(bldr, "Sys.memstats", opi_fn_new(Sys_memstats, 0));
+  opi_builder_def_const(bldr, "Sys.trimMemory", opi_fn_new(Sys_trimMemory, 0));
+  opi_builder_def_const(bldr, "Sys.drainFrees", opi_fn_new(Sys_drainFrees, 0));
+  opi_builder_def_const(bldr, "Sys.collectCycles", opi_fn_new(Sys_collectCycles, 0));
+
   opi_builder_def_const(bldr, "__builtin_sr", opi_fn_new(search_replace, 4));
 
   opi_builder_def_const(bldr, "addressof", opi_fn_new(addressof, 1));
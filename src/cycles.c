@@ -0,0 +1,192 @@
+#include "opium/opium.h"
+#include "opium/hash-map.h"
+
+#ifdef OPI_CYCLE_COLLECTOR
+
+static
+cod_vec(opi_t) g_roots;
+
+void
+opi_cycles_init(void)
+{ cod_vec_init(g_roots); }
+
+void
+opi_cycles_cleanup(void)
+{
+  cod_vec_iter(g_roots, i, x, OPI_VAR(x)->gcidx = OPI_GCIDX_NONE);
+  cod_vec_destroy(g_roots);
+}
+
+void
+opi_cycles_track(opi_t var)
+{
+  OPI_VAR(var)->gcidx = g_roots.len;
+  cod_vec_push(g_roots, var);
+}
+
+void
+opi_cycles_untrack(opi_t var)
+{
+  size_t i = OPI_VAR(var)->gcidx;
+  opi_t last = cod_vec_pop(g_roots);
+  if (last != var) {
+    g_roots.data[i] = last;
+    OPI_VAR(last)->gcidx = i;
+  }
+  OPI_VAR(var)->gcidx = OPI_GCIDX_NONE;
+}
+
+/******************************************************************************/
+typedef struct Node_s {
+  opi_t x;
+  intptr_t refs; // RC minus references from inside the graph
+  int live;
+} Node;
+
+typedef struct Graph_s {
+  cod_vec(Node) nodes;
+  cod_vec(size_t) stack;
+  // open addressing: index of the node + 1 (or 0 if empty)
+  size_t *tab;
+  size_t mask;
+} Graph;
+
+static inline size_t
+ptr_hash(opi_t x)
+{ return opi_hash_mix((uintptr_t)x); }
+
+static Node*
+graph_find(Graph *g, opi_t x)
+{
+  for (size_t i = ptr_hash(x) & g->mask; g->tab[i]; i = (i + 1) & g->mask) {
+    Node *node = g->nodes.data + g->tab[i] - 1;
+    if (node->x == x)
+      return node;
+  }
+  return NULL;
+}
+
+static void
+graph_grow(Graph *g)
+{
+  free(g->tab);
+  g->mask = g->mask * 2 + 1;
+  g->tab = calloc(g->mask + 1, sizeof(size_t));
+  for (size_t k = 0; k < g->nodes.len; ++k) {
+    size_t i = ptr_hash(g->nodes.data[k].x) & g->mask;
+    while (g->tab[i])
+      i = (i + 1) & g->mask;
+    g->tab[i] = k + 1;
+  }
+}
+
+static void
+graph_add(opi_t x, void *g_)
+{
+  Graph *g = g_;
+  if (opi_is_imm(x) || graph_find(g, x))
+    return;
+
+  Node node = { .x = x, .refs = x->rc, .live = FALSE };
+  cod_vec_push(g->nodes, node);
+  if (g->nodes.len * 2 > g->mask) {
+    graph_grow(g);
+  } else {
+    size_t i = ptr_hash(x) & g->mask;
+    while (g->tab[i])
+      i = (i + 1) & g->mask;
+    g->tab[i] = g->nodes.len;
+  }
+}
+
+static void
+graph_subtract(opi_t x, void *g)
+{
+  Node *node;
+  if (!opi_is_imm(x) && (node = graph_find(g, x)))
+    node->refs -= 1;
+}
+
+static void
+graph_mark(opi_t x, void *g_)
+{
+  Graph *g = g_;
+  Node *node;
+  if (!opi_is_imm(x) && (node = graph_find(g, x)) && !node->live) {
+    node->live = TRUE;
+    cod_vec_push(g->stack, node - g->nodes.data);
+  }
+}
+
+size_t
+opi_collect_cycles(void)
+{
+  // dead Vars must leave the roots first
+  opi_drain_frees(SIZE_MAX);
+
+  if (g_roots.len == 0)
+    return 0;
+
+  Graph g;
+  cod_vec_init(g.nodes);
+  cod_vec_init(g.stack);
+  g.mask = 0xFF;
+  g.tab = calloc(g.mask + 1, sizeof(size_t));
+
+  // collect everything reachable from the roots
+  for (size_t i = 0; i < g_roots.len; ++i)
+    graph_add(g_roots.data[i], &g);
+  for (size_t i = 0; i < g.nodes.len; ++i)
+    opi_traverse(g.nodes.data[i].x, graph_add, &g);
+
+  // subtract internal references
+  for (size_t i = 0; i < g.nodes.len; ++i)
+    opi_traverse(g.nodes.data[i].x, graph_subtract, &g);
+
+  // restore everything reachable from outside
+  for (size_t i = 0; i < g.nodes.len; ++i) {
+    Node *node = g.nodes.data + i;
+    if (node->refs != 0 || node->x->rc == 0) {
+      node->live = TRUE;
+      cod_vec_push(g.stack, i);
+    }
+  }
+  while (g.stack.len > 0) {
+    size_t i = cod_vec_pop(g.stack);
+    opi_traverse(g.nodes.data[i].x, graph_mark, &g);
+  }
+
+  // break garbage cycles
+  cod_vec(opi_t) vars;
+  cod_vec_init(vars);
+  size_t ngarbage = 0;
+  for (size_t i = 0; i < g.nodes.len; ++i) {
+    Node *node = g.nodes.data + i;
+    if (node->live)
+      continue;
+    ngarbage += 1;
+    if (opi_typeof(node->x) == opi_var_type) {
+      opi_inc_rc(node->x);
+      cod_vec_push(vars, node->x);
+    }
+  }
+  cod_vec_destroy(g.nodes);
+  cod_vec_destroy(g.stack);
+  free(g.tab);
+
+  for (size_t i = 0; i < vars.len; ++i)
+    opi_var_set(vars.data[i], opi_nil);
+  for (size_t i = 0; i < vars.len; ++i)
+    opi_unref(vars.data[i]);
+  cod_vec_destroy(vars);
+
+  return ngarbage;
+}
+
+#else
+
+size_t
+opi_collect_cycles(void)
+{ return 0; }
+
+#endif
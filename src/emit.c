@@ -40,10 +40,11 @@ static int
 emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc);
 
 OpiBytecode*
-opi_emit_free_fn_body(OpiIr *ir, int nargs)
+opi_emit_free_fn_body(OpiIr *ir, int nargs, int is_generator)
 {
   // create body
   OpiBytecode *body = opi_bytecode();
+  body->is_generator = is_generator;
 
   // create separate stack
   struct stack body_stack;
@@ -82,6 +83,7 @@ emit_fn(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int cell)
 
   // create body
   OpiBytecode *body = opi_bytecode();
+  body->is_generator = ir->fn.is_generator;
 
   // create separate stack
   struct stack body_stack;
@@ -128,12 +130,22 @@ trace(void)
 {
   OpiLocation *loc = opi_current_fn->data;
   opi_t err = opi_pop();
-  opi_assert(err->type == opi_undefined_type);
+  opi_assert(opi_typeof(err) == opi_undefined_type);
   OpiUndefined *u = (void*)err;
   cod_vec_push(*u->trace, opi_location_copy(loc));
   return err;
 }
 
+/* Merge type facts of the branches into the PHI. */
+static void
+join_vtypes(OpiBytecode *bc, int phi, int then_ret, int else_ret)
+{
+  if (bc->vinfo[then_ret].vtype == bc->vinfo[else_ret].vtype)
+    bc->vinfo[phi].vtype = bc->vinfo[then_ret].vtype;
+  bc->vinfo[phi].is_num = opi_bytecode_value_is_num(bc, then_ret) &&
+                          opi_bytecode_value_is_num(bc, else_ret);
+}
+
 static void
 emit_match_with_leak(int val, OpiIrPattern *pattern, OpiBytecode *bc, struct stack *stack)
 {
@@ -277,8 +289,7 @@ emit_match_onelevel_with_then(OpiIr *then, OpiIr *els, int expr,
     // END IF
     opi_bytecode_if_end(bc, &iff);
 
-    if (bc->vinfo[then_ret].vtype == bc->vinfo[else_ret].vtype)
-      bc->vinfo[phi].vtype = bc->vinfo[then_ret].vtype;
+    join_vtypes(bc, phi, then_ret, else_ret);
     return phi;
   }
 }
@@ -304,6 +315,23 @@ emit_error_test(OpiBytecode *bc, int ret, OpiLocation *loc)
   opi_bytecode_if_end(bc, &iff);
 }
 
+/* Type of numeric binop result (NULL if it depends on the values). */
+static opi_type_t
+arith_result_type(OpiOpc opc, opi_type_t lhs, opi_type_t rhs)
+{
+  if (lhs == opi_float_type || rhs == opi_float_type)
+    return opi_float_type;
+  if (lhs != opi_int_type || rhs != opi_int_type)
+    return NULL;
+  // Int / Int and Int % Int may produce a Float
+  return opc == OPI_OPC_DIV || opc == OPI_OPC_FMOD ? NULL : opi_int_type;
+}
+
+/* Unchecked version of a numeric binop. */
+static OpiOpc
+nn_opcode(OpiOpc opc)
+{ return opc - OPI_OPC_ADD + OPI_OPC_ADD_NN; }
+
 static int
 emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
 {
@@ -311,7 +339,7 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
     case OPI_IR_CONST:
     {
       int ret = opi_bytecode_const(bc, ir->cnst);
-      bc->vinfo[ret].vtype = ir->cnst->type;
+      bc->vinfo[ret].vtype = opi_typeof(ir->cnst);
       return ret;
     }
 
@@ -339,7 +367,7 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
       /* Try optimizations for constant functions */
       if (bc->vinfo[fn].c) {
         opi_t fn_val = bc->vinfo[fn].c;
-        if (opi_unlikely(fn_val->type != opi_fn_type)) {
+        if (opi_unlikely(opi_typeof(fn_val) != opi_fn_type)) {
           opi_error("[ir:emit:apply] not a function\n");
           abort();
         }
@@ -356,7 +384,10 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
             int ret = emit(lam->ir, bc, stack, tc);
             stack_pop(stack, nargs);
             opi_assert(stack->size == s0);
-            bc->vinfo[ret].vtype = ir->vtype;
+            // arguments were bound directly, so whatever was inferred from
+            // the body is valid here; don't discard it
+            if (ir->vtype)
+              bc->vinfo[ret].vtype = ir->vtype;
             return ret;
           } else {
             /* Resolve arity statically. */
@@ -370,7 +401,8 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
       }
 
       /* Dynamic dispatch */
-      if (tc && opi_bytecode_value_is_global(bc, fn)) {
+      // (generator frames must stay in place, so no tail calls there)
+      if (tc && !bc->is_generator && opi_bytecode_value_is_global(bc, fn)) {
         /* Tail Call */
         return opi_bytecode_apply_tailcall_arr(bc, fn, ir->apply.nargs, args);
       } else {
@@ -386,22 +418,26 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
     {
       int lhs = emit(ir->binop.lhs, bc, stack, FALSE);
       int rhs = emit(ir->binop.rhs, bc, stack, FALSE);
-      int ret = opi_bytecode_binop(bc, ir->binop.opc, lhs, rhs);
+      OpiOpc opc = ir->binop.opc;
       opi_type_t vtype = NULL;
+      int is_num = FALSE;
       int do_error_test;
 
-      switch (ir->binop.opc) {
+      switch (opc) {
         case OPI_OPC_CONS:
           vtype = opi_pair_type;
           do_error_test = FALSE;
           break;
 
         case OPI_OPC_ADD ... OPI_OPC_FMOD:
-          if (bc->vinfo[lhs].vtype == opi_num_type &&
-              bc->vinfo[rhs].vtype == opi_num_type)
+          if (opi_bytecode_value_is_num(bc, lhs) &&
+              opi_bytecode_value_is_num(bc, rhs))
           {
             opi_debug("optimized binop\n");
-            vtype = opi_num_type;
+            vtype = arith_result_type(opc, bc->vinfo[lhs].vtype,
+                bc->vinfo[rhs].vtype);
+            is_num = TRUE;
+            opc = nn_opcode(opc);
             do_error_test = FALSE;
           } else {
             vtype = NULL;
@@ -410,11 +446,12 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
         break;
 
         case OPI_OPC_NUMEQ ... OPI_OPC_GE:
-        if (bc->vinfo[lhs].vtype == opi_num_type &&
-            bc->vinfo[rhs].vtype == opi_num_type)
+        if (opi_bytecode_value_is_num(bc, lhs) &&
+            opi_bytecode_value_is_num(bc, rhs))
         {
           opi_debug("optimized binop\n");
           vtype = opi_boolean_type;
+          opc = nn_opcode(opc);
           do_error_test = FALSE;
         } else {
           vtype = NULL;
@@ -427,6 +464,8 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
           abort();
       }
 
+      int ret = opi_bytecode_binop(bc, opc, lhs, rhs);
+
       if (do_error_test) {
         // Implicit error-test:
         // if
@@ -441,6 +480,7 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
       }
 
       bc->vinfo[ret].vtype = vtype;
+      bc->vinfo[ret].is_num = is_num;
       return ret;
     }
 
@@ -496,8 +536,7 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
       // END IF
       opi_bytecode_if_end(bc, &iff);
 
-      if (bc->vinfo[then_ret].vtype == bc->vinfo[else_ret].vtype)
-        bc->vinfo[phi].vtype = bc->vinfo[then_ret].vtype;
+      join_vtypes(bc, phi, then_ret, else_ret);
       return phi;
     }
 
@@ -580,8 +619,7 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
         opi_bytecode_if_else(bc, &iff);
         opi_bytecode_if_end(bc, &iff);
 
-        if (bc->vinfo[then_ret].vtype == bc->vinfo[else_ret].vtype)
-          bc->vinfo[phi].vtype = bc->vinfo[then_ret].vtype;
+        join_vtypes(bc, phi, then_ret, else_ret);
         return phi;
       }
     }
@@ -593,6 +631,13 @@ emit(OpiIr *ir, OpiBytecode *bc, struct stack *stack, int tc)
       return opi_bytecode_const(bc, opi_nil);
     }
 
+    case OPI_IR_YIELD:
+    {
+      int val = emit(ir->ret, bc, stack, FALSE);
+      opi_bytecode_yield(bc, val);
+      return opi_bytecode_const(bc, opi_nil);
+    }
+
     case OPI_IR_SETVAR:
     {
       if ((int)stack->size < ir->setvar.var) {
@@ -0,0 +1,377 @@
+#include "opium/hamt.h"
+#include "opium/hash-map.h"
+
+#define BITS 5
+#define MASK ((1 << BITS) - 1)
+
+typedef struct Slot_s {
+  size_t hash;
+  opi_t key; // NULL for a sub-node
+  union {
+    opi_t val;
+    OpiHamtNode *node;
+  };
+} Slot;
+
+/*
+ * Node holds slots for the set bits of the bitmap (in order). When all the
+ * bits of the hash are used up, entries with equal hashes are kept in a
+ * collision-node, which has zero bitmap.
+ */
+struct OpiHamtNode_s {
+  size_t rc;
+  uint32_t bitmap;
+  uint32_t n;
+  Slot slots[];
+};
+
+static inline size_t
+node_size(uint32_t n)
+{ return sizeof(OpiHamtNode) + sizeof(Slot) * n; }
+
+static OpiHamtNode*
+node_new(uint32_t bitmap, uint32_t n)
+{
+  OpiHamtNode *node = opi_alloc(node_size(n));
+  node->rc = 1;
+  node->bitmap = bitmap;
+  node->n = n;
+  return node;
+}
+
+static void
+slot_ref(Slot *slot)
+{
+  if (slot->key) {
+    opi_inc_rc(slot->key);
+    opi_inc_rc(slot->val);
+  } else {
+    slot->node->rc += 1;
+  }
+}
+
+static void
+node_unref(OpiHamtNode *node)
+{
+  if (--node->rc > 0)
+    return;
+  for (uint32_t i = 0; i < node->n; ++i) {
+    Slot *slot = node->slots + i;
+    if (slot->key) {
+      opi_unref(slot->key);
+      opi_unref(slot->val);
+    } else {
+      node_unref(slot->node);
+    }
+  }
+  opi_free(node, node_size(node->n));
+}
+
+/*
+ * Replace node by a copy with slot inserted at `pos` (if `d` is 1), removed
+ * from `pos` (if `d` is -1), or the same slots (if `d` is 0). Unshared node is
+ * moved into the copy, shared one is left to other owners.
+ */
+static OpiHamtNode*
+node_reshape(OpiHamtNode **pnode, uint32_t pos, int d)
+{
+  OpiHamtNode *old = *pnode;
+  if (d == 0 && old->rc == 1)
+    return old;
+
+  OpiHamtNode *node = node_new(old->bitmap, old->n + d);
+  Slot *src = old->slots;
+  Slot *dst = node->slots;
+  if (d >= 0) {
+    memcpy(dst, src, sizeof(Slot) * pos);
+    memcpy(dst + pos + d, src + pos, sizeof(Slot) * (old->n - pos));
+  } else {
+    memcpy(dst, src, sizeof(Slot) * pos);
+    memcpy(dst + pos, src + pos + 1, sizeof(Slot) * (old->n - pos - 1));
+  }
+
+  if (old->rc == 1) {
+    // removed slot is released by the caller
+    opi_free(old, node_size(old->n));
+  } else {
+    old->rc -= 1;
+    for (uint32_t i = 0; i < old->n; ++i) {
+      if (d < 0 && i == pos)
+        continue;
+      slot_ref(old->slots + i);
+    }
+  }
+  return *pnode = node;
+}
+
+static inline uint32_t
+index_of(size_t hash, int shift)
+{ return (hash >> shift) & MASK; }
+
+static inline uint32_t
+pos_of(uint32_t bitmap, uint32_t bit)
+{ return __builtin_popcount(bitmap & (bit - 1)); }
+
+/*
+ * Build node holding two entries with different keys.
+ */
+static OpiHamtNode*
+node_pair(int shift, Slot *a, Slot *b)
+{
+  if (shift >= 64) {
+    OpiHamtNode *node = node_new(0, 2);
+    node->slots[0] = *a;
+    node->slots[1] = *b;
+    return node;
+  }
+
+  uint32_t ia = index_of(a->hash, shift);
+  uint32_t ib = index_of(b->hash, shift);
+  if (ia == ib) {
+    OpiHamtNode *node = node_new(1u << ia, 1);
+    node->slots[0].key = NULL;
+    node->slots[0].node = node_pair(shift + BITS, a, b);
+    return node;
+  }
+
+  OpiHamtNode *node = node_new((1u << ia) | (1u << ib), 2);
+  node->slots[ia > ib] = *a;
+  node->slots[ia < ib] = *b;
+  return node;
+}
+
+static Slot*
+node_find(OpiHamtNode *node, opi_t key, size_t hash)
+{
+  for (int shift = 0; node; shift += BITS) {
+    if (node->bitmap == 0) {
+      for (uint32_t i = 0; i < node->n; ++i) {
+        Slot *slot = node->slots + i;
+        if (slot->hash == hash && opi_equal(slot->key, key))
+          return slot;
+      }
+      return NULL;
+    }
+
+    uint32_t bit = 1u << index_of(hash, shift);
+    if (!(node->bitmap & bit))
+      return NULL;
+    Slot *slot = node->slots + pos_of(node->bitmap, bit);
+    if (slot->key)
+      return slot->hash == hash && opi_equal(slot->key, key) ? slot : NULL;
+    node = slot->node;
+  }
+  return NULL;
+}
+
+/*
+ * Insert entry with a key known to be missing from the node.
+ */
+static void
+node_insert(OpiHamtNode **pnode, int shift, Slot *entry)
+{
+  OpiHamtNode *node = *pnode;
+
+  if (node->bitmap == 0) {
+    node = node_reshape(pnode, node->n, 1);
+    node->slots[node->n - 1] = *entry;
+    return;
+  }
+
+  uint32_t bit = 1u << index_of(entry->hash, shift);
+  uint32_t pos = pos_of(node->bitmap, bit);
+  if (!(node->bitmap & bit)) {
+    node = node_reshape(pnode, pos, 1);
+    node->bitmap |= bit;
+    node->slots[pos] = *entry;
+    return;
+  }
+
+  node = node_reshape(pnode, pos, 0);
+  Slot *slot = node->slots + pos;
+  if (slot->key) {
+    Slot old = *slot;
+    slot->key = NULL;
+    slot->node = node_pair(shift + BITS, &old, entry);
+  } else {
+    node_insert(&slot->node, shift + BITS, entry);
+  }
+}
+
+/*
+ * Replace value of the entry with a key known to be present in the node.
+ */
+static void
+node_replace(OpiHamtNode **pnode, int shift, Slot *entry)
+{
+  OpiHamtNode *node = node_reshape(pnode, 0, 0);
+
+  if (node->bitmap == 0) {
+    for (uint32_t i = 0; i < node->n; ++i) {
+      Slot *slot = node->slots + i;
+      if (slot->hash == entry->hash && opi_equal(slot->key, entry->key)) {
+        opi_unref(slot->val);
+        slot->val = entry->val;
+        opi_unref(entry->key);
+        return;
+      }
+    }
+    opi_assert(!"key is missing");
+  }
+
+  uint32_t bit = 1u << index_of(entry->hash, shift);
+  Slot *slot = node->slots + pos_of(node->bitmap, bit);
+  if (slot->key) {
+    opi_unref(slot->val);
+    slot->val = entry->val;
+    opi_unref(entry->key);
+  } else {
+    node_replace(&slot->node, shift + BITS, entry);
+  }
+}
+
+static void
+release_entry(Slot *slot)
+{
+  opi_unref(slot->key);
+  opi_unref(slot->val);
+}
+
+/*
+ * Remove entry with a key known to be present in the node. Sub-nodes left
+ * with a single entry are collapsed into their parent.
+ */
+static void
+node_erase(OpiHamtNode **pnode, int shift, opi_t key, size_t hash)
+{
+  OpiHamtNode *node = *pnode;
+
+  if (node->bitmap == 0) {
+    for (uint32_t i = 0; i < node->n; ++i) {
+      Slot *slot = node->slots + i;
+      if (slot->hash == hash && opi_equal(slot->key, key)) {
+        Slot old = *slot;
+        int shared = node->rc > 1;
+        node_reshape(pnode, i, -1);
+        if (!shared)
+          release_entry(&old);
+        return;
+      }
+    }
+    opi_assert(!"key is missing");
+  }
+
+  uint32_t bit = 1u << index_of(hash, shift);
+  uint32_t pos = pos_of(node->bitmap, bit);
+  Slot *slot = node->slots + pos;
+  if (slot->key) {
+    Slot old = *slot;
+    int shared = node->rc > 1;
+    node = node_reshape(pnode, pos, -1);
+    node->bitmap &= ~bit;
+    if (!shared)
+      release_entry(&old);
+    return;
+  }
+
+  node = node_reshape(pnode, pos, 0);
+  slot = node->slots + pos;
+  node_erase(&slot->node, shift + BITS, key, hash);
+
+  OpiHamtNode *child = slot->node;
+  if (child->n == 1 && child->slots[0].key) {
+    // the child was made unshared by the erase, so just move the entry
+    *slot = child->slots[0];
+    opi_free(child, node_size(1));
+  }
+}
+
+void
+opi_hamt_init(OpiHamt *hamt)
+{
+  hamt->size = 0;
+  hamt->root = NULL;
+}
+
+void
+opi_hamt_destroy(OpiHamt *hamt)
+{
+  if (hamt->root)
+    node_unref(hamt->root);
+}
+
+void
+opi_hamt_share(OpiHamt *dst, OpiHamt *src)
+{
+  *dst = *src;
+  if (dst->root)
+    dst->root->rc += 1;
+}
+
+opi_t
+opi_hamt_find(OpiHamt *hamt, opi_t key, size_t hash)
+{
+  Slot *slot = node_find(hamt->root, key, opi_hash_mix(hash));
+  return slot ? slot->val : NULL;
+}
+
+int
+opi_hamt_insert(OpiHamt *hamt, opi_t key, size_t hash, opi_t val, int replace)
+{
+  Slot entry = { .hash = opi_hash_mix(hash), .key = key, .val = val };
+  int found = node_find(hamt->root, key, entry.hash) != NULL;
+  if (found && !replace)
+    return FALSE;
+
+  opi_inc_rc(key);
+  opi_inc_rc(val);
+  if (found) {
+    node_replace(&hamt->root, 0, &entry);
+  } else if (hamt->root == NULL) {
+    uint32_t bit = 1u << index_of(entry.hash, 0);
+    hamt->root = node_new(bit, 1);
+    hamt->root->slots[0] = entry;
+    hamt->size = 1;
+  } else {
+    node_insert(&hamt->root, 0, &entry);
+    hamt->size += 1;
+  }
+  return TRUE;
+}
+
+int
+opi_hamt_erase(OpiHamt *hamt, opi_t key, size_t hash)
+{
+  hash = opi_hash_mix(hash);
+  if (!node_find(hamt->root, key, hash))
+    return FALSE;
+
+  node_erase(&hamt->root, 0, key, hash);
+  hamt->size -= 1;
+  if (hamt->size == 0) {
+    node_unref(hamt->root);
+    hamt->root = NULL;
+  }
+  return TRUE;
+}
+
+static void
+node_foreach(OpiHamtNode *node, void (*fn)(opi_t key, opi_t val, void *data),
+    void *data)
+{
+  for (uint32_t i = 0; i < node->n; ++i) {
+    Slot *slot = node->slots + i;
+    if (slot->key)
+      fn(slot->key, slot->val, data);
+    else
+      node_foreach(slot->node, fn, data);
+  }
+}
+
+void
+opi_hamt_foreach(OpiHamt *hamt, void (*fn)(opi_t key, opi_t val, void *data),
+    void *data)
+{
+  if (hamt->root)
+    node_foreach(hamt->root, fn, data);
+}
@@ -1,21 +1,232 @@
 #include "opium/hash-map.h"
 
+#include <time.h>
+#include <unistd.h>
+
 extern uint64_t
 siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
 
+// random per process (see opi_hash_init())
+static uint8_t g_key[16];
+static uint64_t g_seed;
+
+static uint64_t (*g_hash)(const char *p, size_t n);
+
+/******************************************************************************/
+// wyhash (final version 4) by Wang Yi, released into the public domain.
+static const uint64_t wy_s0 = 0xa0761d6478bd642full;
+static const uint64_t wy_s1 = 0xe7037ed1a0b428dbull;
+static const uint64_t wy_s2 = 0x8ebc6af09c88c6e3ull;
+static const uint64_t wy_s3 = 0x589965cc75374cc3ull;
+
+static inline void
+wy_mum(uint64_t *a, uint64_t *b)
+{
+  __uint128_t r = *a;
+  r *= *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+wy_mix(uint64_t a, uint64_t b)
+{
+  wy_mum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t
+wy_r8(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t
+wy_r4(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint64_t
+wy_r3(const uint8_t *p, size_t k)
+{ return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1]; }
+
+static uint64_t
+wyhash(const uint8_t *p, size_t len, uint64_t seed)
+{
+  uint64_t a, b;
+  seed ^= wy_mix(seed ^ wy_s0, wy_s1);
+
+  if (opi_likely(len <= 16)) {
+    if (len >= 4) {
+      size_t off = (len >> 3) << 2;
+      a = (wy_r4(p) << 32) | wy_r4(p + off);
+      b = (wy_r4(p + len - 4) << 32) | wy_r4(p + len - 4 - off);
+    } else if (len > 0) {
+      a = wy_r3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wy_mix(wy_r8(p) ^ wy_s1, wy_r8(p + 8) ^ seed);
+        see1 = wy_mix(wy_r8(p + 16) ^ wy_s2, wy_r8(p + 24) ^ see1);
+        see2 = wy_mix(wy_r8(p + 32) ^ wy_s3, wy_r8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wy_mix(wy_r8(p) ^ wy_s1, wy_r8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = wy_r8(p + i - 16);
+    b = wy_r8(p + i - 8);
+  }
+
+  a ^= wy_s1;
+  b ^= seed;
+  wy_mum(&a, &b);
+  return wy_mix(a ^ wy_s0 ^ len, b ^ wy_s1);
+}
+
+/******************************************************************************/
+uint64_t
+opi_hash_fast(const char *p, size_t n)
+{ return wyhash((const uint8_t*)p, n, g_seed); }
+
+uint64_t
+opi_hash_sip(const char *p, size_t n)
+{ return siphash((const uint8_t*)p, n, g_key); }
+
 uint64_t
 opi_hash(const char* p, size_t n)
+{ return g_hash(p, n); }
+
+void
+opi_hash_init(int use_siphash)
+{
+  FILE *urandom = fopen("/dev/urandom", "rb");
+  if (!urandom || fread(g_key, sizeof g_key, 1, urandom) != 1) {
+    opi_warning("failed to read /dev/urandom, hash seed will be predictable\n");
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t x[2] = { ts.tv_sec ^ ((uint64_t)getpid() << 32), ts.tv_nsec };
+    memcpy(g_key, x, sizeof g_key);
+  }
+  if (urandom)
+    fclose(urandom);
+
+  memcpy(&g_seed, g_key, sizeof g_seed);
+  g_hash = use_siphash ? opi_hash_sip : opi_hash_fast;
+}
+
+/******************************************************************************/
+#define GROUP OPI_HASH_MAP_GROUP
+#define EMPTY OPI_HASH_MAP_EMPTY
+#define DELETED OPI_HASH_MAP_DELETED
+
+// bitmasks of slots in the group (bit i for slot i)
+#ifdef __SSE2__
+# include <emmintrin.h>
+
+static inline uint32_t
+group_match(const int8_t *g, int8_t h)
+{
+  __m128i ctrl = _mm_loadu_si128((const __m128i*)g);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h), ctrl));
+}
+
+static inline uint32_t
+group_mask_free(const int8_t *g)
+{
+  __m128i ctrl = _mm_loadu_si128((const __m128i*)g);
+  return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl));
+}
+
+#else
+
+static inline uint32_t
+group_match(const int8_t *g, int8_t h)
 {
-  static uint8_t key[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
-  return siphash((const uint8_t*)p, n, key);
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP; ++i)
+    mask |= (uint32_t)(g[i] == h) << i;
+  return mask;
+}
+
+static inline uint32_t
+group_mask_free(const int8_t *g)
+{
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP; ++i)
+    mask |= (uint32_t)(g[i] < -1) << i;
+  return mask;
+}
+
+#endif
+
+static inline uint32_t
+group_mask_empty(const int8_t *g)
+{ return group_match(g, EMPTY); }
+
+static inline size_t
+h1(size_t hash)
+{ return hash >> 7; }
+
+static inline int8_t
+h2(size_t hash)
+{ return hash & 0x7F; }
+
+static inline size_t
+growth_of(size_t cap)
+{ return cap - cap / 8; }
+
+static inline void
+set_ctrl(OpiHashMap *map, size_t i, int8_t h)
+{
+  map->ctrl[i] = h;
+  // mirror first group behind the end, so that groups never wrap around
+  map->ctrl[((i - (GROUP - 1)) & (map->cap - 1)) + (GROUP - 1)] = h;
+}
+
+static void
+alloc_slots(OpiHashMap *map, size_t cap)
+{
+  map->cap = cap;
+  map->growth_left = growth_of(cap);
+  map->ctrl = malloc(cap + GROUP);
+  memset(map->ctrl, EMPTY, cap + GROUP);
+  map->data = malloc(sizeof(OpiHashMapElt) * cap);
 }
 
 void
-opi_hash_map_init(OpiHashMap *map)
+opi_hash_map_init(OpiHashMap *map, size_t reserve)
 {
-  map->cap = 0x100;
   map->size = 0;
-  map->data = calloc(map->cap, sizeof(OpiHashMapElt));
+  if (reserve == 0) {
+    map->cap = 0;
+    map->growth_left = 0;
+    map->ctrl = NULL;
+    map->data = NULL;
+    return;
+  }
+
+  size_t cap = GROUP;
+  while (growth_of(cap) < reserve)
+    cap <<= 1;
+  alloc_slots(map, cap);
 }
 
 void
@@ -28,92 +239,101 @@ opi_hash_map_destroy(OpiHashMap *map)
     opi_unref(val);
     iter = opi_hash_map_next(map, iter);
   }
+  free(map->ctrl);
   free(map->data);
 }
 
-static OpiHashMapElt*
-find(OpiHashMapElt *data, size_t cap, opi_t key, size_t hash)
-{
-  for (size_t inc = 0, idx = hash & (cap - 1); TRUE; inc += 1, idx += inc) {
-    OpiHashMapElt *elt = data + idx;
-    if (elt->key == NULL) {
-      // Found empty cell.
-      return elt;
+/*
+ * Walk groups starting from h1 of the mixed hash (triangular probing over
+ * groups visits every group for power-of-two capacities).
+ */
+#define PROBE(map, mh, pos)                                                   \
+  for (size_t pos = h1(mh) & ((map)->cap - 1), stride_ = 0; TRUE;            \
+       stride_ += GROUP, pos = (pos + stride_) & ((map)->cap - 1))
 
-    } else if (elt->hash == hash && opi_equal(key, elt->key)) {
-      // Found cell with matching key:
-      return elt;
-    }
-  }
-}
+#define FIND(map, key, hash, eq)                                              \
+  do {                                                                        \
+    if (map->cap == 0)                                                        \
+      return NULL;                                                            \
+    size_t mh = opi_hash_mix(hash);                                           \
+    PROBE(map, mh, pos) {                                                     \
+      const int8_t *g = map->ctrl + pos;                                      \
+      for (uint32_t m = group_match(g, h2(mh)); m; m &= m - 1) {              \
+        OpiHashMapElt *elt =                                                  \
+          map->data + ((pos + __builtin_ctz(m)) & (map->cap - 1));            \
+        if (elt->hash == hash && eq(key, elt->key))                           \
+          return elt;                                                         \
+      }                                                                       \
+      if (group_mask_empty(g))                                                \
+        return NULL;                                                          \
+    }                                                                         \
+  } while (0)
 
 static OpiHashMapElt*
-find_is(OpiHashMapElt *data, size_t cap, opi_t key, size_t hash)
-{
-  for (size_t inc = 0, idx = hash & (cap - 1); TRUE; inc += 1, idx += inc) {
-    OpiHashMapElt *elt = data + idx;
-    if (elt->key == NULL) {
-      // Found empty cell.
-      return elt;
+find(OpiHashMap *map, opi_t key, size_t hash)
+{ FIND(map, key, hash, opi_equal); }
 
-    } else if (elt->hash == hash && opi_is(key, elt->key)) {
-      // Found cell with matching key:
-      return elt;
-    }
+static OpiHashMapElt*
+find_is(OpiHashMap *map, opi_t key, size_t hash)
+{ FIND(map, key, hash, opi_is); }
+
+/*
+ * Find first empty or deleted slot for the (mixed) hash.
+ */
+static size_t
+find_free(OpiHashMap *map, size_t mh)
+{
+  PROBE(map, mh, pos) {
+    uint32_t m = group_mask_free(map->ctrl + pos);
+    if (m)
+      return (pos + __builtin_ctz(m)) & (map->cap - 1);
   }
 }
 
 int
 opi_hash_map_find(OpiHashMap *map, opi_t key, size_t hash, OpiHashMapElt **elt)
 {
-  OpiHashMapElt *myelt = find(map->data, map->cap, key, hash);
+  OpiHashMapElt *myelt = find(map, key, hash);
   if (elt)
     *elt = myelt;
-  return myelt->key != NULL;
+  return myelt != NULL;
 }
 
 int
 opi_hash_map_find_is(OpiHashMap *map, opi_t key, size_t hash, OpiHashMapElt **elt)
 {
-  OpiHashMapElt *myelt = find_is(map->data, map->cap, key, hash);
+  OpiHashMapElt *myelt = find_is(map, key, hash);
   if (elt)
     *elt = myelt;
-  return myelt->key != NULL;
+  return myelt != NULL;
 }
 
 static void
 rehash(OpiHashMap *map, size_t new_cap)
 {
+  int8_t *old_ctrl = map->ctrl;
   OpiHashMapElt *old_data = map->data;
   size_t old_cap = map->cap;
-  OpiHashMapElt *new_data = calloc(new_cap, sizeof(OpiHashMapElt));
 
+  alloc_slots(map, new_cap);
   for (size_t i = 0; i < old_cap; ++i) {
-    OpiHashMapElt *old_elt = old_data + i;
-    if (old_elt->key != NULL) {
-      OpiHashMapElt *new_elt = find(new_data, new_cap, old_elt->key, old_elt->hash);
-      *new_elt = *old_elt;
+    if (old_ctrl[i] >= 0) {
+      size_t mh = opi_hash_mix(old_data[i].hash);
+      size_t j = find_free(map, mh);
+      set_ctrl(map, j, h2(mh));
+      map->data[j] = old_data[i];
     }
   }
-  free(old_data);
+  map->growth_left -= map->size;
 
-  map->cap = new_cap;
-  map->data = new_data;
+  free(old_ctrl);
+  free(old_data);
 }
 
 void
 opi_hash_map_insert(OpiHashMap *map, opi_t key, size_t hash, opi_t val, OpiHashMapElt *elt)
 {
-  if (elt->key == NULL) {
-    // Must insert new element => check load factor and rehash if needed.
-    map->size += 1;
-    if ((map->size * 100) / map->cap > 70) {
-      rehash(map, map->cap << 1);
-      // repeat search for new data-array
-      elt = find(map->data, map->cap, key, hash);
-    }
-
-  } else {
+  if (elt) {
     // replace old value with new one
     opi_inc_rc(val);
     opi_unref(elt->val);
@@ -121,9 +341,59 @@ opi_hash_map_insert(OpiHashMap *map, opi_t key, size_t hash, opi_t val, OpiHashM
     return;
   }
 
+  // Must insert new element => make sure there is room for it.
+  size_t mh = opi_hash_mix(hash);
+  size_t i;
+  if (map->cap == 0) {
+    alloc_slots(map, GROUP);
+    i = find_free(map, mh);
+  } else {
+    i = find_free(map, mh);
+    if (map->growth_left == 0 && map->ctrl[i] == EMPTY) {
+      // grow unless the room is occupied by deleted slots
+      size_t new_cap = map->size > growth_of(map->cap) / 2 ? map->cap << 1
+                                                           : map->cap;
+      rehash(map, new_cap);
+      i = find_free(map, mh);
+    }
+  }
+
+  map->size += 1;
+  map->growth_left -= map->ctrl[i] == EMPTY;
+  set_ctrl(map, i, h2(mh));
+
   // insert new element
+  elt = map->data + i;
   opi_inc_rc(elt->key = key);
   opi_inc_rc(elt->val = val);
   elt->hash = hash;
 }
 
+void
+opi_hash_map_erase(OpiHashMap *map, OpiHashMapElt *elt)
+{
+  opi_unref(elt->key);
+  opi_unref(elt->val);
+  opi_hash_map_forget(map, elt);
+}
+
+void
+opi_hash_map_forget(OpiHashMap *map, OpiHashMapElt *elt)
+{
+  size_t i = elt - map->data;
+  map->size -= 1;
+
+  // If no probe could have passed through this slot (there is an empty slot
+  // within a group from either side), it may become empty again; otherwise
+  // leave a tombstone.
+  uint32_t after = group_mask_empty(map->ctrl + i);
+  size_t i_before = (i - GROUP) & (map->cap - 1);
+  uint32_t before = group_mask_empty(map->ctrl + i_before);
+  if (after && before &&
+      __builtin_ctz(after) + __builtin_clz(before << (32 - GROUP)) < GROUP) {
+    set_ctrl(map, i, EMPTY);
+    map->growth_left += 1;
+  } else {
+    set_ctrl(map, i, DELETED);
+  }
+}
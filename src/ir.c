@@ -59,6 +59,7 @@ opi_builder_init(OpiBuilder *bldr, OpiContext *ctx)
 
   cod_vec_init(bldr->decls);
   bldr->frame_offset = 0;
+  bldr->is_generator = FALSE;
 
   opi_alist_init(bldr->alist = malloc(sizeof(OpiAlist)));
 
@@ -74,7 +75,8 @@ opi_builder_init(OpiBuilder *bldr, OpiContext *ctx)
   cod_ptrvec_init(bldr->traits = malloc(sizeof(struct cod_ptrvec)));
 
   opi_builder_def_type(bldr, "Undefined", opi_undefined_type); cod_vec_pop(ctx->types);
-  opi_builder_def_type(bldr, "Num"      , opi_num_type      ); cod_vec_pop(ctx->types);
+  opi_builder_def_type(bldr, "Int"      , opi_int_type      ); cod_vec_pop(ctx->types);
+  opi_builder_def_type(bldr, "Float"    , opi_float_type    ); cod_vec_pop(ctx->types);
   opi_builder_def_type(bldr, "Sym"      , opi_symbol_type   ); cod_vec_pop(ctx->types);
   opi_builder_def_type(bldr, "Nil"      , opi_nil_type      ); cod_vec_pop(ctx->types);
   opi_builder_def_type(bldr, "Str"      , opi_str_type      ); cod_vec_pop(ctx->types);
@@ -106,6 +108,7 @@ opi_builder_init_derived(OpiBuilder *bldr, OpiBuilder *parent)
 
   cod_vec_init(bldr->decls);
   bldr->frame_offset = 0;
+  bldr->is_generator = FALSE;
 
   bldr->alist = parent->alist;
 
@@ -466,7 +469,7 @@ opi_struct_delete(opi_type_t type, opi_t x)
   size_t nfields = opi_type_get_nfields(type);
   for (size_t i = 0; i < nfields; ++i)
     opi_unref(s->data[i]);
-  free(s);
+  opi_free(s, sizeof(struct opi_struct) + sizeof(opi_t) * nfields);
 }
 
 static int
@@ -488,7 +491,7 @@ make_struct(void)
   opi_type_t type = opi_current_fn->data;
   size_t nfields = opi_type_get_nfields(type);
 
-  struct opi_struct *s = malloc(sizeof(struct opi_struct) + sizeof(opi_t) * nfields);
+  struct opi_struct *s = opi_alloc(sizeof(struct opi_struct) + sizeof(opi_t) * nfields);
   for (size_t i = 0; i < nfields; ++i) {
     opi_t x = opi_get(i + 1);
     opi_inc_rc(s->data[i] = x);
@@ -515,7 +518,7 @@ static opi_t
 copy_ctor(void)
 {
   CopyCtorData *restrict data = opi_current_fn->data;
-  if (opi_get(1)->type != data->type) {
+  if (opi_typeof(opi_get(1)) != data->type) {
     OPI_BEGIN_FN()
     OPI_THROW("type-error");
   }
@@ -527,7 +530,7 @@ copy_ctor(void)
     //
     // Construct new struct.
     //
-    struct opi_struct *s = malloc(sizeof(struct opi_struct) + sizeof(opi_t) * nflds);
+    struct opi_struct *s = opi_alloc(sizeof(struct opi_struct) + sizeof(opi_t) * nflds);
     int n_new = opi_nargs - 1;
     for (int i = 0, i_offs = 0; i < nflds; ++i) {
       if (i_offs < n_new && data->offs[i_offs] == i) {
@@ -628,7 +631,7 @@ test_trait(void)
 {
   OpiTrait *trait = opi_current_fn->data;
   opi_t x = opi_pop();
-  opi_type_t type = x->type;
+  opi_type_t type = opi_typeof(x);
   opi_drop(x);
   return opi_trait_get_impl(trait, type, 0) ? opi_true : opi_false;
 }
@@ -905,6 +908,7 @@ opi_builder_build_ir(OpiBuilder *bldr, OpiAst *ast)
 
       // build body (with local builder)
       OpiIr *body = opi_builder_build_ir(&fn_bldr, ast->fn.body);
+      int is_generator = fn_bldr.is_generator;
 
       // process captures
       size_t ncaps = fn_bldr.frame_offset;
@@ -923,12 +927,14 @@ opi_builder_build_ir(OpiBuilder *bldr, OpiAst *ast)
 
       if (ncaps > 0) {
         /* Runtime lambda constructor. */
-        return opi_ir_fn(caps, ncaps, ast->fn.nargs, body);
+        OpiIr *ret = opi_ir_fn(caps, ncaps, ast->fn.nargs, body);
+        ret->fn.is_generator = is_generator;
+        return ret;
 
       } else /* ncaps == 0 */ {
         /* Instant lambda constructor (i.e. create it NOW). */
         // emit bytecode
-        OpiBytecode *bc = opi_emit_free_fn_body(body, ast->fn.nargs);
+        OpiBytecode *bc = opi_emit_free_fn_body(body, ast->fn.nargs, is_generator);
 
         // create lambda
         OpiLambda *lam = opi_lambda_allocate(0);
@@ -936,8 +942,7 @@ opi_builder_build_ir(OpiBuilder *bldr, OpiAst *ast)
         lam->ir = body;
         opi_ir_ref(body);
         lam->ncaps = 0;
-        lam->scp = NULL;
-        opi_t fn = opi_fn_new(opi_lambda_fn, ast->fn.nargs);
+        opi_t fn = opi_fn_new(opi_lambda_handle(bc), ast->fn.nargs);
         void delete(OpiFn *fn) {
           OpiLambda* lam = fn->data;
           opi_bytecode_delete(lam->bc);
@@ -1310,6 +1315,14 @@ opi_builder_build_ir(OpiBuilder *bldr, OpiAst *ast)
     case OPI_AST_RETURN:
       return opi_ir_return(opi_builder_build_ir(bldr, ast->ret));
 
+    case OPI_AST_YIELD:
+      if (!opi_builder_is_derived(bldr)) {
+        opi_error("yield outside of a function\n");
+        return build_error();
+      }
+      bldr->is_generator = TRUE;
+      return opi_ir_yield(opi_builder_build_ir(bldr, ast->ret));
+
     case OPI_AST_BINOP:
       return opi_ir_binop(ast->binop.opc,
           opi_builder_build_ir(bldr, ast->binop.lhs),
@@ -1451,7 +1464,7 @@ opi_load(OpiBuilder *bldr, const char *path)
   opi_t ret = opi_vm(bc);
   opi_context_drain_bytecode(bldr->ctx, bc);
   opi_bytecode_delete(bc);
-  if (ret->type == opi_undefined_type) {
+  if (opi_typeof(ret) == opi_undefined_type) {
     opi_drop(ret);
     return OPI_ERR;
   }
@@ -1515,6 +1528,7 @@ _opi_ir_delete(OpiIr *node)
       break;
 
     case OPI_IR_RETURN:
+    case OPI_IR_YIELD:
       opi_ir_unref(node->ret);
       break;
 
@@ -1584,6 +1598,7 @@ opi_ir_fn(OpiIr **caps, size_t ncaps, size_t nargs, OpiIr *body)
   node->fn.ncaps = ncaps;
   node->fn.nargs = nargs;
   node->fn.body = body;
+  node->fn.is_generator = FALSE;
   opi_ir_ref_arr(caps, ncaps);
   opi_ir_ref(body);
   return node;
@@ -1703,6 +1718,16 @@ opi_ir_return(OpiIr *val)
   return node;
 }
 
+OpiIr*
+opi_ir_yield(OpiIr *val)
+{
+  OpiIr *node = ir_new();
+  node->tag = OPI_IR_YIELD;
+  node->ret = val;
+  opi_ir_ref(val);
+  return node;
+}
+
 OpiIr*
 opi_ir_binop(int opc, OpiIr *lhs, OpiIr *rhs)
 {
@@ -1,326 +1,819 @@
-#define OPI_USE_LIBJIT 0
-#if OPI_USE_LIBJIT
+#ifdef OPI_USE_LIBJIT
 
 #include "opium/opium.h"
+#include "opium/lambda.h"
 #include "jit/jit.h"
 
-typedef struct OpiJIT_s {
-  jit_function_t func;
-} OpiJIT;
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+
+/*
+ * Baseline JIT.
+ *
+ * Hot lambda bodies (see opi_jit_ready()) are translated instruction by
+ * instruction from the flat tape into LibJIT IR. Registers become local
+ * variables of the native function, control flow maps onto LibJIT labels,
+ * RC-operations, type tests and numeric fast paths are emitted inline, and
+ * everything else calls into the runtime.
+ *
+ * Compiled code follows the same calling convention as opi_vm(): arguments
+ * are taken from the argument stack and opi_current_fn refers to the lambda.
+ * Self tail calls become jumps to the beginning of the function; other tail
+ * calls set opi_current_fn and return opi_jit_tailcall to the trampoline in
+ * opi_lambda_fn().
+ */
+
+static jit_context_t g_ctx;
+
+static OpiHeader g_tailcall, g_selfcall;
+opi_t opi_jit_tailcall = &g_tailcall;
+
+static jit_type_t
+  g_sig_p_v,    // opi_t (void)
+  g_sig_v_v,    // void (void)
+  g_sig_p_n,    // opi_t (size_t)
+  g_sig_v_n,    // void (size_t)
+  g_sig_v_p,    // void (opi_t)
+  g_sig_p_pp,   // opi_t (opi_t, opi_t)
+  g_sig_v_pp,   // void (opi_t, opi_t)
+  g_sig_p_nppp, // opi_t (size_t, opi_t, opi_t, void*)
+  g_sig_p_pn,   // opi_t (opi_t, size_t)
+  g_sig_p_pnp,  // opi_t (opi_t, size_t, void*)
+  g_sig_p_f,    // opi_t (double)
+  g_sig_v_pppn; // void (opi_t, void*, void*, void*, size_t)
+
+static jit_type_t
+signature(jit_type_t ret, size_t nparams, ...)
+{
+  jit_type_t params[nparams];
+  va_list args;
+  va_start(args, nparams);
+  for (size_t i = 0; i < nparams; ++i)
+    params[i] = va_arg(args, jit_type_t);
+  va_end(args);
+  return jit_type_create_signature(jit_abi_cdecl, ret, params, nparams, 1);
+}
 
-typedef struct Block_s {
-  jit_label_t start, end;
-} Block;
+void
+opi_jit_init(void)
+{
+  jit_init();
+  g_ctx = jit_context_create();
+
+  jit_type_t p = jit_type_void_ptr,
+             n = jit_type_nuint,
+             v = jit_type_void,
+             f = jit_type_float64;
+  g_sig_p_v = signature(p, 0);
+  g_sig_v_v = signature(v, 0);
+  g_sig_p_n = signature(p, 1, n);
+  g_sig_v_n = signature(v, 1, n);
+  g_sig_v_p = signature(v, 1, p);
+  g_sig_p_pp = signature(p, 2, p, p);
+  g_sig_v_pp = signature(v, 2, p, p);
+  g_sig_p_nppp = signature(p, 4, n, p, p, p);
+  g_sig_p_pn = signature(p, 2, p, n);
+  g_sig_p_pnp = signature(p, 3, p, n, p);
+  g_sig_p_f = signature(p, 1, f);
+  g_sig_v_pppn = signature(v, 5, p, p, p, p, n);
+}
 
-static inline jit_value_t
-load_type(jit_function_t func, jit_value_t x)
+void
+opi_jit_cleanup(void)
 {
-  int offset = offsetof(OpiHeader, type);
-  return jit_insn_load_relative(func, x, offset, jit_type_void_ptr);
+  jit_type_free(g_sig_p_v);
+  jit_type_free(g_sig_v_v);
+  jit_type_free(g_sig_p_n);
+  jit_type_free(g_sig_v_n);
+  jit_type_free(g_sig_v_p);
+  jit_type_free(g_sig_p_pp);
+  jit_type_free(g_sig_v_pp);
+  jit_type_free(g_sig_p_nppp);
+  jit_type_free(g_sig_p_pn);
+  jit_type_free(g_sig_p_pnp);
+  jit_type_free(g_sig_p_f);
+  jit_type_free(g_sig_v_pppn);
+  jit_context_destroy(g_ctx);
 }
 
-static inline jit_value_t
-type_constant(jit_function_t func, opi_type_t type)
+/******************************************************************************/
+/*
+ * Runtime helpers called from compiled code.
+ */
+static opi_t
+rt_param(size_t offs)
+{ return opi_get(offs); }
+
+static void
+rt_popn(size_t n)
+{ opi_popn(n); }
+
+static void
+rt_push(opi_t x)
+{ opi_push(x); }
+
+static void
+rt_drop(opi_t x)
+{ opi_drop(x); }
+
+static void
+rt_unref(opi_t x)
+{ opi_unref(x); }
+
+static opi_t
+rt_ldcap(size_t idx)
 {
-  jit_constant_t c = {
-    .type = jit_type_void_ptr,
-    .un.ptr_value = type,
-  };
-  return jit_value_create_constant(func, &c);
+  OpiLambda *data = opi_current_fn->data;
+  return opi_lambda_ldcap(data, idx);
 }
 
-static inline jit_value_t
-type_is(jit_function_t func, jit_value_t ty1_val, opi_type_t ty2)
+static void
+rt_drain_frees(void)
+{ opi_drain_frees_safepoint(); }
+
+static opi_t
+rt_alcfn(void)
+{ return opi_fn_alloc(); }
+
+static void
+rt_finfn(opi_t fn, OpiFnInsnData *data, opi_t *caps, OpiRecScp *scp,
+    size_t iref)
 {
-  jit_value_t ty2_val = type_constant(func, ty2);
-  return jit_insn_eq(func, ty1_val, ty2_val);
+  size_t ncaps = data->ncaps;
+  OpiLambda *lam = opi_lambda_allocate(ncaps);
+  lam->bc = data->bc;
+  lam->ir = data->ir;
+  opi_ir_ref(lam->ir);
+  lam->ncaps = ncaps;
+  for (size_t i = 0; i < ncaps; ++i)
+    opi_inc_rc(lam->caps[i] = caps[i]);
+
+  opi_fn_finalize(fn, opi_lambda_handle(data->bc), data->arity);
+  opi_fn_set_data(fn, lam, opi_lambda_delete);
+
+  if (scp) {
+    lam->scpidx = iref;
+    opi_rec_scp_set(scp, iref, fn, (void*)opi_lam_destroy, (void*)opi_lam_free);
+  }
 }
 
-static inline jit_value_t
-test_type(jit_function_t func, jit_value_t x, opi_type_t type)
+static opi_t
+rt_begscp(size_t n)
+{ return (opi_t)opi_rec_scp_alloc(n); }
+
+static void
+rt_endscp(opi_t scp)
+{ opi_rec_scp_finalize((OpiRecScp*)scp); }
+
+static opi_t
+rt_float_new(double x)
+{ return opi_float_new(x); }
+
+static opi_t
+rt_cons(opi_t car, opi_t cdr)
+{ return opi_cons(car, cdr); }
+
+static void
+rt_setvar(opi_t var, opi_t x)
+{ opi_var_set(var, x); }
+
+static opi_t
+rt_trait_binop(OpiTrait *trait, OpiTraitCache *ic, opi_t lhs, opi_t rhs)
 {
-  return type_is(func, load_type(func, x), type);
+  opi_t gen = opi_trait_cache_get_impl(&ic[0], trait, opi_typeof(lhs), 0);
+  if (gen) {
+    opi_push(rhs);
+    opi_push(lhs);
+    return opi_apply(gen, 2);
+  } else if ((gen = opi_trait_cache_get_impl(&ic[1], trait, opi_typeof(rhs), 1))) {
+    opi_push(lhs);
+    opi_push(rhs);
+    return opi_apply(gen, 2);
+  } else {
+    return opi_undefined(opi_symbol("method-dispatch-error"));
+  }
 }
 
+/* Slow path of numeric binary operators (same semantics as in opi_vm()). */
+static opi_t
+rt_binop(size_t opc, opi_t lhs, opi_t rhs, OpiTraitCache *ic)
+{
+  int isnum = opi_is_num(lhs) && opi_is_num(rhs);
+
+  switch ((OpiOpc)opc) {
+    case OPI_OPC_ADD:
+      return isnum ? opi_num_add(lhs, rhs) : rt_trait_binop(opi_trait_add, ic, lhs, rhs);
+    case OPI_OPC_SUB:
+      return isnum ? opi_num_sub(lhs, rhs) : rt_trait_binop(opi_trait_sub, ic, lhs, rhs);
+    case OPI_OPC_MUL:
+      return isnum ? opi_num_mul(lhs, rhs) : rt_trait_binop(opi_trait_mul, ic, lhs, rhs);
+    case OPI_OPC_DIV:
+      return isnum ? opi_num_div(lhs, rhs) : rt_trait_binop(opi_trait_div, ic, lhs, rhs);
+    default:
+      break;
+  }
+
+  if (!isnum)
+    return opi_undefined(opi_symbol("type-error"));
+
+  if (opc == OPI_OPC_FMOD)
+    return opi_num_mod(lhs, rhs);
+
+  int c;
+  if (opi_is_int(lhs) & opi_is_int(rhs)) {
+    intmax_t x = opi_int_get_value(lhs), y = opi_int_get_value(rhs);
+    c = x < y ? -1 : x > y;
+  } else {
+    double x = opi_num_get_value(lhs), y = opi_num_get_value(rhs);
+    c = x < y ? -1 : x > y ? 1 : x == y ? 0 : 2; // 2 if unordered
+  }
+
+  switch ((OpiOpc)opc) {
+    case OPI_OPC_NUMEQ: return c == 0 ? opi_true : opi_false;
+    case OPI_OPC_NUMNE: return c != 0 ? opi_true : opi_false;
+    case OPI_OPC_LT: return c == -1 ? opi_true : opi_false;
+    case OPI_OPC_GT: return c == 1 ? opi_true : opi_false;
+    case OPI_OPC_LE: return c == -1 || c == 0 ? opi_true : opi_false;
+    case OPI_OPC_GE: return c == 1 || c == 0 ? opi_true : opi_false;
+    default:
+      opi_assert(!"unexpected binop");
+      abort();
+  }
+}
+
+static opi_t
+rt_apply(opi_t fn, size_t nargs)
+{
+  if (opi_unlikely(opi_typeof(fn) != opi_fn_type)) {
+    while (nargs--)
+      opi_drop(opi_pop());
+    return opi_undefined(opi_symbol("type-error"));
+  }
+  return opi_apply(fn, nargs);
+}
+
+static opi_t
+rt_applyi(opi_t fn, size_t nargs)
+{ return opi_fn_apply(fn, nargs); }
+
+static opi_t
+rt_applytc(opi_t fn, size_t nargs, OpiBytecode *self)
+{
+  if (opi_unlikely(opi_typeof(fn) != opi_fn_type)) {
+    while (nargs--)
+      opi_drop(opi_pop());
+    return opi_undefined(opi_symbol("type-error"));
+  }
+  if (opi_is_lambda(fn) & opi_test_arity(opi_fn_get_arity(fn), nargs)) {
+    OpiLambda *lam = OPI_FN(fn)->data;
+    opi_current_fn = OPI_FN(fn);
+    return lam->bc == self ? &g_selfcall : &g_tailcall;
+  }
+  return opi_apply(fn, nargs);
+}
+
+/******************************************************************************/
+/*
+ * Code generation.
+ */
+typedef struct Jit_s {
+  jit_function_t func;
+  OpiBytecode *bc;
+  jit_value_t *r;         // registers
+  jit_label_t *labels;    // labels for each instruction of the tape
+  jit_label_t start;      // beginning of the body (self tail calls)
+  jit_value_t caps;       // buffer to pass captures to rt_finfn()
+  jit_value_t scp;        // current recursive scope
+  int in_scope;
+  size_t scpcnt;
+} Jit;
+
 static inline jit_value_t
-const_ptr(jit_function_t func, void *ptr)
+const_ptr(jit_function_t func, const void *ptr)
 {
   jit_constant_t c = {
     .type = jit_type_void_ptr,
-    .un.ptr_value = ptr,
+    .un.ptr_value = (void*)ptr,
   };
   return jit_value_create_constant(func, &c);
 }
 
 static inline jit_value_t
-load_num(jit_function_t func, jit_value_t x)
-{
-  int offset = offsetof(OpiNum, val);
-  return jit_insn_load_relative(func, x, offset, jit_type_nfloat);
-}
+const_nuint(jit_function_t func, size_t x)
+{ return jit_value_create_nint_constant(func, jit_type_nuint, x); }
 
 static inline jit_value_t
-new_num(jit_function_t func, jit_value_t val)
-{
-  jit_type_t param[] = { jit_type_nfloat };
-  jit_type_t sig =
-    jit_type_create_signature(jit_abi_cdecl, jit_type_void_ptr, param, 1, 0);
-  jit_value_t ret = jit_insn_call_native(func, 0, opi_num_new, sig, &val, 1, 0);
-  jit_type_free(sig);
-  return ret;
-}
+call(jit_function_t func, const char *name, void *f, jit_type_t sig,
+    jit_value_t *args, unsigned int nargs)
+{ return jit_insn_call_native(func, name, f, sig, args, nargs, JIT_CALL_NOTHROW); }
+
+static inline void
+set(Jit *jit, uintptr_t reg, jit_value_t val)
+{ jit_insn_store(jit->func, jit->r[reg], val); }
+
+static inline void
+set_bool(Jit *jit, uintptr_t reg, jit_value_t test)
+{ set(jit, reg, jit_insn_convert(jit->func, test, jit_type_void_ptr, 0)); }
+
+static inline jit_value_t
+const_nint(jit_function_t func, intptr_t x)
+{ return jit_value_create_nint_constant(func, jit_type_nint, x); }
+
+static inline jit_value_t
+as_nint(jit_function_t func, jit_value_t x)
+{ return jit_insn_convert(func, x, jit_type_nint, 0); }
+
+static inline jit_value_t
+is_imm(jit_function_t func, jit_value_t x)
+{ return jit_insn_and(func, as_nint(func, x), const_nint(func, OPI_IMM_TAG)); }
 
 static inline jit_value_t
-cons(jit_function_t func, jit_value_t car, jit_value_t cdr)
+load_header_type(jit_function_t func, jit_value_t x)
+{ return jit_insn_load_relative(func, x, offsetof(OpiHeader, type), jit_type_void_ptr); }
+
+/* Same as opi_typeof(). */
+static jit_value_t
+load_type(jit_function_t func, jit_value_t x)
 {
-  jit_type_t param[] = { jit_type_void_ptr, jit_type_void_ptr };
-  jit_type_t sig =
-    jit_type_create_signature(jit_abi_cdecl, jit_type_void_ptr, param, 2, 0);
-  jit_value_t arg[] = { car, cdr };
-  jit_value_t ret = jit_insn_call_native(func, 0, opi_cons, sig, arg, 2, 0);
-  jit_type_free(sig);
-  return ret;
+  jit_value_t ty = jit_value_create(func, jit_type_void_ptr);
+  jit_label_t boxed = jit_label_undefined,
+              done = jit_label_undefined;
+  jit_insn_branch_if_not(func, is_imm(func, x), &boxed);
+  jit_insn_store(func, ty, const_ptr(func, opi_int_type));
+  jit_insn_branch(func, &done);
+  jit_insn_label(func, &boxed);
+  jit_insn_store(func, ty, load_header_type(func, x));
+  jit_insn_label(func, &done);
+  return ty;
 }
 
+static inline jit_value_t
+test_type(jit_function_t func, jit_value_t x, opi_type_t type)
+{ return jit_insn_eq(func, load_type(func, x), const_ptr(func, type)); }
+
+static inline jit_value_t
+load_num(jit_function_t func, jit_value_t x)
+{ return jit_insn_load_relative(func, x, offsetof(OpiFloat, val), jit_type_float64); }
+
 static inline jit_value_t
 boolean(jit_function_t func, jit_value_t x)
 {
   static opi_t false_true[2];
   false_true[0] = opi_false;
   false_true[1] = opi_true;
-  jit_constant_t c = {
-    .type = jit_type_void_ptr,
-    .un.ptr_value = false_true,
-  };
-  jit_value_t tf = jit_value_create_constant(func, &c);
+  jit_value_t tf = const_ptr(func, false_true);
   return jit_insn_load_elem(func, tf, x, jit_type_void_ptr);
 }
 
 static inline void
-guard(jit_function_t func)
+add_rc(jit_function_t func, jit_value_t x, int d)
 {
-  jit_type_t sig =
-    jit_type_create_signature(jit_abi_cdecl, jit_type_void, 0, 0, 0);
-  jit_insn_call_native(func, "abort", abort, sig, 0, 0, 0);
-  jit_type_free(sig);
+  int offs = offsetof(OpiHeader, rc);
+  jit_label_t skip = jit_label_undefined;
+  jit_insn_branch_if(func, is_imm(func, x), &skip);
+  jit_value_t rc = jit_insn_load_relative(func, x, offs, jit_type_uint);
+  jit_value_t dv = jit_value_create_nint_constant(func, jit_type_uint, d);
+  jit_value_t newrc = jit_insn_convert(func, jit_insn_add(func, rc, dv), jit_type_uint, 0);
+  jit_insn_store_relative(func, x, offs, newrc);
+  jit_insn_label(func, &skip);
 }
 
-static int
-jit(OpiJIT *jit, OpiBytecode *bc)
+/* Same as opi_drain_frees_safepoint(), with the common empty-queue check
+ * inlined. */
+static inline void
+drain_frees(jit_function_t func)
 {
-  jit_value_t r[bc->nvals];
-  OpiInsn *ip = bc->head;
+  jit_label_t skip = jit_label_undefined;
+  jit_value_t len = jit_insn_load_relative(func, const_ptr(func, &opi_free_queue),
+      offsetof(OpiFreeQueue, len), jit_type_nuint);
+  jit_insn_branch_if_not(func, len, &skip);
+  call(func, "drain_frees", rt_drain_frees, g_sig_v_v, NULL, 0);
+  jit_insn_label(func, &skip);
+}
 
-  cod_vec(Block) tail_blocks;
-  cod_vec_init(tail_blocks);
+static inline void
+push(jit_function_t func, jit_value_t x)
+{ call(func, "opi_push", rt_push, g_sig_v_p, &x, 1); }
 
+static void
+binop(Jit *jit, OpiFlatInsn *ip)
+{
   jit_function_t func = jit->func;
-
-  while (1) {
-    switch (ip->opc) {
-      case OPI_OPC_END:
-        goto end;
-        
-      case OPI_OPC_NOP:
-        break;
-
-      case OPI_OPC_VAR:
-        r[OPI_VAR_REG(ip)] = jit_value_create(func, jit_type_int);
-        break;
-
-      case OPI_OPC_SET:
-      {
-        jit_value_t dest = r[OPI_SET_REG(ip)];
-        jit_constant_t c = {
-          .type = jit_type_int,
-          .un.int_value = OPI_SET_ARG_VAL(ip),
-        };
-        jit_value_t val = jit_value_create_constant(func, &c);
-        jit_insn_store(func, dest, val);
-        break;
+  OpiOpc opc = ip->opc;
+  // unchecked variants share the code (the slow path never fails for them)
+  if (opc >= OPI_OPC_ADD_NN)
+    opc = opc - OPI_OPC_ADD_NN + OPI_OPC_ADD;
+  jit_value_t lhs = jit->r[OPI_BINOP_REG_LHS(ip)];
+  jit_value_t rhs = jit->r[OPI_BINOP_REG_RHS(ip)];
+  int iscmp = opc >= OPI_OPC_NUMEQ;
+
+  jit_label_t boxed = jit_label_undefined,
+              slow = jit_label_undefined,
+              done = jit_label_undefined;
+
+  // Both immediates: compare tagged words directly, or add/subtract untagged
+  // values (can't overflow a machine word) and retag if the result fits.
+  if (iscmp || opc == OPI_OPC_ADD || opc == OPI_OPC_SUB) {
+    jit_value_t a = as_nint(func, lhs);
+    jit_value_t b = as_nint(func, rhs);
+    jit_value_t one = const_nint(func, 1);
+    jit_insn_branch_if_not(func, jit_insn_and(func, jit_insn_and(func, a, b), one), &boxed);
+    if (iscmp) {
+      jit_value_t ret;
+      switch (opc) {
+        case OPI_OPC_NUMEQ: ret = jit_insn_eq(func, a, b); break;
+        case OPI_OPC_NUMNE: ret = jit_insn_ne(func, a, b); break;
+        case OPI_OPC_LT: ret = jit_insn_lt(func, a, b); break;
+        case OPI_OPC_GT: ret = jit_insn_gt(func, a, b); break;
+        case OPI_OPC_LE: ret = jit_insn_le(func, a, b); break;
+        case OPI_OPC_GE: ret = jit_insn_ge(func, a, b); break;
+        default: abort();
       }
+      set(jit, OPI_BINOP_REG_OUT(ip), boolean(func, ret));
+    } else {
+      jit_value_t x = jit_insn_sshr(func, a, one);
+      jit_value_t y = jit_insn_sshr(func, b, one);
+      jit_value_t z = opc == OPI_OPC_ADD ? jit_insn_add(func, x, y) : jit_insn_sub(func, x, y);
+      jit_insn_branch_if(func, jit_insn_lt(func, z, const_nint(func, OPI_IMM_MIN)), &slow);
+      jit_insn_branch_if(func, jit_insn_gt(func, z, const_nint(func, OPI_IMM_MAX)), &slow);
+      z = jit_insn_or(func, jit_insn_shl(func, z, one), one);
+      set(jit, OPI_BINOP_REG_OUT(ip), jit_insn_convert(func, z, jit_type_void_ptr, 0));
+    }
+    jit_insn_branch(func, &done);
+  }
 
-      case OPI_OPC_AND:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t ret = jit_insn_and(func, lhs, rhs);
-        r[OPI_AND_REG_OUT(ip)] = ret;
-        break;
-      }
+  // Both Floats.
+  jit_insn_label(func, &boxed);
+  if (opc != OPI_OPC_FMOD) {
+    jit_insn_branch_if(func, is_imm(func, lhs), &slow);
+    jit_insn_branch_if(func, is_imm(func, rhs), &slow);
+    jit_value_t num = const_ptr(func, opi_float_type);
+    jit_value_t isnum = jit_insn_and(func,
+        jit_insn_eq(func, load_header_type(func, lhs), num),
+        jit_insn_eq(func, load_header_type(func, rhs), num));
+    jit_insn_branch_if_not(func, isnum, &slow);
+
+    jit_value_t x = load_num(func, lhs);
+    jit_value_t y = load_num(func, rhs);
+    jit_value_t ret;
+    switch (opc) {
+      case OPI_OPC_ADD: ret = jit_insn_add(func, x, y); break;
+      case OPI_OPC_SUB: ret = jit_insn_sub(func, x, y); break;
+      case OPI_OPC_MUL: ret = jit_insn_mul(func, x, y); break;
+      case OPI_OPC_DIV: ret = jit_insn_div(func, x, y); break;
+      case OPI_OPC_NUMEQ: ret = jit_insn_eq(func, x, y); break;
+      case OPI_OPC_NUMNE: ret = jit_insn_ne(func, x, y); break;
+      case OPI_OPC_LT: ret = jit_insn_lt(func, x, y); break;
+      case OPI_OPC_GT: ret = jit_insn_gt(func, x, y); break;
+      case OPI_OPC_LE: ret = jit_insn_le(func, x, y); break;
+      case OPI_OPC_GE: ret = jit_insn_ge(func, x, y); break;
+      default: abort();
+    }
+    if (iscmp) {
+      set(jit, OPI_BINOP_REG_OUT(ip), boolean(func, ret));
+    } else {
+      ret = jit_insn_convert(func, ret, jit_type_float64, 0);
+      set(jit, OPI_BINOP_REG_OUT(ip), call(func, "opi_float_new", rt_float_new, g_sig_p_f, &ret, 1));
+    }
+    jit_insn_branch(func, &done);
+  }
 
-      case OPI_OPC_ADD:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_add(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = new_num(func, ret_val);
-        break;
-      }
+  jit_insn_label(func, &slow);
+  // only arithmetic operators may dispatch to traits
+  OpiTraitCache *ic = ip->opc <= OPI_OPC_DIV ? opi_bytecode_get_trait_cache(jit->bc, ip) : NULL;
+  jit_value_t args[] = { const_nuint(func, opc), lhs, rhs, const_ptr(func, ic) };
+  set(jit, OPI_BINOP_REG_OUT(ip), call(func, "binop", rt_binop, g_sig_p_nppp, args, 4));
+  jit_insn_label(func, &done);
+}
 
-      case OPI_OPC_SUB:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_sub(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = new_num(func, ret_val);
-        break;
-      }
+static int
+emit_insn(Jit *jit, OpiFlatInsn *ip)
+{
+  jit_function_t func = jit->func;
+  jit_value_t *r = jit->r;
+
+  switch (ip->opc) {
+    case OPI_OPC_NOP:
+    case OPI_OPC_VAR:
+      break;
+
+    case OPI_OPC_END:
+      opi_assert(!"unexpected end");
+      return OPI_ERR;
+
+    case OPI_OPC_SET:
+      set(jit, OPI_SET_REG(ip), const_ptr(func, (void*)OPI_SET_ARG_VAL(ip)));
+      break;
+
+    case OPI_OPC_ADD:
+    case OPI_OPC_SUB:
+    case OPI_OPC_MUL:
+    case OPI_OPC_DIV:
+    case OPI_OPC_FMOD:
+    case OPI_OPC_NUMEQ:
+    case OPI_OPC_NUMNE:
+    case OPI_OPC_LT:
+    case OPI_OPC_GT:
+    case OPI_OPC_LE:
+    case OPI_OPC_GE:
+    case OPI_OPC_ADD_NN ... OPI_OPC_GE_NN:
+      binop(jit, ip);
+      break;
+
+    case OPI_OPC_CONS:
+    {
+      jit_value_t args[] = { r[OPI_BINOP_REG_LHS(ip)], r[OPI_BINOP_REG_RHS(ip)] };
+      set(jit, OPI_BINOP_REG_OUT(ip), call(func, "opi_cons", rt_cons, g_sig_p_pp, args, 2));
+      break;
+    }
 
-      case OPI_OPC_MUL:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_mul(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = new_num(func, ret_val);
-        break;
-      }
+    case OPI_OPC_SETVAR:
+    {
+      jit_value_t args[] = { r[OPI_SETVAR_REG_REF(ip)], r[OPI_SETVAR_REG_VAL(ip)] };
+      call(func, "opi_var_set", rt_setvar, g_sig_v_pp, args, 2);
+      break;
+    }
 
-      case OPI_OPC_DIV:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_div(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = new_num(func, ret_val);
-        break;
-      }
+    case OPI_OPC_DEREF:
+      set(jit, OPI_DEREF_REG_OUT(ip),
+          jit_insn_load_relative(func, r[OPI_DEREF_REG_VAR(ip)], offsetof(OpiVar, val), jit_type_void_ptr));
+      break;
+
+    case OPI_OPC_PHI:
+      set(jit, OPI_PHI_REG(ip), const_ptr(func, opi_nil));
+      break;
+
+    case OPI_OPC_TEST:
+      set_bool(jit, OPI_TEST_REG_OUT(ip),
+          jit_insn_ne(func, r[OPI_TEST_REG_IN(ip)], const_ptr(func, opi_false)));
+      break;
+
+    case OPI_OPC_GUARD:
+    {
+      jit_label_t ok = jit_label_undefined;
+      jit_insn_branch_if(func, r[OPI_GUARD_REG(ip)], &ok);
+      call(func, "abort", abort, g_sig_v_v, NULL, 0);
+      jit_insn_label(func, &ok);
+      break;
+    }
 
-      case OPI_OPC_MOD:
-      {
-        opi_error("unimplemented MOD\n");
-        abort();
-      }
+    case OPI_OPC_CONST:
+      set(jit, OPI_CONST_REG_OUT(ip), const_ptr(func, OPI_CONST_ARG_CELL(ip)));
+      break;
+
+    case OPI_OPC_CONSTPUSH:
+      set(jit, OPI_CONST_REG_OUT(ip), const_ptr(func, OPI_CONST_ARG_CELL(ip)));
+      push(func, r[OPI_CONST_REG_OUT(ip)]);
+      break;
+
+    case OPI_OPC_APPLY:
+    case OPI_OPC_APPLYRC:
+    {
+      jit_value_t args[] = { r[OPI_APPLY_REG_FN(ip)], const_nuint(func, OPI_APPLY_ARG_NARGS(ip)) };
+      set(jit, OPI_APPLY_REG_OUT(ip), call(func, "apply", rt_apply, g_sig_p_pn, args, 2));
+      if (ip->opc == OPI_OPC_APPLYRC)
+        add_rc(func, r[OPI_APPLY_REG_OUT(ip)], +1);
+      break;
+    }
 
-      case OPI_OPC_NUMEQ:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_eq(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = boolean(func, ret_val);
-        break;
-      }
+    case OPI_OPC_APPLYI:
+    {
+      jit_value_t args[] = { r[OPI_APPLY_REG_FN(ip)], const_nuint(func, OPI_APPLY_ARG_NARGS(ip)) };
+      set(jit, OPI_APPLY_REG_OUT(ip), call(func, "opi_fn_apply", rt_applyi, g_sig_p_pn, args, 2));
+      break;
+    }
 
-      case OPI_OPC_NUMNE:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_ne(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = boolean(func, ret_val);
-        break;
-      }
+    case OPI_OPC_APPLYTC:
+    {
+      jit_value_t args[] = {
+        r[OPI_APPLY_REG_FN(ip)],
+        const_nuint(func, OPI_APPLY_ARG_NARGS(ip)),
+        const_ptr(func, jit->bc),
+      };
+      jit_value_t ret = call(func, "applytc", rt_applytc, g_sig_p_pnp, args, 3);
+      // self tail call
+      jit_label_t notself = jit_label_undefined;
+      jit_insn_branch_if_not(func, jit_insn_eq(func, ret, const_ptr(func, &g_selfcall)), &notself);
+      drain_frees(func);
+      jit_insn_branch(func, &jit->start);
+      jit_insn_label(func, &notself);
+      // tail call to other lambda: leave it to the trampoline
+      jit_label_t cont = jit_label_undefined;
+      jit_insn_branch_if_not(func, jit_insn_eq(func, ret, const_ptr(func, &g_tailcall)), &cont);
+      jit_insn_return(func, ret);
+      jit_insn_label(func, &cont);
+      set(jit, OPI_APPLY_REG_OUT(ip), ret);
+      break;
+    }
 
-      case OPI_OPC_LT:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_lt(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = boolean(func, ret_val);
-        break;
-      }
+    case OPI_OPC_RET:
+      drain_frees(func);
+      jit_insn_return(func, r[OPI_RET_REG_VAL(ip)]);
+      break;
+
+    case OPI_OPC_YIELD:
+      // generators are resumed by the VM only
+      return OPI_ERR;
+
+    case OPI_OPC_PUSH:
+      push(func, r[OPI_PUSH_REG_VAL(ip)]);
+      break;
+
+    case OPI_OPC_DECPUSH:
+      add_rc(func, r[OPI_PUSH_REG_VAL(ip)], -1);
+      push(func, r[OPI_PUSH_REG_VAL(ip)]);
+      break;
+
+    case OPI_OPC_POP:
+    {
+      jit_value_t n = const_nuint(func, OPI_POP_ARG_N(ip));
+      call(func, "opi_popn", rt_popn, g_sig_v_n, &n, 1);
+      break;
+    }
 
-      case OPI_OPC_GT:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_gt(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = boolean(func, ret_val);
-        break;
-      }
+    case OPI_OPC_LDCAP:
+    {
+      jit_value_t idx = const_nuint(func, OPI_LDCAP_ARG_IDX(ip));
+      set(jit, OPI_LDCAP_REG_OUT(ip), call(func, "ldcap", rt_ldcap, g_sig_p_n, &idx, 1));
+      break;
+    }
 
-      case OPI_OPC_LE:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_le(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = boolean(func, ret_val);
-        break;
-      }
+    case OPI_OPC_PARAM:
+    case OPI_OPC_PARAMRC:
+    {
+      jit_value_t offs = const_nuint(func, OPI_PARAM_ARG_OFFS(ip));
+      set(jit, OPI_PARAM_REG_OUT(ip), call(func, "opi_get", rt_param, g_sig_p_n, &offs, 1));
+      if (ip->opc == OPI_OPC_PARAMRC)
+        add_rc(func, r[OPI_PARAM_REG_OUT(ip)], +1);
+      break;
+    }
 
-      case OPI_OPC_GE:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        jit_value_t lhs_val = load_num(func, lhs);
-        jit_value_t rhs_val = load_num(func, rhs);
-        jit_value_t ret_val = jit_insn_ge(func, lhs_val, rhs_val);
-        r[OPI_BINOP_REG_OUT(ip)] = boolean(func, ret_val);
-        break;
-      }
+    case OPI_OPC_ALCFN:
+      set(jit, OPI_ALCFN_REG_OUT(ip), call(func, "opi_fn_alloc", rt_alcfn, g_sig_p_v, NULL, 0));
+      break;
+
+    case OPI_OPC_FINFN:
+    {
+      OpiFnInsnData *data = OPI_FINFN_ARG_DATA(ip);
+      for (int i = 0; i < data->ncaps; ++i)
+        jit_insn_store_relative(func, jit->caps, sizeof(opi_t) * i, r[data->caps[i]]);
+      jit_value_t args[] = {
+        r[OPI_FINFN_REG_CELL(ip)],
+        const_ptr(func, data),
+        jit->caps,
+        jit->in_scope ? jit->scp : const_ptr(func, NULL),
+        const_nuint(func, jit->in_scope ? jit->scpcnt++ : 0),
+      };
+      call(func, "finfn", rt_finfn, g_sig_v_pppn, args, 5);
+      break;
+    }
 
-      case OPI_OPC_CONS:
-      {
-        jit_value_t lhs = r[OPI_BINOP_REG_LHS(ip)];
-        jit_value_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        r[OPI_BINOP_REG_OUT(ip)] = cons(func, lhs, rhs);
-        break;
-      }
+    case OPI_OPC_INCRC:
+      add_rc(func, r[OPI_INCRC_REG_CELL(ip)], +1);
+      break;
 
-      case OPI_OPC_PHI:
-      {
-        jit_value_t phi = jit_value_create(func, jit_type_void_ptr);
-        jit_insn_store(func, phi, const_ptr(func, opi_nil));
-        r[OPI_PHI_REG(ip)] = phi;
-        break;
-      }
+    case OPI_OPC_DECRC:
+      add_rc(func, r[OPI_DECRC_REG_CELL(ip)], -1);
+      break;
 
-      case OPI_OPC_TEST:
-      {
-        jit_value_t x = r[OPI_TEST_REG_IN(ip)];
-        jit_value_t test = jit_insn_ne(func, x, const_ptr(func, opi_false));
-        r[OPI_TEST_REG_OUT(ip)] = test;
-        break;
-      }
+    case OPI_OPC_DROP:
+      call(func, "opi_drop", rt_drop, g_sig_v_p, &r[OPI_DROP_REG_CELL(ip)], 1);
+      break;
 
-      case OPI_OPC_GUARD:
-      {
-        jit_value_t x = r[OPI_GUARD_REG(ip)];
-        jit_value_t test = jit_insn_eq(func, x, const_ptr(func, opi_false));
-        jit_label_t label = jit_label_undefined;
-        jit_insn_branch_if_not(func, test, &label);
-        guard(func);
-        jit_insn_label(func, &label);
-        break;
-      }
+    case OPI_OPC_UNREF:
+      call(func, "opi_unref", rt_unref, g_sig_v_p, &r[OPI_UNREF_REG_CELL(ip)], 1);
+      break;
 
-      case OPI_OPC_CONST:
-      {
-        opi_t x = OPI_CONST_ARG_CELL(ip);
-        r[OPI_CONST_REG_OUT(ip)] = const_ptr(func, x);
-        break;
-      }
+    case OPI_OPC_IF:
+    {
+      size_t to = (OpiFlatInsn*)OPI_IF_ARG_ELSE(ip) - jit->bc->tape;
+      jit_insn_branch_if_not(func, r[OPI_IF_REG_TEST(ip)], &jit->labels[to]);
+      break;
+    }
 
-      case OPI_OPC_APPLY:
-      {
-        jit_value_t fn = r[OPI_APPLY_REG_FN(ip)];
-        size_t nargs = OPI_APPLY_ARG_NARGS(ip);
-        r[OPI_APPLY_REG_OUT(ip)] = opi_apply(fn, nargs);
-        break;
-      }
+    case OPI_OPC_TESTTYIF:
+    {
+      size_t to = (OpiFlatInsn*)OPI_TESTTYIF_ARG_ELSE(ip) - jit->bc->tape;
+      jit_value_t test =
+        test_type(func, r[OPI_TESTTYIF_REG_CELL(ip)], OPI_TESTTYIF_ARG_TYPE(ip));
+      jit_insn_branch_if_not(func, test, &jit->labels[to]);
+      break;
+    }
 
+    case OPI_OPC_JMP:
+    {
+      size_t to = (OpiFlatInsn*)OPI_JMP_ARG_TO(ip) - jit->bc->tape;
+      jit_insn_branch(func, &jit->labels[to]);
+      break;
+    }
 
+    case OPI_OPC_DUP:
+      set(jit, OPI_DUP_REG_OUT(ip), r[OPI_DUP_REG_IN(ip)]);
+      break;
+
+    case OPI_OPC_BEGSCP:
+    {
+      jit_value_t n = const_nuint(func, OPI_BEGSCP_ARG_N(ip));
+      jit_insn_store(func, jit->scp, call(func, "opi_rec_scp_alloc", rt_begscp, g_sig_p_n, &n, 1));
+      jit->in_scope = TRUE;
+      jit->scpcnt = 0;
+      break;
     }
 
-    ip = ip->next;
+    case OPI_OPC_ENDSCP:
+      call(func, "opi_rec_scp_finalize", rt_endscp, g_sig_v_p, &jit->scp, 1);
+      jit->in_scope = FALSE;
+      break;
+
+    case OPI_OPC_TESTTY:
+      set_bool(jit, OPI_TESTTY_REG_OUT(ip),
+          test_type(func, r[OPI_TESTTY_REG_CELL(ip)], OPI_TESTTY_ARG_TYPE(ip)));
+      break;
+
+    case OPI_OPC_LDFLD:
+      set(jit, OPI_LDFLD_REG_OUT(ip),
+          jit_insn_load_relative(func, r[OPI_LDFLD_REG_CELL(ip)],
+            OPI_LDFLD_ARG_OFFS(ip), jit_type_void_ptr));
+      break;
+  }
+
+  return OPI_OK;
+}
+
+int
+opi_jit_compile(OpiBytecode *bc)
+{
+  opi_assert(bc->tape);
+
+  size_t len = 0;
+  while (bc->tape[len].opc != OPI_OPC_END)
+    len += 1;
+
+  jit_context_build_start(g_ctx);
+
+  jit_function_t func = jit_function_create(g_ctx, g_sig_p_v);
+
+  jit_value_t r[bc->nvals ? bc->nvals : 1];
+  for (size_t i = 0; i < bc->nvals; ++i)
+    r[i] = jit_value_create(func, jit_type_void_ptr);
+
+  jit_label_t labels[len + 1];
+  char is_target[len + 1];
+  int maxcaps = 0;
+  memset(is_target, 0, len + 1);
+  for (size_t i = 0; i < len; ++i) {
+    OpiFlatInsn *ip = bc->tape + i;
+    labels[i] = jit_label_undefined;
+    if (ip->opc == OPI_OPC_IF)
+      is_target[(OpiFlatInsn*)OPI_IF_ARG_ELSE(ip) - bc->tape] = TRUE;
+    else if (ip->opc == OPI_OPC_TESTTYIF)
+      is_target[(OpiFlatInsn*)OPI_TESTTYIF_ARG_ELSE(ip) - bc->tape] = TRUE;
+    else if (ip->opc == OPI_OPC_JMP)
+      is_target[(OpiFlatInsn*)OPI_JMP_ARG_TO(ip) - bc->tape] = TRUE;
+    else if (ip->opc == OPI_OPC_FINFN && OPI_FINFN_ARG_DATA(ip)->ncaps > maxcaps)
+      maxcaps = OPI_FINFN_ARG_DATA(ip)->ncaps;
+  }
+  labels[len] = jit_label_undefined;
+
+  Jit jit = {
+    .func = func,
+    .bc = bc,
+    .r = r,
+    .labels = labels,
+    .start = jit_label_undefined,
+    .caps = NULL,
+    .scp = jit_value_create(func, jit_type_void_ptr),
+    .in_scope = FALSE,
+    .scpcnt = 0,
+  };
+  if (maxcaps > 0)
+    jit.caps = jit_insn_alloca(func, const_nuint(func, sizeof(opi_t) * maxcaps));
+
+  jit_insn_label(func, &jit.start);
+  for (size_t i = 0; i < len; ++i) {
+    if (is_target[i])
+      jit_insn_label(func, &labels[i]);
+    if (emit_insn(&jit, bc->tape + i) != OPI_OK) {
+      jit_function_abandon(func);
+      jit_context_build_end(g_ctx);
+      return FALSE;
+    }
   }
-end:;
+  if (is_target[len])
+    jit_insn_label(func, &labels[len]);
+
+  int ok = jit_function_compile(func);
+  jit_context_build_end(g_ctx);
+  if (!ok) {
+    opi_warning("JIT: failed to compile function\n");
+    jit_function_abandon(func);
+    return FALSE;
+  }
+
+  bc->jit = jit_function_to_closure(func);
+  return TRUE;
 }
 
-#endif/* OPI_USE_LIBJIT */
+#endif /* OPI_USE_LIBJIT */
@@ -6,7 +6,7 @@ opi_lam_destroy(OpiFn *fn)
 {
   OpiLambda *lam = fn->data;
   for (size_t i = 0; i < lam->ncaps; ++i) {
-    if (lam->caps[i]->rc > 0)
+    if (opi_get_rc(lam->caps[i]) > 0)
       opi_unref(lam->caps[i]);
   }
 }
@@ -21,7 +21,7 @@ opi_lam_free(OpiFn *fn)
   else if (lam->ncaps < 5)
     opi_h6w_free(lam);
   else
-    free(lam);
+    opi_free(lam, sizeof(OpiLambda) + sizeof(opi_t) * lam->ncaps);
 
   opi_fn_delete(fn);
 }
@@ -33,40 +33,173 @@ opi_lam_delete(OpiFn *fn)
   opi_lam_free(fn);
 }
 
-extern inline void
-opi_scope_dropout(OpiRecScope *scp)
+void
+opi_lambda_delete(OpiFn *fn)
 {
-  if (--scp->rc == 0) {
-    size_t nnz = 0;
-    for (size_t i = 0; i < scp->nrefs; ++i)
-      nnz += !!scp->refs[i].val->rc;
-
-    if (nnz == 0) {
-      for (size_t i = 0; i < scp->nrefs; ++i)
-        scp->refs[i].destroy(scp->refs[i].val);
-      for (size_t i = 0; i < scp->nrefs; ++i)
-        scp->refs[i].free(scp->refs[i].val);
-      free(scp);
-    } else {
-      scp->rc = nnz;
-    }
-  }
+  // members of recursive scopes are deleted along with the scope
+  opi_assert(fn->header.meta == OPI_META_NONE);
+  opi_lam_delete(fn);
 }
 
+static void
+rec_scp_delete(OpiFn *fn)
+{ opi_rec_scp_destroy(opi_rec_scp_from_id(fn->header.meta), OPI(fn)); }
+
 void
-opi_lambda_delete(OpiFn *fn)
+opi_lambda_suspect(OpiFn *fn)
 {
   OpiLambda *lam = fn->data;
-  if (lam->scp)
-    opi_scope_dropout(lam->scp);
-  else
-    opi_lam_delete(fn);
+  opi_rec_scp_suspect(opi_rec_scp_from_id(fn->header.meta), lam->scpidx);
+}
+
+void
+opi_lambda_dropout(OpiFn *fn)
+{
+  OpiLambda *lam = fn->data;
+  OpiRecScp *scp = opi_rec_scp_from_id(fn->header.meta);
+  if (opi_rec_scp_dropout(scp, lam->scpidx)) {
+    // no one can resurrect members of a dead scope, so it is safe to queue
+    fn->dtor = rec_scp_delete;
+    cod_vec_push(opi_free_queue, OPI(fn));
+  }
 }
 
 opi_t
 opi_lambda_fn(void)
 {
+#ifdef OPI_USE_LIBJIT
+  // trampoline for tail calls from compiled code
+  while (1) {
+    OpiLambda *lam = opi_current_fn->data;
+    if (!opi_jit_ready(lam->bc))
+      return opi_vm(lam->bc);
+    opi_t ret = ((opi_fn_handle_t)lam->bc->jit)();
+    if (ret != opi_jit_tailcall)
+      return ret;
+  }
+#else
   OpiLambda *lam = opi_current_fn->data;
   return opi_vm(lam->bc);
+#endif
 }
 
+
+/*
+ * Generators.
+ *
+ * Application of a generator saves the arguments and returns a Seq; each time
+ * the Seq needs an element the body is resumed in its own registers until the
+ * next YIELD. Copies of the Seq share the generator along with the cache of
+ * elements, so whichever copy runs past the cache advances it.
+ */
+enum { GEN_READY, GEN_RUNNING, GEN_DONE };
+
+typedef struct {
+  size_t rc;
+  OpiFn *fn;
+  OpiFlatInsn *ip; // YIELD the body is suspended at (NULL before the start)
+  int state;
+  size_t nargs; // arguments not yet passed to the body
+  opi_t *args;
+  size_t nregs;
+  opi_t regs[];
+} Generator;
+
+static opi_t
+generator_next(OpiIter *iter)
+{
+  Generator *gen = (void*)iter;
+  if (opi_unlikely(gen->state != GEN_READY)) {
+    if (gen->state == GEN_DONE)
+      return NULL;
+    return opi_undefined(opi_symbol("generator-running"));
+  }
+
+  OpiLambda *lam = gen->fn->data;
+  opi_nargs = 0;
+  if (gen->ip == NULL) {
+    // first resume: the body takes arguments from the stack as in a call
+    if (opi_unlikely(!opi_stack_fits(gen->nargs)))
+      return opi_undefined(opi_symbol("stack-overflow"));
+    for (size_t i = gen->nargs; i-- > 0; ) {
+      opi_dec_rc(gen->args[i]);
+      opi_push(gen->args[i]);
+    }
+    opi_nargs = gen->nargs;
+    gen->nargs = 0;
+  }
+
+  opi_current_fn = gen->fn;
+  gen->state = GEN_RUNNING;
+  opi_t ret = opi_vm_resume(lam->bc, gen->regs, &gen->ip);
+  if (gen->ip) {
+    gen->state = GEN_READY;
+    return ret;
+  }
+
+  // an error ends the sequence as its last element
+  gen->state = GEN_DONE;
+  if (opi_typeof(ret) == opi_undefined_type)
+    return ret;
+  opi_drop(ret);
+  return NULL;
+}
+
+static OpiIter*
+generator_copy(OpiIter *iter)
+{
+  Generator *gen = (void*)iter;
+  gen->rc += 1;
+  return iter;
+}
+
+static void
+generator_dtor(OpiIter *iter)
+{
+  Generator *gen = (void*)iter;
+  if (--gen->rc > 0)
+    return;
+
+  if (gen->state == GEN_READY) {
+    if (gen->ip) {
+      // release whatever the suspended body still holds
+      int *lives = OPI_YIELD_ARG_LIVES(gen->ip);
+      for (size_t i = 0; i < OPI_YIELD_ARG_NLIVES(gen->ip); ++i)
+        opi_unref(gen->regs[lives[i]]);
+    }
+    for (size_t i = 0; i < gen->nargs; ++i)
+      opi_unref(gen->args[i]);
+  }
+
+  opi_unref(OPI(gen->fn));
+  opi_free(gen, sizeof(Generator) + sizeof(opi_t) * gen->nregs);
+}
+
+static OpiSeqCfg
+g_generator_cfg = {
+  .next = generator_next,
+  .copy = generator_copy,
+  .dtor = generator_dtor,
+};
+
+opi_t
+opi_generator_fn(void)
+{
+  OpiFn *fn = opi_current_fn;
+  OpiLambda *lam = fn->data;
+  size_t nargs = opi_nargs;
+  size_t nregs = lam->bc->nvals + nargs;
+
+  Generator *gen = opi_alloc(sizeof(Generator) + sizeof(opi_t) * nregs);
+  gen->rc = 1;
+  opi_inc_rc(OPI(gen->fn = fn));
+  gen->ip = NULL;
+  gen->state = GEN_READY;
+  gen->nargs = nargs;
+  gen->args = gen->regs + lam->bc->nvals;
+  gen->nregs = nregs;
+  for (size_t i = 0; i < nargs; ++i)
+    opi_inc_rc(gen->args[i] = opi_pop());
+
+  return opi_seq_new((OpiIter*)gen, g_generator_cfg);
+}
@@ -1,15 +1,21 @@
 #include "opium/opium.h"
 #include "opium/hash-map.h"
+#include "opium/hamt.h"
+#include "opium/lambda.h"
 
 #include <string.h>
 #include <math.h>
 #include <float.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pcre.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 OpiFn *opi_current_fn = NULL;
 opi_t *opi_sp = NULL;
+opi_t *opi_stack_limit = (opi_t*)UINTPTR_MAX;
 size_t opi_nargs;
 
 int opi_error = 0;
@@ -30,19 +36,71 @@ opi_die(const char *fmt, ...)
 static opi_t*
 g_my_stack = NULL;
 
+static size_t
+g_my_stack_size;
+
+// all traits indexed by id (NULL for deleted ones)
+static cod_vec(OpiTrait*) g_traits;
+
+#ifdef OPI_MEM_CENSUS
+// all live types (for statistics)
+static cod_vec(opi_type_t) g_types;
+#endif
+
+// cells to free by opi_delete()
+static size_t g_free_budget = OPI_FREE_BUDGET;
+
 extern void
 opi_lexer_init(void);
 
 extern void
 opi_lexer_cleanup(void);
 
+void*
+opi_stack_map(size_t size, size_t *mapsize)
+{
+  size_t pgsize = sysconf(_SC_PAGESIZE);
+  size = (size + pgsize - 1) & ~(pgsize - 1);
+  *mapsize = size + pgsize;
+
+  void *p = mmap(NULL, *mapsize, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    opi_die("failed to map stack (%zu bytes)", *mapsize);
+  // guard page
+  mprotect((char*)p + size, pgsize, PROT_NONE);
+  return p;
+}
+
+static void
+stack_init(void)
+{
+  size_t size = sizeof(opi_t) * (OPI_STACK_SIZE + OPI_STACK_SLACK);
+  opi_sp = g_my_stack = opi_stack_map(size, &g_my_stack_size);
+  opi_stack_limit = g_my_stack + OPI_STACK_SIZE;
+}
+
+opi_t
+opi_stack_overflow(size_t nargs)
+{
+  while (nargs--)
+    opi_drop(opi_pop());
+  return opi_undefined(opi_symbol("stack-overflow"));
+}
+
 void
 opi_init(int flags)
 {
   if (flags & OPI_INIT_STACK)
-    opi_sp = g_my_stack = malloc(sizeof(opi_t) * 0x400);
+    stack_init();
 
+  opi_hash_init(flags & OPI_INIT_SIPHASH);
+  cod_vec_init(opi_free_queue);
+#ifdef OPI_MEM_CENSUS
+  cod_vec_init(g_types);
+#endif
   opi_allocators_init();
+  opi_vm_init();
   opi_lexer_init();
   opi_rec_scp_init();
 
@@ -62,13 +120,32 @@ opi_init(int flags)
   opi_seq_init();
   opi_buffer_init();
   opi_var_init();
+#ifdef OPI_CYCLE_COLLECTOR
+  opi_cycles_init();
+#endif
 
   opi_traits_init();
+
+#ifdef OPI_USE_LIBJIT
+  opi_jit_init();
+#endif
 }
 
 void
 opi_cleanup(void)
 {
+  // free everything right away from now on: types are about to be deleted
+  g_free_budget = SIZE_MAX;
+#ifdef OPI_CYCLE_COLLECTOR
+  opi_collect_cycles();
+  opi_cycles_cleanup();
+#endif
+  opi_drain_frees(SIZE_MAX);
+
+#ifdef OPI_USE_LIBJIT
+  opi_jit_cleanup();
+#endif
+
   opi_traits_cleanup();
 
   opi_file_cleanup();
@@ -87,13 +164,19 @@ opi_cleanup(void)
   opi_seq_cleanup();
   opi_buffer_cleanup();
   opi_var_cleanup();
+  cod_vec_destroy(g_traits);
+  cod_vec_destroy(opi_free_queue);
 
   opi_lexer_cleanup();
+  opi_vm_cleanup();
   opi_allocators_cleanup();
   opi_rec_scp_cleanup();
 
-  if (g_my_stack)
-    free(g_my_stack);
+  if (g_my_stack) {
+    munmap(g_my_stack, g_my_stack_size);
+    g_my_stack = NULL;
+    opi_stack_limit = (opi_t*)UINTPTR_MAX;
+  }
 }
 
 /******************************************************************************/
@@ -117,6 +200,7 @@ struct OpiType_s {
   int (*eq)(opi_type_t ty, opi_t x, opi_t y);
   int (*equal)(opi_type_t ty, opi_t x, opi_t y);
   size_t (*hash)(opi_type_t ty, opi_t x);
+  void (*traverse)(opi_type_t ty, opi_t x, void (*visit)(opi_t,void*), void *data);
 
   size_t fields_offset;
   size_t nfields;
@@ -125,8 +209,32 @@ struct OpiType_s {
   int is_struct;
 
   opi_t hash_impl;
+
+  // trait methods indexed by trait id (NULL if trait is not implemented)
+  opi_t **vtable;
+  size_t vtable_size;
+
+#ifdef OPI_MEM_CENSUS
+  size_t nlive;
+#endif
 };
 
+#ifdef OPI_MEM_CENSUS
+void
+opi_census_add(opi_type_t ty, int d)
+{ ty->nlive += d; }
+
+void
+opi_type_census(void (*fn)(opi_type_t ty, size_t nlive, void *data), void *data)
+{
+  for (size_t i = 0; i < g_types.len; ++i)
+    fn(g_types.data[i], g_types.data[i]->nlive, data);
+}
+#endif
+
+static void
+trait_forget_type(size_t trait_id, opi_type_t type);
+
 static void
 default_destroy_cell(opi_type_t ty, opi_t cell)
 { }
@@ -151,6 +259,14 @@ static int
 default_equal(opi_type_t ty, opi_t x, opi_t y)
 { return ty->eq(ty, x, y); }
 
+static void
+default_traverse(opi_type_t ty, opi_t x, void (*visit)(opi_t,void*), void *data)
+{
+  // declared fields are owned references
+  for (size_t i = 0; i < ty->nfields; ++i)
+    visit(*(opi_t*)((char*)x + ty->fields_offset + sizeof(opi_t) * i), data);
+}
+
 static void
 type_object_delete(opi_type_t type, opi_t x)
 { free(x); }
@@ -165,9 +281,13 @@ static OpiType type_type = {
   .eq = default_eq,
   .equal = default_equal,
   .hash = NULL,
+  .traverse = default_traverse,
   .fields = NULL,
+  .nfields = 0,
   .is_struct = FALSE,
   .hash_impl = NULL,
+  .vtable = NULL,
+  .vtable_size = 0,
 };
 opi_type_t opi_type_type = &type_type;
 
@@ -188,10 +308,17 @@ type_init(OpiType *ty, const char *name)
   ty->eq = default_eq;
   ty->equal = default_equal;
   ty->hash = NULL;
+  ty->traverse = default_traverse;
   ty->fields = NULL;
   ty->nfields = 0;
   ty->is_struct = FALSE;
   ty->hash_impl = NULL;
+  ty->vtable = NULL;
+  ty->vtable_size = 0;
+#ifdef OPI_MEM_CENSUS
+  ty->nlive = 0;
+  cod_vec_push(g_types, ty);
+#endif
 }
 
 opi_type_t
@@ -214,6 +341,25 @@ opi_type_delete(opi_type_t ty)
     free(ty->fields);
   }
 
+  for (size_t i = 0; i < ty->vtable_size; ++i) {
+    if (ty->vtable[i])
+      trait_forget_type(i, ty);
+  }
+  free(ty->vtable);
+
+#ifdef OPI_MEM_CENSUS
+  for (size_t i = 0; i < g_types.len; ++i) {
+    if (g_types.data[i] == ty) {
+      g_types.data[i] = g_types.data[--g_types.len];
+      break;
+    }
+  }
+  if (g_types.len == 0) {
+    cod_vec_destroy(g_types);
+    cod_vec_init(g_types);
+  }
+#endif
+
   opi_unref(OPI(ty->type_object));
   free(ty);
 }
@@ -253,22 +399,34 @@ void
 opi_type_set_hash(opi_type_t ty, size_t (*fn)(opi_type_t,opi_t))
 { ty->hash = fn; }
 
+void
+opi_type_set_traverse(opi_type_t ty,
+    void (*fn)(opi_type_t,opi_t,void(*)(opi_t,void*),void*))
+{ ty->traverse = fn; }
+
+void
+opi_traverse(opi_t x, void (*visit)(opi_t,void*), void *data)
+{
+  if (!opi_is_imm(x))
+    x->type->traverse(x->type, x, visit, data);
+}
+
 static size_t
 generic_hash_handle(opi_type_t type, opi_t x)
 {
   opi_push(x);
   opi_inc_rc(x); // DON'T DROP OBJECT!!
   opi_t hash = opi_apply(type->hash_impl, 1);
-  if (hash->type != opi_num_type) {
+  if (!opi_is_int(hash)) {
     // use hash of returned value
-    opi_assert(hash->type != opi_undefined_type);
-    opi_assert(opi_type_is_hashable(hash->type));
+    opi_assert(opi_typeof(hash) != opi_undefined_type);
+    opi_assert(opi_type_is_hashable(opi_typeof(hash)));
     size_t ret = opi_hashof(hash);
     opi_drop(hash);
     opi_dec_rc(x);
     return ret;
   } else {
-    size_t ret = OPI_NUM(hash)->val;
+    size_t ret = opi_int_get_value(hash);
     opi_drop(hash);
     opi_dec_rc(x);
     return ret;
@@ -342,27 +500,74 @@ opi_type_is_struct(const opi_type_t type)
 
 void
 opi_display(opi_t x, FILE *out)
-{ x->type->display(x->type, x, out); }
+{
+  opi_type_t ty = opi_typeof(x);
+  ty->display(ty, x, out);
+}
 
 void
 opi_write(opi_t x, FILE *out)
-{ x->type->write(x->type, x, out); }
+{
+  opi_type_t ty = opi_typeof(x);
+  ty->write(ty, x, out);
+}
 
 int
 opi_eq(opi_t x, opi_t y)
-{ return x->type == y->type && x->type->eq(x->type, x, y); }
+{
+  opi_type_t ty = opi_typeof(x);
+  return ty == opi_typeof(y) && ty->eq(ty, x, y);
+}
 
 int
 opi_equal(opi_t x, opi_t y)
-{ return x->type == y->type && x->type->equal(x->type, x, y); }
+{
+  opi_type_t ty = opi_typeof(x);
+  return ty == opi_typeof(y) && ty->equal(ty, x, y);
+}
+
+OpiFreeQueue opi_free_queue;
+int opi_free_queue_draining = FALSE;
 
 void
 opi_delete(opi_t x)
-{ x->type->delete_cell(x->type, x); }
+{
+  // immediates are never deleted
+  if (opi_unlikely(x->type == opi_fn_type && x->meta != OPI_META_NONE)) {
+    // Members of a recursive scope may be resurrected by their siblings while
+    // in the queue (and die once more), so they drop out of the scope right
+    // away instead.
+    opi_lambda_dropout((OpiFn*)x);
+  } else {
+    cod_vec_push(opi_free_queue, x);
+  }
+  if (!opi_free_queue_draining)
+    opi_drain_frees(g_free_budget);
+}
+
+size_t
+opi_drain_frees(size_t budget)
+{
+  opi_free_queue_draining = TRUE;
+  size_t n = 0;
+  while (n < budget && opi_free_queue.len > 0) {
+    opi_t x = opi_free_queue.data[--opi_free_queue.len];
+#ifdef OPI_MEM_CENSUS
+    opi_census_add(x->type, -1);
+#endif
+    x->type->delete_cell(x->type, x);
+    n += 1;
+  }
+  opi_free_queue_draining = FALSE;
+  return n;
+}
 
 size_t
 opi_hashof(opi_t x)
-{ return x->type->hash(x->type, x); }
+{
+  opi_type_t ty = opi_typeof(x);
+  return ty->hash(ty, x);
+}
 
 opi_t
 opi_type_get_type_object(const opi_type_t type)
@@ -482,15 +687,64 @@ cond_impl_fits(CondImpl *ci, opi_type_t type)
 }
 
 struct OpiTrait_s {
+  size_t id; // offset in vtables
   Impl *default_impl;
-  OpiHashMap *impls;
+  cod_vec(opi_type_t) types; // types implementing the trait
   cod_vec(CondImpl*) cond_impls;
   opi_t *generics;
 };
 
+static void
+vtable_slot_delete(OpiTrait *trait, opi_type_t type)
+{
+  opi_t *slot = type->vtable[trait->id];
+  for (int i = 0; i < trait->default_impl->n; ++i) {
+    if (slot[i])
+      opi_unref(slot[i]);
+  }
+  free(slot);
+  type->vtable[trait->id] = NULL;
+  // inline caches hold the methods (and the type) without references
+  opi_trait_epoch += 1;
+}
+
+static void
+trait_forget_type(size_t trait_id, opi_type_t type)
+{
+  OpiTrait *trait = g_traits.data[trait_id];
+  for (size_t i = 0; i < trait->types.len; ++i) {
+    if (trait->types.data[i] == type) {
+      trait->types.data[i] = trait->types.data[--trait->types.len];
+      break;
+    }
+  }
+  vtable_slot_delete(trait, type);
+}
+
+/*
+ * Get vtable slot of the trait in given type, creating new one if missing.
+ */
+static opi_t*
+vtable_slot(OpiTrait *trait, opi_type_t type)
+{
+  if (type->vtable_size <= trait->id) {
+    size_t size = g_traits.len;
+    type->vtable = realloc(type->vtable, sizeof(opi_t*) * size);
+    for (size_t i = type->vtable_size; i < size; ++i)
+      type->vtable[i] = NULL;
+    type->vtable_size = size;
+  }
+  if (type->vtable[trait->id] == NULL) {
+    type->vtable[trait->id] = calloc(trait->default_impl->n, sizeof(opi_t));
+    cod_vec_push(trait->types, type);
+  }
+  return type->vtable[trait->id];
+}
+
 typedef struct GenericData_s {
   OpiTrait *trait;
   int moffs;
+  OpiTraitCache cache;
 } GenericData;
 
 static void
@@ -505,7 +759,8 @@ generic(void)
 {
   GenericData *data = opi_current_fn->data;
   opi_t x = opi_get(1);
-  opi_t m = opi_trait_get_impl(data->trait, x->type, data->moffs);
+  opi_t m = opi_trait_cache_get_impl(&data->cache, data->trait, opi_typeof(x),
+      data->moffs);
   if (m == NULL) {
     opi_drop_args(opi_nargs);
     return opi_undefined(opi_symbol("method-dispatch-error"));
@@ -522,10 +777,11 @@ opi_trait_new(char *const nam[], int n)
   opi_t fs[n];
   memset(fs, 0, sizeof fs);
   trait->default_impl = impl_new(nam, fs, n);
-  // impls
-  trait->impls = malloc(sizeof(OpiHashMap) * n);
-  for (int i = 0; i < n; ++i)
-    opi_hash_map_init(&trait->impls[i]);
+  // id
+  trait->id = g_traits.len;
+  cod_vec_push(g_traits, trait);
+  // types
+  cod_vec_init(trait->types);
   // cond_impls
   cod_vec_init(trait->cond_impls);
   // generics
@@ -535,6 +791,7 @@ opi_trait_new(char *const nam[], int n)
     GenericData *data = malloc(sizeof(GenericData));
     data->trait = trait;
     data->moffs = i;
+    memset(&data->cache, 0, sizeof(OpiTraitCache));
     opi_fn_set_data(g, data, generic_data_delete);
     opi_inc_rc(trait->generics[i] = g);
   }
@@ -544,9 +801,9 @@ opi_trait_new(char *const nam[], int n)
 void
 opi_trait_delete(OpiTrait *trait)
 {
-  for (int i = 0; i < trait->default_impl->n; ++i)
-    opi_hash_map_destroy(&trait->impls[i]);
-  free(trait->impls);
+  cod_vec_iter(trait->types, i, x, vtable_slot_delete(trait, x));
+  cod_vec_destroy(trait->types);
+  g_traits.data[trait->id] = NULL;
   cod_vec_iter(trait->cond_impls, i, x, cond_impl_delete(x));
   cod_vec_destroy(trait->cond_impls);
   for (int i = 0; i < trait->default_impl->n; ++i)
@@ -580,6 +837,17 @@ opi_trait_get_method_offset(const OpiTrait *trait, const char *nam)
   return -1;
 }
 
+/*
+ * Get method from the vtable (without checking conditional implementations).
+ */
+static inline opi_t
+opi_trait_get_impl_noconds(OpiTrait *trait, opi_type_t type, int metoffs)
+{
+  if (opi_likely(trait->id < type->vtable_size && type->vtable[trait->id]))
+    return type->vtable[trait->id][metoffs];
+  return NULL;
+}
+
 int
 opi_trait_impl(OpiTrait *trait, opi_type_t type, char *const nam[], opi_t f[],
     int n, int replace)
@@ -587,24 +855,24 @@ opi_trait_impl(OpiTrait *trait, opi_type_t type, char *const nam[], opi_t f[],
   if (!impl_is_full_with(trait->default_impl, nam, n))
     return OPI_ERR;
 
-  opi_t tyobj = opi_type_get_type_object(type);
-  size_t hash = (size_t)type;
-
   int offs[n];
   for (int i = 0; i < n; ++i) {
     offs[i] = opi_trait_get_method_offset(trait, nam[i]);
-    if (!replace) {
-      OpiHashMapElt *elt;
-      if (opi_hash_map_find(&trait->impls[offs[i]], tyobj, hash, &elt))
-        return OPI_ERR;
-    }
+    if (!replace && opi_trait_get_impl_noconds(trait, type, offs[i]))
+      return OPI_ERR;
   }
 
+  // invalidate inline caches
+  opi_trait_epoch += 1;
+
+  opi_t *slot = vtable_slot(trait, type);
+
   // apply supplied implementation
   for (int i = 0; i < n; ++i) {
-    OpiHashMapElt *elt;
-    opi_hash_map_find(&trait->impls[offs[i]], tyobj, hash, &elt);
-    opi_hash_map_insert(&trait->impls[offs[i]], tyobj, hash, f[i], elt);
+    opi_inc_rc(f[i]);
+    if (slot[offs[i]])
+      opi_unref(slot[offs[i]]);
+    slot[offs[i]] = f[i];
   }
   // apply default implementations
   for (int i = 0; i < trait->default_impl->n; ++i) {
@@ -619,9 +887,10 @@ opi_trait_impl(OpiTrait *trait, opi_type_t type, char *const nam[], opi_t f[],
     if (skip)
       continue;
 
-    OpiHashMapElt *elt;
-    opi_hash_map_find(&trait->impls[i], tyobj, hash, &elt);
-    opi_hash_map_insert(&trait->impls[i], tyobj, hash, trait->default_impl->fs[i], elt);
+    opi_inc_rc(trait->default_impl->fs[i]);
+    if (slot[i])
+      opi_unref(slot[i]);
+    slot[i] = trait->default_impl->fs[i];
   }
 
   return OPI_OK;
@@ -635,6 +904,7 @@ opi_trait_cond_impl(OpiTrait *trait, OpiTrait *traits[], int ntraits,
     return OPI_ERR;
   CondImpl *cimpl = cond_impl_new(impl_new(nam, f, nf), traits, ntraits);
   cod_vec_push(trait->cond_impls, cimpl);
+  opi_trait_epoch += 1;
   return OPI_OK;
 }
 
@@ -651,12 +921,9 @@ opi_trait_find_cond_impl(OpiTrait *trait, opi_type_t type)
 opi_t
 opi_trait_get_impl(OpiTrait *trait, opi_type_t type, int metoffs)
 {
-  opi_t tyobj = opi_type_get_type_object(type);
-  OpiHashMapElt *elt;
-  size_t hash = (size_t)type;
-
-  if (opi_hash_map_find_is(&trait->impls[metoffs], tyobj, hash, &elt)) {
-    return elt->val;
+  opi_t m = opi_trait_get_impl_noconds(trait, type, metoffs);
+  if (m) {
+    return m;
 
   } else {
     int impl_id = opi_trait_find_cond_impl(trait, type);
@@ -671,6 +938,29 @@ opi_trait_get_impl(OpiTrait *trait, opi_type_t type, int metoffs)
   }
 }
 
+// Start from 1 so that zero-initialized caches are invalid.
+size_t opi_trait_epoch = 1;
+
+opi_t
+opi_trait_cache_miss(OpiTraitCache *cache, OpiTrait *trait, opi_type_t type,
+    int metoffs)
+{
+  // may implement the trait (from conditional implementation) and thus change
+  // the epoch, so do the lookup first
+  opi_t impl = opi_trait_get_impl(trait, type, metoffs);
+
+  if (cache->epoch != opi_trait_epoch) {
+    cache->epoch = opi_trait_epoch;
+    cache->n = 0;
+  }
+
+  // megamorphic site: keep the first entries, replace the last one
+  int i = cache->n < OPI_TRAIT_CACHE_SIZE ? cache->n++ : OPI_TRAIT_CACHE_SIZE - 1;
+  cache->ents[i].type = type;
+  cache->ents[i].impl = impl;
+  return impl;
+}
+
 opi_t
 opi_trait_get_generic(OpiTrait *trait, int metoffs)
 {
@@ -692,6 +982,8 @@ opi_t opi_generic_hash;
 void
 opi_traits_init(void)
 {
+  cod_vec_init(g_traits);
+
   opi_trait_add = opi_trait_new((char*[]){ "add", "radd" }, 2);
   opi_generic_add = opi_trait_get_generic(opi_trait_add, 0);
   opi_generic_radd = opi_trait_get_generic(opi_trait_add, 1);
@@ -715,6 +1007,16 @@ opi_traits_init(void)
 void
 opi_traits_cleanup(void)
 {
+  // User-defined traits outlive this point, so release their implementations
+  // now (while all types are still alive).
+  for (size_t i = 0; i < g_traits.len; ++i) {
+    OpiTrait *trait = g_traits.data[i];
+    if (trait) {
+      cod_vec_iter(trait->types, j, x, vtable_slot_delete(trait, x));
+      trait->types.len = 0;
+    }
+  }
+
   opi_trait_delete(opi_trait_add);
   opi_trait_delete(opi_trait_sub);
   opi_trait_delete(opi_trait_mul);
@@ -724,58 +1026,110 @@ opi_traits_cleanup(void)
 
 /******************************************************************************/
 opi_type_t
-opi_num_type;
+opi_int_type;
+
+opi_type_t
+opi_float_type;
+
+static void
+int_write(opi_type_t ty, opi_t x, FILE *out)
+{ fprintf(out, "%jd", opi_int_get_value(x)); }
 
 static void
-num_write(opi_type_t ty, opi_t x, FILE *out)
+int_delete(opi_type_t ty, opi_t cell)
+{ opi_h2w_free(cell); }
+
+static int
+int_eq(opi_type_t typ, opi_t x, opi_t y)
+{ return opi_int_get_value(x) == opi_int_get_value(y); }
+
+static size_t
+int_hash(opi_type_t type, opi_t x)
+{ return opi_int_get_value(x); }
+
+static void
+float_write(opi_type_t ty, opi_t x, FILE *out)
 {
-  long double val = opi_as(x, OpiNum).val;
-  long double i;
-  long double f = modfl(val, &i);
+  double val = opi_float_get_value(x);
+  double i;
+  double f = modf(val, &i);
   if (f == 0)
-    fprintf(out, "%.0Lf", i);
+    fprintf(out, "%.0f", i);
   else
-    fprintf(out, "%Lf", val);
+    fprintf(out, "%f", val);
 }
 
 static void
-num_display(opi_type_t ty, opi_t x, FILE *out)
+float_display(opi_type_t ty, opi_t x, FILE *out)
 {
-  long double val = opi_as(x, OpiNum).val;
-  long double i;
-  long double f = modfl(val, &i);
+  double val = opi_float_get_value(x);
+  double i;
+  double f = modf(val, &i);
   if (f == 0)
-    fprintf(out, "%.0Lf", i);
+    fprintf(out, "%.0f", i);
   else
-    fprintf(out, "%Lg", val);
+    fprintf(out, "%g", val);
 }
 
 static void
-num_delete(opi_type_t ty, opi_t cell)
+float_delete(opi_type_t ty, opi_t cell)
 { opi_h2w_free(cell); }
 
 static int
-num_eq(opi_type_t typ, opi_t x, opi_t y)
-{ return opi_num_get_value(x) == opi_num_get_value(y); }
+float_eq(opi_type_t typ, opi_t x, opi_t y)
+{ return opi_float_get_value(x) == opi_float_get_value(y); }
 
 static size_t
-num_hash(opi_type_t type, opi_t x)
-{ return opi_num_get_value(x); }
+float_hash(opi_type_t type, opi_t x)
+{
+  double val = opi_float_get_value(x);
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof bits);
+  return bits;
+}
 
 void
 opi_num_init(void)
 {
-  opi_num_type = opi_type_new("Num");
-  opi_type_set_write(opi_num_type, num_write);
-  opi_type_set_display(opi_num_type, num_display);
-  opi_type_set_delete_cell(opi_num_type, num_delete);
-  opi_type_set_eq(opi_num_type, num_eq);
-  opi_type_set_hash(opi_num_type, num_hash);
+  opi_int_type = opi_type_new("Int");
+  opi_type_set_write(opi_int_type, int_write);
+  opi_type_set_display(opi_int_type, int_write);
+  opi_type_set_delete_cell(opi_int_type, int_delete);
+  opi_type_set_eq(opi_int_type, int_eq);
+  opi_type_set_hash(opi_int_type, int_hash);
+
+  opi_float_type = opi_type_new("Float");
+  opi_type_set_write(opi_float_type, float_write);
+  opi_type_set_display(opi_float_type, float_display);
+  opi_type_set_delete_cell(opi_float_type, float_delete);
+  opi_type_set_eq(opi_float_type, float_eq);
+  opi_type_set_hash(opi_float_type, float_hash);
 }
 
 void
 opi_num_cleanup(void)
-{ opi_type_delete(opi_num_type); }
+{
+  opi_type_delete(opi_int_type);
+  opi_type_delete(opi_float_type);
+}
+
+opi_t
+opi_num_parse(const char *str, char **endptr)
+{
+  char *end;
+  errno = 0;
+  intmax_t i = strtoimax(str, &end, 10);
+  if (end != str && errno == 0 && !(*end && strchr(".eExX", *end))) {
+    if (endptr)
+      *endptr = end;
+    return opi_int_new(i);
+  }
+
+  double f = strtod(str, &end);
+  if (endptr)
+    *endptr = end;
+  return end == str ? NULL : opi_float_new(f);
+}
 
 /******************************************************************************/
 struct symbol {
@@ -786,8 +1140,69 @@ struct symbol {
 
 opi_type_t opi_symbol_type;
 
+/*
+ * Symbol table.
+ *
+ * Symbols are split between shards by the top bits of the hash. Each shard is
+ * an open addressing table of pointers which is never modified in place
+ * except for filling empty slots, and is replaced as a whole when it grows, so
+ * lookups need no lock. Insertions into a shard are serialized by its
+ * spin-lock. Replaced tables are kept until cleanup since a reader may still
+ * walk them.
+ */
+#define SYM_SHARDS_LOG2 4
+#define SYM_SHARDS (1 << SYM_SHARDS_LOG2)
+
+typedef struct SymTab_s {
+  struct SymTab_s *prev; // replaced table
+  size_t cap;
+  struct symbol *slots[];
+} SymTab;
+
+typedef struct SymShard_s {
+  SymTab *tab;
+  size_t size;
+  char lock;
+} SymShard;
+
 static
-OpiHashMap g_sym_map;
+SymShard g_sym_shards[SYM_SHARDS];
+
+static SymTab*
+symtab_new(size_t cap, SymTab *prev)
+{
+  SymTab *tab = calloc(1, sizeof(SymTab) + sizeof(struct symbol*) * cap);
+  tab->prev = prev;
+  tab->cap = cap;
+  return tab;
+}
+
+static inline SymShard*
+sym_shard(uint64_t hash)
+{ return g_sym_shards + (hash >> (64 - SYM_SHARDS_LOG2)); }
+
+static struct symbol*
+symtab_find(SymTab *tab, const char *str, uint64_t hash)
+{
+  size_t mask = tab->cap - 1;
+  for (size_t i = hash & mask; TRUE; i = (i + 1) & mask) {
+    struct symbol *sym = __atomic_load_n(&tab->slots[i], __ATOMIC_ACQUIRE);
+    if (sym == NULL)
+      return NULL;
+    if (sym->hash == hash && strcmp(sym->str, str) == 0)
+      return sym;
+  }
+}
+
+static void
+symtab_put(SymTab *tab, struct symbol *sym)
+{
+  size_t mask = tab->cap - 1;
+  size_t i = sym->hash & mask;
+  while (tab->slots[i])
+    i = (i + 1) & mask;
+  __atomic_store_n(&tab->slots[i], sym, __ATOMIC_RELEASE);
+}
 
 static void
 symbol_write(opi_type_t ty, opi_t x, FILE *out)
@@ -803,11 +1218,7 @@ symbol_hash(opi_type_t ty, opi_t x)
 
 static int
 symbol_eq(opi_type_t ty, opi_t x, opi_t y)
-{
-  char *s1 = opi_as(x, struct symbol).str;
-  char *s2 = opi_as(y, struct symbol).str;
-  return strcmp(s1, s2) == 0;
-}
+{ return x == y; } // symbols are unique
 
 static void
 symbol_delete(opi_type_t ty, opi_t x)
@@ -827,38 +1238,71 @@ opi_symbol_init(void)
   opi_type_set_eq(opi_symbol_type, symbol_eq);
   opi_type_set_delete_cell(opi_symbol_type, symbol_delete);
 
-  opi_hash_map_init(&g_sym_map);
+  for (int i = 0; i < SYM_SHARDS; ++i) {
+    g_sym_shards[i].tab = symtab_new(0x20, NULL);
+    g_sym_shards[i].size = 0;
+    g_sym_shards[i].lock = 0;
+  }
 }
 
 void
 opi_symbol_cleanup(void)
 {
-  opi_hash_map_destroy(&g_sym_map);
+  for (int i = 0; i < SYM_SHARDS; ++i) {
+    SymTab *tab = g_sym_shards[i].tab;
+    for (size_t j = 0; j < tab->cap; ++j) {
+      if (tab->slots[j])
+        opi_unref(OPI(tab->slots[j]));
+    }
+    while (tab) {
+      SymTab *prev = tab->prev;
+      free(tab);
+      tab = prev;
+    }
+  }
   opi_type_delete(opi_symbol_type);
 }
 
 opi_t
 opi_symbol(const char *str)
 {
-  OpiHashMapElt *elt;
   uint64_t hash = opi_hash(str, strlen(str));
+  SymShard *shard = sym_shard(hash);
+
+  struct symbol *sym;
+  SymTab *tab = __atomic_load_n(&shard->tab, __ATOMIC_ACQUIRE);
+  if ((sym = symtab_find(tab, str, hash)))
+    return (opi_t)sym;
 
-  struct symbol sym;
-  sym.str = (void*)str;
-  opi_init_cell(&sym, opi_symbol_type);
+  while (__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE))
+    ;
 
-  if (opi_hash_map_find(&g_sym_map, (opi_t)&sym, hash, &elt)) {
-    return elt->val;
-  } else {
+  // may have been inserted while we were waiting for the lock
+  tab = shard->tab;
+  if (!(sym = symtab_find(tab, str, hash))) {
     // Create new symbol:
-    struct symbol *sym = malloc(sizeof(struct symbol));
+    sym = malloc(sizeof(struct symbol));
     sym->str = strdup(str);
     sym->hash = hash;
     opi_init_cell(sym, opi_symbol_type);
-    // insert it into global hash-table
-    opi_hash_map_insert(&g_sym_map, (opi_t)sym, hash, (opi_t)sym, elt);
-    return (opi_t)sym;
+    opi_inc_rc(OPI(sym));
+
+    // keep load factor below 1/2
+    if ((shard->size + 1) * 2 > tab->cap) {
+      SymTab *newtab = symtab_new(tab->cap * 2, tab);
+      for (size_t i = 0; i < tab->cap; ++i) {
+        if (tab->slots[i])
+          symtab_put(newtab, tab->slots[i]);
+      }
+      __atomic_store_n(&shard->tab, newtab, __ATOMIC_RELEASE);
+      tab = newtab;
+    }
+    symtab_put(tab, sym);
+    shard->size += 1;
   }
+
+  __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+  return (opi_t)sym;
 }
 
 const char*
@@ -981,10 +1425,22 @@ static void
 str_display(opi_type_t ty, opi_t x, FILE *out)
 { fprintf(out, "%s", opi_as(x, OpiStr).str); }
 
+// interned strings (not owned by the table)
+static
+OpiHashMap g_str_intern;
+
+static size_t
+str_hash(opi_type_t ty, opi_t x);
+
 static void
 str_delete(opi_type_t ty, opi_t x)
 {
   OpiStr *s = opi_as_ptr(x);
+  if (x->meta == OPI_STR_INTERNED) {
+    OpiHashMapElt *elt;
+    if (opi_hash_map_find_is(&g_str_intern, x, str_hash(ty, x), &elt))
+      opi_hash_map_forget(&g_str_intern, elt);
+  }
   free(s->str);
   opi_h2w_free(s);
 }
@@ -992,6 +1448,11 @@ str_delete(opi_type_t ty, opi_t x)
 static int
 str_eq(opi_type_t ty, opi_t x, opi_t y)
 {
+  if (x == y)
+    return TRUE;
+  if (x->meta == OPI_STR_INTERNED && y->meta == OPI_STR_INTERNED)
+    return FALSE;
+
   size_t l1 = OPI_STR(x)->len;
   size_t l2 = OPI_STR(y)->len;
   const char *s1 = OPI_STR(x)->str;
@@ -1016,11 +1477,23 @@ opi_str_init(void)
   opi_type_set_delete_cell(opi_str_type, str_delete);
   opi_type_set_eq(opi_str_type, str_eq);
   opi_type_set_hash(opi_str_type, str_hash);
+
+  opi_hash_map_init(&g_str_intern, 0);
 }
 
 void
 opi_str_cleanup(void)
-{ opi_type_delete(opi_str_type); }
+{
+  // strings still alive are not interned anymore
+  size_t it = opi_hash_map_begin(&g_str_intern);
+  for (opi_t str; opi_hash_map_get(&g_str_intern, it, &str, NULL);
+       it = opi_hash_map_next(&g_str_intern, it)) {
+    str->meta = OPI_META_NONE;
+    opi_hash_map_forget(&g_str_intern, g_str_intern.data + it);
+  }
+  opi_hash_map_destroy(&g_str_intern);
+  opi_type_delete(opi_str_type);
+}
 
 extern inline opi_t
 opi_str_drain_with_len(char *str, size_t len)
@@ -1061,6 +1534,31 @@ opi_str_from_char(char c)
   return (opi_t)s;
 }
 
+opi_t
+opi_str_intern(opi_t str)
+{
+  if (str->meta == OPI_STR_INTERNED)
+    return str;
+
+  size_t hash = opi_hash(OPI_STR(str)->str, OPI_STR(str)->len);
+  OpiHashMapElt *elt;
+  if (opi_hash_map_find(&g_str_intern, str, hash, &elt)) {
+    if (opi_get_rc(elt->val) > 0)
+      return elt->val;
+    // The string may be dead and waiting in the free queue: take over the
+    // entry. If it is alive after all, it is only compared by contents now.
+    elt->val->meta = OPI_META_NONE;
+    elt->key = elt->val = str;
+  } else {
+    opi_hash_map_insert(&g_str_intern, str, hash, str, NULL);
+    // drop the references taken by the table
+    opi_dec_rc(str);
+    opi_dec_rc(str);
+  }
+  str->meta = OPI_STR_INTERNED;
+  return str;
+}
+
 /******************************************************************************/
 typedef struct OpiRegEx_s {
   OpiHeader header;
@@ -1165,11 +1663,11 @@ opi_type_t opi_pair_type;
 static void
 pair_display(opi_type_t ty, opi_t x, FILE *out)
 {
-  while (x->type == opi_pair_type) {
-    if (opi_car(x)->type == opi_pair_type)
+  while (opi_typeof(x) == opi_pair_type) {
+    if (opi_typeof(opi_car(x)) == opi_pair_type)
       putc('(', out);
     opi_display(opi_car(x), out);
-    if (opi_car(x)->type == opi_pair_type)
+    if (opi_typeof(opi_car(x)) == opi_pair_type)
       putc(')', out);
     putc(':', out);
     x = opi_cdr(x);
@@ -1180,11 +1678,11 @@ pair_display(opi_type_t ty, opi_t x, FILE *out)
 static void
 pair_write(opi_type_t ty, opi_t x, FILE *out)
 {
-  while (x->type == opi_pair_type) {
-    if (opi_car(x)->type == opi_pair_type)
+  while (opi_typeof(x) == opi_pair_type) {
+    if (opi_typeof(opi_car(x)) == opi_pair_type)
       putc('(', out);
     opi_write(opi_car(x), out);
-    if (opi_car(x)->type == opi_pair_type)
+    if (opi_typeof(opi_car(x)) == opi_pair_type)
       putc(')', out);
     putc(':', out);
     x = opi_cdr(x);
@@ -1194,14 +1692,11 @@ pair_write(opi_type_t ty, opi_t x, FILE *out)
 
 static void
 pair_delete(opi_type_t ty, opi_t x) {
-  while (x->type == opi_pair_type) {
-    opi_t tmp = opi_cdr(x);
-    opi_unref(opi_car(x));
-    opi_h2w_free(x);
-    if (opi_dec_rc(x = tmp) > 0)
-      return;
-  }
-  opi_drop(x);
+  // tail goes through the free-queue, so long lists are freed incrementally
+  opi_t cdr = opi_cdr(x);
+  opi_unref(opi_car(x));
+  opi_h2w_free(x);
+  opi_unref(cdr);
 }
 
 void
@@ -1222,7 +1717,9 @@ opi_pair_cleanup(void)
 /******************************************************************************/
 struct table {
   OpiHeader header;
+  // exactly one of the two is used
   OpiHashMap *map;
+  OpiHamt *hamt;
 };
 
 opi_type_t opi_table_type;
@@ -1230,9 +1727,14 @@ opi_type_t opi_table_type;
 static void
 table_delete(opi_type_t ty, opi_t x)
 {
-  OpiHashMap *table = opi_as(x, struct table).map;
-  opi_hash_map_destroy(table);
-  free(table);
+  struct table *t = opi_as_ptr(x);
+  if (t->map) {
+    opi_hash_map_destroy(t->map);
+    opi_free(t->map, sizeof(OpiHashMap));
+  } else {
+    opi_hamt_destroy(t->hamt);
+    opi_free(t->hamt, sizeof(OpiHamt));
+  }
   opi_h2w_free(x);
 }
 
@@ -1247,46 +1749,60 @@ void
 opi_table_cleanup(void)
 { opi_type_delete(opi_table_type); }
 
-opi_t
-opi_table(opi_t l, int replace)
+static opi_t
+table_new(OpiHashMap *map, OpiHamt *hamt)
 {
-  OpiHashMap *map = malloc(sizeof(OpiHashMap));
-  opi_hash_map_init(map);
+  struct table *tab = opi_h2w();
+  tab->map = map;
+  tab->hamt = hamt;
+  opi_init_cell(tab, opi_table_type);
+  return (opi_t)tab;
+}
 
-  for (opi_t it = l; it->type == opi_pair_type; it = opi_cdr(it)) {
+static opi_t
+table_of_list(opi_t tab, opi_t l, int replace)
+{
+  for (opi_t it = l; opi_typeof(it) == opi_pair_type; it = opi_cdr(it)) {
     opi_t kv = opi_car(it);
-    if (opi_unlikely(kv->type != opi_pair_type)) {
-      opi_hash_map_destroy(map);
-      free(map);
+    if (opi_unlikely(opi_typeof(kv) != opi_pair_type)) {
+      opi_drop(tab);
       return opi_undefined(opi_symbol("type-error"));
     }
 
-    opi_t key = opi_car(kv);
-    if (opi_unlikely(!opi_type_is_hashable(key->type))) {
-      opi_hash_map_destroy(map);
-      free(map);
-      return opi_undefined(opi_symbol("hash-error"));
-    }
-
-    size_t hash = opi_hashof(key);
-    OpiHashMapElt *elt;
-    if (opi_hash_map_find(map, key, hash, &elt)) {
-      if (replace) {
-        opi_hash_map_insert(map, key, hash, kv, elt);
-      } else {
-        opi_hash_map_destroy(map);
-        free(map);
-        return opi_undefined(opi_symbol("key-collision"));
-      }
-    } else {
-      opi_hash_map_insert(map, key, hash, kv, elt);
+    opi_t err;
+    if (!opi_table_insert(tab, kv, replace, &err)) {
+      opi_drop(tab);
+      return err ? err : opi_undefined(opi_symbol("key-collision"));
     }
   }
+  return tab;
+}
 
-  struct table *tab = opi_h2w();
-  tab->map = map;
-  opi_init_cell(tab, opi_table_type);
-  return (opi_t)tab;
+opi_t
+opi_table(opi_t l, int replace)
+{
+  OpiHashMap *map = opi_alloc(sizeof(OpiHashMap));
+  opi_hash_map_init(map, 0);
+  return table_of_list(table_new(map, NULL), l, replace);
+}
+
+opi_t
+opi_table_persistent(opi_t l, int replace)
+{
+  OpiHamt *hamt = opi_alloc(sizeof(OpiHamt));
+  opi_hamt_init(hamt);
+  return table_of_list(table_new(NULL, hamt), l, replace);
+}
+
+int
+opi_table_is_persistent(opi_t tab)
+{ return ((struct table*)tab)->hamt != NULL; }
+
+size_t
+opi_table_size(opi_t tab)
+{
+  struct table *t = (void*)tab;
+  return t->map ? t->map->size : t->hamt->size;
 }
 
 opi_t
@@ -1294,21 +1810,31 @@ opi_table_at(opi_t tab, opi_t key, opi_t *err)
 {
   struct table *t = opi_as_ptr(tab);
 
-  if (opi_unlikely(!opi_type_is_hashable(key->type))) {
+  if (opi_unlikely(!opi_type_is_hashable(opi_typeof(key)))) {
     if (err)
       *err = opi_undefined(opi_symbol("hash-error"));
     return NULL;
   }
 
   size_t hash = opi_hashof(key);
-  OpiHashMapElt *elt;
-  if (opi_hash_map_find(t->map, key, hash, &elt)) {
-    return elt->val;
+  opi_t x;
+  if (t->map) {
+    OpiHashMapElt *elt;
+    x = opi_hash_map_find(t->map, key, hash, &elt) ? elt->val : NULL;
   } else {
-    if (err)
-      *err = opi_undefined(opi_symbol("out-of-range"));
-    return NULL;
+    x = opi_hamt_find(t->hamt, key, hash);
   }
+
+  if (x == NULL && err)
+    *err = opi_undefined(opi_symbol("out-of-range"));
+  return x;
+}
+
+static void
+table_pairs_add(opi_t key, opi_t val, void *data)
+{
+  opi_t *l = data;
+  *l = opi_cons(val, *l);
 }
 
 opi_t
@@ -1317,10 +1843,14 @@ opi_table_pairs(opi_t tab)
   struct table *t = (void*)tab;
   opi_t l = opi_nil;
   opi_t val;
-  size_t it = opi_hash_map_begin(t->map);
-  while (opi_hash_map_get(t->map, it, NULL, &val)) {
-    l = opi_cons(val, l);
-    it = opi_hash_map_next(t->map, it);
+  if (t->map) {
+    size_t it = opi_hash_map_begin(t->map);
+    while (opi_hash_map_get(t->map, it, NULL, &val)) {
+      l = opi_cons(val, l);
+      it = opi_hash_map_next(t->map, it);
+    }
+  } else {
+    opi_hamt_foreach(t->hamt, table_pairs_add, &l);
   }
   return l;
 }
@@ -1331,13 +1861,21 @@ opi_table_insert(opi_t tab, opi_t pair, int replace, opi_t *err)
   struct table *t = opi_as_ptr(tab);
   opi_t key = opi_car(pair);
 
-  if (opi_unlikely(!opi_type_is_hashable(key->type))) {
+  if (opi_unlikely(!opi_type_is_hashable(opi_typeof(key)))) {
     if (err)
       *err = opi_undefined(opi_symbol("hash-error"));
     return FALSE;
   }
 
   size_t hash = opi_hashof(key);
+  if (t->hamt) {
+    if (opi_hamt_insert(t->hamt, key, hash, pair, replace))
+      return TRUE;
+    if (err)
+      *err = NULL;
+    return FALSE;
+  }
+
   OpiHashMapElt *elt;
   if (opi_hash_map_find(t->map, key, hash, &elt)) {
     if (replace) {
@@ -1354,18 +1892,55 @@ opi_table_insert(opi_t tab, opi_t pair, int replace, opi_t *err)
   }
 }
 
+int
+opi_table_remove(opi_t tab, opi_t key, opi_t *err)
+{
+  struct table *t = opi_as_ptr(tab);
+
+  if (opi_unlikely(!opi_type_is_hashable(opi_typeof(key)))) {
+    if (err)
+      *err = opi_undefined(opi_symbol("hash-error"));
+    return FALSE;
+  }
+
+  size_t hash = opi_hashof(key);
+  if (t->hamt) {
+    if (opi_hamt_erase(t->hamt, key, hash))
+      return TRUE;
+  } else {
+    OpiHashMapElt *elt;
+    if (opi_hash_map_find(t->map, key, hash, &elt)) {
+      opi_hash_map_erase(t->map, elt);
+      return TRUE;
+    }
+  }
+
+  if (err)
+    *err = opi_undefined(opi_symbol("out-of-range"));
+  return FALSE;
+}
+
 opi_t
 opi_table_copy(opi_t tab)
 {
   struct table *t = (void*)tab;
-  opi_t newtab = opi_table(opi_nil, 0);
-  opi_t val;
+
+  if (t->hamt) {
+    OpiHamt *hamt = opi_alloc(sizeof(OpiHamt));
+    opi_hamt_share(hamt, t->hamt);
+    return table_new(NULL, hamt);
+  }
+
+  OpiHashMap *map = opi_alloc(sizeof(OpiHashMap));
+  opi_hash_map_init(map, t->map->size);
+  opi_t key, val;
   size_t it = opi_hash_map_begin(t->map);
-  while (opi_hash_map_get(t->map, it, NULL, &val)) {
-    opi_table_insert(newtab, val, FALSE, NULL);
+  while (opi_hash_map_get(t->map, it, &key, &val)) {
+    OpiHashMapElt *elt = t->map->data + it;
+    opi_hash_map_insert(map, key, elt->hash, val, NULL);
     it = opi_hash_map_next(t->map, it);
   }
-  return newtab;
+  return table_new(map, NULL);
 }
 
 /******************************************************************************/
@@ -1460,12 +2035,28 @@ opi_fn_delete(OpiFn *fn)
   opi_h6w_free(fn);
 }
 
+static void
+fn_traverse(opi_type_t type, opi_t x, void (*visit)(opi_t,void*), void *data)
+{
+  // only captures of lambdas are known; siblings from the same recursive
+  // scope are not owned
+  opi_fn_handle_t handle = opi_fn_get_handle(x);
+  if (handle != opi_lambda_fn && handle != opi_generator_fn)
+    return;
+  OpiLambda *lam = OPI_FN(x)->data;
+  for (size_t i = 0; i < lam->ncaps; ++i) {
+    if (!opi_is_rec_sibling(x, lam->caps[i]))
+      visit(lam->caps[i], data);
+  }
+}
+
 void
 opi_fn_init(void)
 {
   opi_fn_type = opi_type_new("Fn");
   opi_type_set_display(opi_fn_type, fn_display);
   opi_type_set_delete_cell(opi_fn_type, fn_delete);
+  opi_type_set_traverse(opi_fn_type, fn_traverse);
 }
 
 void
@@ -1520,7 +2111,7 @@ curry_delete(OpiFn *fn)
   opi_unref(data->f);
   for (size_t i = 0; i < data->n; ++i)
     opi_unref(data->p[i]);
-  free(data);
+  opi_free(data, sizeof(struct curry_data) + sizeof(opi_t) * data->n);
   opi_fn_delete(fn);
 }
 
@@ -1560,7 +2151,7 @@ opi_apply_partial(opi_t f, int nargs)
 
       opi_t tmp_f = opi_fn_apply(f, arity);
       opi_inc_rc(tmp_f);
-      if (opi_unlikely(tmp_f->type != opi_fn_type)) {
+      if (opi_unlikely(opi_typeof(tmp_f) != opi_fn_type)) {
         opi_unref(tmp_f);
         while (nargs--)
           opi_unref(opi_pop());
@@ -1579,7 +2170,7 @@ opi_apply_partial(opi_t f, int nargs)
       // Curry functoin.
       //
       struct curry_data *data =
-        malloc(sizeof(struct curry_data) + sizeof(opi_t) * nargs);
+        opi_alloc(sizeof(struct curry_data) + sizeof(opi_t) * nargs);
       opi_inc_rc(data->f = f);
       data->n = nargs;
       for (int i = 0; i < nargs; ++i)
@@ -1604,11 +2195,16 @@ lazy_delete(opi_type_t type, opi_t x)
   opi_h2w_free(lazy);
 }
 
+static void
+lazy_traverse(opi_type_t type, opi_t x, void (*visit)(opi_t,void*), void *data)
+{ visit(OPI_LAZY(x)->cell, data); }
+
 void
 opi_lazy_init(void)
 {
   opi_lazy_type = opi_type_new("lazy");
   opi_type_set_delete_cell(opi_lazy_type, lazy_delete);
+  opi_type_set_traverse(opi_lazy_type, lazy_traverse);
 }
 
 void
@@ -1633,7 +2229,13 @@ static void
 seq_delete(opi_type_t type, opi_t x)
 {
   OpiSeq *seq = opi_as_ptr(x);
-  seq->cfg.dtor(seq->iter);
+  seq->cache->cfg.dtor(seq->iter);
+  if (seq->cprev)
+    seq->cprev->cnext = seq->cnext;
+  else
+    seq->cache->seqs = seq->cnext;
+  if (seq->cnext)
+    seq->cnext->cprev = seq->cprev;
   opi_seq_cache_unref(seq->cache);
   opi_h6w_free(seq);
 }
@@ -1643,7 +2245,7 @@ opi_seq_init(void)
 {
   opi_seq_type = opi_type_new("Seq");
   opi_type_set_delete_cell(opi_seq_type, seq_delete);
-  opi_assert(sizeof(OpiSeq) == sizeof(OpiH6w));
+  opi_assert(sizeof(OpiSeq) <= sizeof(OpiH6w));
 }
 
 void
@@ -1658,10 +2260,14 @@ opi_seq_new_with_cache(OpiIter *iter, OpiSeqCfg cfg, OpiSeqCache *cache, int cnt
   opi_assert(cfg.next && cfg.dtor && cfg.copy);
   OpiSeq *seq = opi_h6w();
   seq->iter = iter;
-  seq->cfg = cfg;
+  cache->cfg = cfg;
   seq->cache = cache;
   opi_seq_cache_ref(cache);
-  seq->cnt = cnt;
+  seq->cprev = NULL;
+  if ((seq->cnext = cache->seqs))
+    cache->seqs->cprev = seq;
+  cache->seqs = seq;
+  seq->cnt = seq->held = cnt;
   seq->is_free = FALSE;
   opi_init_cell(seq, opi_seq_type);
   return OPI(seq);
@@ -1678,8 +2284,105 @@ opi_t
 opi_seq_copy(opi_t x)
 {
   OpiSeq *seq = opi_as_ptr(x);
-  OpiIter *iter = seq->cfg.copy(seq->iter);
-  return opi_seq_new_with_cache(iter, seq->cfg, seq->cache, seq->cnt);
+  OpiIter *iter = seq->cache->cfg.copy(seq->iter);
+  return opi_seq_new_with_cache(iter, seq->cache->cfg, seq->cache, seq->cnt);
+}
+
+static void
+seq_stolen_dtor(OpiIter *iter)
+{ }
+
+int
+opi_seq_steal(opi_t x, OpiIter **iter, OpiSeqCfg *cfg)
+{
+  OpiSeq *seq = opi_as_ptr(x);
+  OpiSeqCache *cache = seq->cache;
+  if (opi_get_rc(x) != 1 || cache->rc != 1 || seq->cnt == cache->end_cnt ||
+      seq->cnt < cache->base + OPI_ARRAY(cache->arr)->len)
+    return FALSE;
+
+  *iter = seq->iter;
+  *cfg = cache->cfg;
+  cache->cfg.dtor = seq_stolen_dtor;
+  opi_unref(x);
+  return TRUE;
+}
+
+size_t
+opi_seq_next_batch(opi_t x, opi_t *out, size_t n)
+{
+  OpiSeq *seq = (OpiSeq*)x;
+  OpiSeqCache *cache = seq->cache;
+
+  seq->held = seq->cnt;
+  if (opi_unlikely(seq->cnt == cache->end_cnt))
+    return 0;
+
+  // take elements from cache
+  OpiArray *arr = OPI_ARRAY(cache->arr);
+  size_t i = seq->cnt - cache->base;
+  if (i < arr->len) {
+    size_t k = arr->len - i;
+    if (k > n)
+      k = n;
+    memcpy(out, arr->data + i, sizeof(opi_t) * k);
+    seq->cnt += k;
+    return k;
+  }
+
+  if (seq->cache->cfg.next_batch == NULL) {
+    // elements may have side effects: don't evaluate ahead
+    return (out[0] = opi_seq_next(x)) ? 1 : 0;
+  }
+
+  size_t k = seq->cache->cfg.next_batch(seq->iter, out, n);
+  if (opi_unlikely(k == 0)) {
+    cache->end_cnt = seq->cnt;
+    return 0;
+  }
+  seq->cnt += k;
+
+  // same as in opi_seq_next()
+  if (!seq->is_free) {
+    if (cache->rc == 1) {
+      seq->is_free = TRUE;
+    } else {
+      for (size_t i = 0; i < k; ++i)
+        opi_array_push(cache->arr, out[i]);
+      if (arr->len >= cache->trim_at)
+        opi_seq_cache_trim(cache);
+    }
+  }
+  return k;
+}
+
+void
+opi_seq_cache_trim(OpiSeqCache *cache)
+{
+  OpiArray *arr = OPI_ARRAY(cache->arr);
+
+  // find the slowest copy; elements it has last returned may still be in use
+  uint32_t min = UINT32_MAX;
+  size_t nseqs = 0;
+  for (OpiSeq *seq = cache->seqs; seq; seq = seq->cnext) {
+    nseqs += 1;
+    if (seq->held < min)
+      min = seq->held;
+  }
+
+  if (nseqs == cache->rc && min > cache->base) {
+    size_t k = min - cache->base;
+    for (size_t i = 0; i < k; ++i)
+      opi_unref(arr->data[i]);
+    memmove(arr->data, arr->data + k, sizeof(opi_t) * (arr->len - k));
+    arr->len -= k;
+    cache->base = min;
+  }
+
+  // amortize the scan over as many pushes as there are elements left
+  cache->trim_at = arr->len * 2;
+  if (cache->trim_at < OPI_SEQ_TRIM_MIN)
+    cache->trim_at = OPI_SEQ_TRIM_MIN;
 }
 
 opi_t
@@ -1691,12 +2394,12 @@ opi_seq_force(opi_t s, int must_cache)
     opi_seq_cache_inc_rc(seq->cache);
 
   // evaluate untill finished
-  while (TRUE) {
-    opi_t x = opi_seq_next(s);
-    if (opi_unlikely(x == NULL))
-      break;
-    if (opi_unlikely(x->type == opi_undefined_type))
-      return x;
+  opi_t buf[OPI_SEQ_BATCH];
+  size_t n;
+  while ((n = opi_seq_next_batch(s, buf, OPI_SEQ_BATCH))) {
+    opi_t last = buf[n - 1];
+    if (opi_unlikely(opi_typeof(last) == opi_undefined_type))
+      return last;
   }
 
   if (must_cache)
@@ -1717,7 +2420,16 @@ array_delete(opi_type_t type, opi_t x)
   for (size_t i = 0; i < n; ++i)
     opi_unref(a[i]);
   free(a);
-  free(x);
+  opi_free(x, sizeof(OpiArray));
+}
+
+static void
+array_traverse(opi_type_t type, opi_t x, void (*visit)(opi_t,void*), void *data)
+{
+  opi_t *a = opi_array_get_data(x);
+  size_t n = opi_array_get_length(x);
+  for (size_t i = 0; i < n; ++i)
+    visit(a[i], data);
 }
 
 static void
@@ -1755,6 +2467,7 @@ opi_array_init(void)
   opi_type_set_delete_cell(opi_array_type, array_delete);
   opi_type_set_write(opi_array_type, array_write);
   opi_type_set_display(opi_array_type, array_display);
+  opi_type_set_traverse(opi_array_type, array_traverse);
 }
 
 void
@@ -1766,7 +2479,7 @@ opi_array_cleanup(void)
 opi_t
 opi_array_drain(opi_t *data, size_t len, size_t cap)
 {
-  OpiArray *arr = malloc(sizeof(OpiArray));
+  OpiArray *arr = opi_alloc(sizeof(OpiArray));
   if (cap == 0) {
     cap = 0x10;
     data = malloc(sizeof(opi_t) * cap);
@@ -1861,15 +2574,24 @@ opi_type_t opi_var_type;
 static void
 delete_var(opi_type_t type, opi_t x)
 {
+#ifdef OPI_CYCLE_COLLECTOR
+  if (OPI_VAR(x)->gcidx != OPI_GCIDX_NONE)
+    opi_cycles_untrack(x);
+#endif
   opi_unref(OPI_VAR(x)->val);
   opi_h2w_free(x);
 }
 
+static void
+traverse_var(opi_type_t type, opi_t x, void (*visit)(opi_t,void*), void *data)
+{ visit(OPI_VAR(x)->val, data); }
+
 void
 opi_var_init(void)
 {
   opi_var_type = opi_type_new("variable");
   opi_type_set_delete_cell(opi_var_type, delete_var);
+  opi_type_set_traverse(opi_var_type, traverse_var);
 }
 
 void
@@ -44,6 +44,7 @@ void
 opi_rec_scp_cleanup(void)
 {
   cod_vec_iter(g_pools, i, x, free(x));
+  cod_vec_destroy(g_pools);
 }
 
 OpiRecScp*
@@ -72,15 +73,17 @@ opi_rec_scp_alloc(size_t scpsize)
     }
   }
 
-  ret->nodes = malloc(sizeof(OpiRecNode) * scpsize);
+  ret->nodes = opi_alloc(sizeof(OpiRecNode) * scpsize);
   ret->n = scpsize;
+  ret->rc = 0;
+  ret->suspects = 0;
   return ret;
 }
 
 void
 opi_rec_scp_free(OpiRecScp *scp)
 {
-  free(scp->nodes);
+  opi_free(scp->nodes, sizeof(OpiRecNode) * scp->n);
   scp->next = g_free_scp;
   g_free_scp = scp;
 }
@@ -88,7 +91,60 @@ opi_rec_scp_free(OpiRecScp *scp)
 OpiRecScp*
 opi_rec_scp_from_id(uint32_t id)
 {
-  uint32_t poolid = id & (POOL_SIZE - 1);
-  uint32_t cellid = id >> LOG2_POOL_SIZE;
+  uint32_t poolid = id >> LOG2_POOL_SIZE;
+  uint32_t cellid = id & (POOL_SIZE - 1);
   return &g_pools.data[poolid]->arr[cellid];
 }
+
+int
+opi_rec_scp_dropout(OpiRecScp *scp, size_t i)
+{
+  // A member may get resurrected by its siblings and die again; it is counted
+  // only once.
+  if (scp->nodes[i].dropped)
+    return FALSE;
+  scp->nodes[i].dropped = TRUE;
+  if (--scp->rc > 0)
+    return FALSE;
+
+  // Everyone has dropped out at least once; check for resurrected members.
+  // Each suspect is checked once per load, so no dropout pays for a scan.
+  for (size_t j = scp->suspects; j; ) {
+    OpiRecNode *node = scp->nodes + j - 1;
+    j = node->next_suspect;
+    node->suspect = FALSE;
+    if (node->val->rc > 0) {
+      node->dropped = FALSE;
+      scp->rc += 1;
+    }
+  }
+  scp->suspects = 0;
+  return scp->rc == 0;
+}
+
+void
+opi_rec_scp_suspect(OpiRecScp *scp, size_t i)
+{
+  OpiRecNode *node = scp->nodes + i;
+  // it may be about to drop out as well, so it is marked even if it has not
+  if (node->suspect)
+    return;
+  node->suspect = TRUE;
+  node->next_suspect = scp->suspects;
+  scp->suspects = i + 1;
+}
+
+void
+opi_rec_scp_destroy(OpiRecScp *scp, opi_t queued)
+{
+  for (size_t j = 0; j < scp->n; ++j)
+    scp->nodes[j].destroy(scp->nodes[j].val);
+  for (size_t j = 0; j < scp->n; ++j) {
+#ifdef OPI_MEM_CENSUS
+    if (scp->nodes[j].val != queued)
+      opi_census_add(scp->nodes[j].val->type, -1);
+#endif
+    scp->nodes[j].free(scp->nodes[j].val);
+  }
+  opi_rec_scp_free(scp);
+}
@@ -75,7 +75,6 @@ start_token_t opi_start_token;
 %union {
   opi_t opi;
   OpiAst *ast;
-  long double num;
   char c;
   char *str;
   struct binds *binds;
@@ -143,7 +142,7 @@ start_token_t opi_start_token;
 %nonassoc STRUCT TRAIT IMPL FOR
 
 %token<c>   CHAR
-%token<num> NUMBER
+%token<opi> NUMBER
 %token<str> SYMBOL TYPE SHELL
 %token<opi> CONST
 %token<str> S R_OPTS
@@ -166,7 +165,7 @@ start_token_t opi_start_token;
 %token LOAD
 %token MODULE
 %token USE AS
-%nonassoc RETURN
+%nonassoc RETURN YIELD
 /*%token DOTDOT*/
 
 %token FMT_START
@@ -254,7 +253,7 @@ ctor_aux
 ;
 
 Atom
-  : NUMBER { $$ = opi_ast_const(opi_num_new($1)); }
+  : NUMBER { $$ = opi_ast_const($1); }
   | Symbol { $$ = opi_ast_var($1); free($1); }
   | CONST { $$ = opi_ast_const($1); }
   | string
@@ -380,6 +379,9 @@ Stmnt
   | RETURN Expr {
     $$ = opi_ast_return($2);
   }
+  | YIELD Expr {
+    $$ = opi_ast_yield($2);
+  }
   | BEG Expr END { $$ = $2; }
 ;
 
@@ -457,12 +459,13 @@ Expr
   | Expr SCAND Expr { $$ = opi_ast_and($1, $3); }
   | Expr SCOR Expr { $$ = opi_ast_or($1, $3); }
   | '-' Expr %prec UMINUS {
-    if ($2->tag == OPI_AST_CONST && $2->cnst->type == opi_num_type) {
-      long double x = opi_num_get_value($2->cnst);
-      opi_as($2->cnst, OpiNum).val = -x;
+    if ($2->tag == OPI_AST_CONST && opi_is_num($2->cnst)) {
+      opi_t x = $2->cnst;
+      opi_inc_rc($2->cnst = opi_num_mul(opi_int_new(-1), x));
+      opi_unref(x);
       $$ = $2;
     } else {
-      OpiAst *p[] = { opi_ast_const(opi_num_new(0)), $2 };
+      OpiAst *p[] = { opi_ast_const(opi_int_new(0)), $2 };
       $$ = opi_ast_apply(opi_ast_var("-"), p, 2);
       $$->apply.loc = location(&@$);
     }
@@ -1058,7 +1061,7 @@ vafn_aux
   : DOTDOT SYMBOL RARROW Expr %prec FN {
     char *p[] = { $2 };
     OpiAst *fn = opi_ast_fn(p, 1, $4);
-    OpiAst *param[] = { opi_ast_const(opi_num_new(0)), fn };
+    OpiAst *param[] = { opi_ast_const(opi_int_new(0)), fn };
     $$ = opi_ast_apply(opi_ast_var("vaarg"), param, 2);
     $$->apply.loc = location(&@$);
     free($2);
@@ -1066,7 +1069,7 @@ vafn_aux
   | param DOTDOT SYMBOL RARROW Expr %prec FN {
     cod_vec_push($1, opi_ast_pattern_new_ident($3));
     OpiAst *fn = opi_ast_fn_new_with_patterns($1.data, $1.len, $5);
-    OpiAst *param[] = { opi_ast_const(opi_num_new($1.len - 1)), fn };
+    OpiAst *param[] = { opi_ast_const(opi_int_new($1.len - 1)), fn };
     $$ = opi_ast_apply(opi_ast_var("vaarg"), param, 2);
     $$->apply.loc = location(&@$);
     cod_vec_destroy($1);
@@ -1087,7 +1090,7 @@ vadef_aux
   : DOTDOT SYMBOL '=' Expr {
     char *p[] = { $2 };
     OpiAst *fn = opi_ast_fn(p, 1, $4);
-    OpiAst *param[] = { opi_ast_const(opi_num_new(0)), fn };
+    OpiAst *param[] = { opi_ast_const(opi_int_new(0)), fn };
     $$ = opi_ast_apply(opi_ast_var("vaarg"), param, 2);
     $$->apply.loc = location(&@$);
     free($2);
@@ -1095,7 +1098,7 @@ vadef_aux
   | param DOTDOT SYMBOL '=' Expr {
     cod_vec_push($1, opi_ast_pattern_new_ident($3));
     OpiAst *fn = opi_ast_fn_new_with_patterns($1.data, $1.len, $5);
-    OpiAst *param[] = { opi_ast_const(opi_num_new($1.len - 1)), fn };
+    OpiAst *param[] = { opi_ast_const(opi_int_new($1.len - 1)), fn };
     $$ = opi_ast_apply(opi_ast_var("vaarg"), param, 2);
     $$->apply.loc = location(&@$);
     cod_vec_destroy($1);
@@ -1228,12 +1231,12 @@ shell_aux: '`' fmt '`' { $$ = $2; cod_vec_push($$.s, 0); };
 
 qr
   : qr_str {
-    OpiAst *args[2] = { $1, opi_ast_const(opi_num_new(0)) };
+    OpiAst *args[2] = { $1, opi_ast_const(opi_int_new(0)) };
     $$ = opi_ast_apply(opi_ast_var("regex"), args, 2);
     $$->apply.loc = location(&@$);
   }
   | qr_str_with_opts {
-    OpiAst *args[2] = { $1.str, opi_ast_const(opi_num_new($1.opts)) };
+    OpiAst *args[2] = { $1.str, opi_ast_const(opi_int_new($1.opts)) };
     $$ = opi_ast_apply(opi_ast_var("regex"), args, 2);
     $$->apply.loc = location(&@$);
   }
@@ -1291,7 +1294,7 @@ qr_str_with_opts: 'r' fmt R_OPTS 'q' {
 };
 
 sr: S qr_str string_with_opts {
-  OpiAst *reargs[2] = { $2, opi_ast_const(opi_num_new($3.opts)) };
+  OpiAst *reargs[2] = { $2, opi_ast_const(opi_int_new($3.opts)) };
   OpiAst *re = opi_ast_apply(opi_ast_var("regex"), reargs, 2);
   OpiAst *p[] = { re, $3.str, opi_ast_const(opi_str_drain($1)) };
   $$ = opi_ast_apply(opi_ast_var("__builtin_sr"), p, 3);
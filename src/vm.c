@@ -4,79 +4,230 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <sys/mman.h>
+
+/*
+ * Dispatch.
+ *
+ * With OPI_THREADED_DISPATCH each flat instruction carries address of its
+ * handler (resolved by opi_bytecode_flatten()), and every handler jumps
+ * directly to the next one. Otherwise plain switch is used.
+ */
+#ifdef OPI_THREADED_DISPATCH
+# define CASE(opc) case opc: L_##opc
+# define DISPATCH() goto *ip->label
+# define NEXT() do { ip += 1; DISPATCH(); } while (0)
+# define LABEL(opc) [opc] = &&L_##opc
+
+static const void *const *g_labels = NULL;
+
+const void*
+opi_vm_label(OpiOpc opc)
+{
+  if (opi_unlikely(g_labels == NULL))
+    opi_vm(NULL);
+  return g_labels[opc];
+}
+#else
+# define CASE(opc) case opc
+# define DISPATCH() continue
+# define NEXT() break
+#endif
+
+/*
+ * Saved state of a caller (see OPI_FRAME_STACK).
+ */
+typedef struct VmFrame_s {
+  OpiBytecode *bc;
+  OpiFlatInsn *ip; // application instruction
+  opi_t *r;
+  OpiFn *fn;
+  OpiRecScp *scp;
+  size_t scpcnt;
+} VmFrame;
+
+static opi_t *g_regs, *g_regs_end;
+static opi_t *g_regs_top; // end of registers of the top activation
+static size_t g_regs_mapsize;
+
+static VmFrame *g_frames, *g_frames_end;
+static VmFrame *g_fp;
+static size_t g_frames_mapsize;
+
+void
+opi_vm_init(void)
+{
+  g_regs_top = g_regs = opi_stack_map(sizeof(opi_t) * OPI_VM_NREGS, &g_regs_mapsize);
+  g_regs_end = g_regs + OPI_VM_NREGS;
+  g_fp = g_frames = opi_stack_map(sizeof(VmFrame) * OPI_VM_NFRAMES, &g_frames_mapsize);
+  g_frames_end = g_frames + OPI_VM_NFRAMES;
+}
 
-opi_t
-opi_vm(OpiBytecode *bc)
+void
+opi_vm_cleanup(void)
 {
-  OpiRecScope *scp = NULL;
+  munmap(g_regs, g_regs_mapsize);
+  munmap(g_frames, g_frames_mapsize);
+}
+
+// Store result of the application instruction at ip (see do_return in
+// opi_vm()).
+#define SET_CALL_RESULT(x)              \
+  do {                                  \
+    opi_t x_ = (x);                     \
+    if (ip->opc == OPI_OPC_APPLYRC)     \
+      opi_inc_rc(x_);                   \
+    r[OPI_APPLY_REG_OUT(ip)] = x_;      \
+  } while (0)
+
+// Same convention as __builtin_*_overflow: nonzero if result can't be
+// represented by an integer.
+static inline int
+imm_div_inexact(intptr_t x, intptr_t y, intptr_t *z)
+{
+  if (y == 0 || (y == -1 && x == INTPTR_MIN) || x % y != 0)
+    return 1;
+  *z = x / y;
+  return 0;
+}
+
+/*
+ * Generator bodies run with their own registers (regs) and report the YIELD
+ * they were suspended at through yield_ip; plain calls pass NULL for both.
+ */
+static opi_t
+vm(OpiBytecode *bc, opi_t *regs, OpiFlatInsn *start, OpiFlatInsn **yield_ip)
+{
+#ifdef OPI_THREADED_DISPATCH
+  static const void *const labels[OPI_OPC_COUNT] = {
+    LABEL(OPI_OPC_NOP), LABEL(OPI_OPC_END), LABEL(OPI_OPC_CONST),
+    LABEL(OPI_OPC_APPLY), LABEL(OPI_OPC_APPLYTC), LABEL(OPI_OPC_APPLYI),
+    LABEL(OPI_OPC_RET), LABEL(OPI_OPC_YIELD), LABEL(OPI_OPC_PUSH), LABEL(OPI_OPC_POP),
+    LABEL(OPI_OPC_INCRC), LABEL(OPI_OPC_DECRC), LABEL(OPI_OPC_DROP),
+    LABEL(OPI_OPC_UNREF), LABEL(OPI_OPC_LDCAP), LABEL(OPI_OPC_PARAM),
+    LABEL(OPI_OPC_ALCFN), LABEL(OPI_OPC_FINFN), LABEL(OPI_OPC_IF),
+    LABEL(OPI_OPC_JMP), LABEL(OPI_OPC_PHI), LABEL(OPI_OPC_DUP),
+    LABEL(OPI_OPC_BEGSCP), LABEL(OPI_OPC_ENDSCP), LABEL(OPI_OPC_TEST),
+    LABEL(OPI_OPC_GUARD), LABEL(OPI_OPC_TESTTY), LABEL(OPI_OPC_LDFLD),
+    LABEL(OPI_OPC_CONS), LABEL(OPI_OPC_ADD), LABEL(OPI_OPC_SUB),
+    LABEL(OPI_OPC_MUL), LABEL(OPI_OPC_DIV), LABEL(OPI_OPC_FMOD),
+    LABEL(OPI_OPC_NUMEQ), LABEL(OPI_OPC_NUMNE), LABEL(OPI_OPC_LT),
+    LABEL(OPI_OPC_GT), LABEL(OPI_OPC_LE), LABEL(OPI_OPC_GE),
+    LABEL(OPI_OPC_VAR), LABEL(OPI_OPC_SET), LABEL(OPI_OPC_SETVAR),
+    LABEL(OPI_OPC_DEREF), LABEL(OPI_OPC_CONSTPUSH), LABEL(OPI_OPC_PARAMRC),
+    LABEL(OPI_OPC_APPLYRC), LABEL(OPI_OPC_DECPUSH), LABEL(OPI_OPC_TESTTYIF),
+    LABEL(OPI_OPC_ADD_NN), LABEL(OPI_OPC_SUB_NN), LABEL(OPI_OPC_MUL_NN),
+    LABEL(OPI_OPC_DIV_NN), LABEL(OPI_OPC_FMOD_NN), LABEL(OPI_OPC_NUMEQ_NN),
+    LABEL(OPI_OPC_NUMNE_NN), LABEL(OPI_OPC_LT_NN), LABEL(OPI_OPC_GT_NN),
+    LABEL(OPI_OPC_LE_NN), LABEL(OPI_OPC_GE_NN),
+  };
+  if (opi_unlikely(bc == NULL)) {
+    // export labels for opi_vm_label()
+    g_labels = labels;
+    return NULL;
+  }
+#endif
+
+  OpiRecScp *scp = NULL;
   size_t scpcnt = 0;
 
-  opi_t r_stack[bc->nvals];
-  size_t r_cap = bc->nvals;
+  // frames and registers below belong to outer activations
+  VmFrame *fp0 = g_fp;
+  opi_t *r0 = g_regs_top;
+  if (regs == NULL) {
+    if (opi_unlikely(r0 + bc->nvals > g_regs_end))
+      return opi_stack_overflow(opi_nargs);
+    regs = r0;
+    g_regs_top = r0 + bc->nvals;
+  }
 
-  register opi_t *restrict r = r_stack;
-  register OpiFlatInsn *restrict ip = bc->tape;
+  register opi_t *restrict r = regs;
+  register OpiFlatInsn *restrict ip = start ? start : bc->tape;
+
+  opi_t ret;
+#ifdef OPI_FRAME_STACK
+  opi_t callee;
+  size_t callee_nargs;
+#endif
+
+#ifdef OPI_THREADED_DISPATCH
+  DISPATCH();
+#endif
 
   while (1) {
     switch (ip->opc) {
-      case OPI_OPC_NOP:
-      case OPI_OPC_VAR:
-        break;
+      CASE(OPI_OPC_NOP):
+      CASE(OPI_OPC_VAR):
+        NEXT();
 
-      case OPI_OPC_SET:
+      CASE(OPI_OPC_SET):
         r[OPI_SET_REG(ip)] = (void*)OPI_SET_ARG_VAL(ip);
-        break;
-
-#define NUM_BINOP(opc, op, trait)                                                          \
-      case opc:                                                                            \
-      {                                                                                    \
-        opi_t lhs = r[OPI_BINOP_REG_LHS(ip)];                                              \
-        opi_t rhs = r[OPI_BINOP_REG_RHS(ip)];                                              \
-        if (opi_likely(lhs->type == opi_num_type && rhs->type == opi_num_type)) {          \
-          long double x = opi_num_get_value(lhs);                                          \
-          long double y = opi_num_get_value(rhs);                                          \
-          r[OPI_BINOP_REG_OUT(ip)] = opi_num_new(x op y);                                  \
-        } else {                                                                           \
-          opi_t gen = opi_trait_get_impl(opi_trait_##trait, lhs->type, 0);                 \
-          if (gen) {                                                                       \
-            opi_push(rhs);                                                                 \
-            opi_push(lhs);                                                                 \
-            r[OPI_BINOP_REG_OUT(ip)] = opi_apply(gen, 2);                                  \
-          } else if ((gen = opi_trait_get_impl(opi_trait_##trait, rhs->type, 1))) {        \
-            opi_push(lhs);                                                                 \
-            opi_push(rhs);                                                                 \
-            r[OPI_BINOP_REG_OUT(ip)] = opi_apply(gen, 2);                                  \
-          } else {                                                                         \
-            r[OPI_BINOP_REG_OUT(ip)] = opi_undefined(opi_symbol("method-dispatch-error")); \
-          }                                                                                \
-        }                                                                                  \
-        break;                                                                             \
+        NEXT();
+
+#define NUM_BINOP(opc, name, trait, imm_op)                                                             \
+      CASE(opc):                                                                                        \
+      {                                                                                                 \
+        opi_t lhs = r[OPI_BINOP_REG_LHS(ip)];                                                           \
+        opi_t rhs = r[OPI_BINOP_REG_RHS(ip)];                                                           \
+        intptr_t z;                                                                                     \
+        if (opi_likely(opi_is_imm(lhs) & opi_is_imm(rhs)) &&                                            \
+            !imm_op(opi_imm_get_value(lhs), opi_imm_get_value(rhs), &z) &&                              \
+            opi_likely(z >= OPI_IMM_MIN && z <= OPI_IMM_MAX)) {                                         \
+          r[OPI_BINOP_REG_OUT(ip)] = opi_imm_new(z);                                                    \
+        } else if (opi_likely(opi_is_num(lhs) && opi_is_num(rhs))) {                                    \
+          r[OPI_BINOP_REG_OUT(ip)] = opi_num_##name(lhs, rhs);                                          \
+        } else {                                                                                        \
+          OpiTraitCache *ic = opi_bytecode_get_trait_cache(bc, ip);                                     \
+          opi_t gen = opi_trait_cache_get_impl(&ic[0], opi_trait_##trait, opi_typeof(lhs), 0);          \
+          if (gen) {                                                                                    \
+            opi_push(rhs);                                                                              \
+            opi_push(lhs);                                                                              \
+            r[OPI_BINOP_REG_OUT(ip)] = opi_apply(gen, 2);                                               \
+          } else if ((gen = opi_trait_cache_get_impl(&ic[1], opi_trait_##trait, opi_typeof(rhs), 1))) { \
+            opi_push(lhs);                                                                              \
+            opi_push(rhs);                                                                              \
+            r[OPI_BINOP_REG_OUT(ip)] = opi_apply(gen, 2);                                               \
+          } else {                                                                                      \
+            r[OPI_BINOP_REG_OUT(ip)] = opi_undefined(opi_symbol("method-dispatch-error"));              \
+          }                                                                                             \
+        }                                                                                               \
+        NEXT();                                                                                         \
       }
-      NUM_BINOP(OPI_OPC_ADD, +, add)
-      NUM_BINOP(OPI_OPC_SUB, -, sub)
-      NUM_BINOP(OPI_OPC_MUL, *, mul)
-      NUM_BINOP(OPI_OPC_DIV, /, div)
-      case OPI_OPC_FMOD:
+      NUM_BINOP(OPI_OPC_ADD, add, add, __builtin_add_overflow)
+      NUM_BINOP(OPI_OPC_SUB, sub, sub, __builtin_sub_overflow)
+      NUM_BINOP(OPI_OPC_MUL, mul, mul, __builtin_mul_overflow)
+      NUM_BINOP(OPI_OPC_DIV, div, div, imm_div_inexact)
+      CASE(OPI_OPC_FMOD):
       {
         opi_t lhs = r[OPI_BINOP_REG_LHS(ip)];
         opi_t rhs = r[OPI_BINOP_REG_RHS(ip)];
-        if (opi_unlikely(lhs->type != opi_num_type || rhs->type != opi_num_type))
+        if (opi_unlikely(!opi_is_num(lhs) || !opi_is_num(rhs)))
           r[OPI_BINOP_REG_OUT(ip)] = opi_undefined(opi_symbol("type-error"));
         else
-          r[OPI_BINOP_REG_OUT(ip)] = opi_num_new(fmodl(OPI_NUM(lhs)->val, OPI_NUM(rhs)->val));
-        break;
+          r[OPI_BINOP_REG_OUT(ip)] = opi_num_mod(lhs, rhs);
+        NEXT();
       }
 
+// Tagging preserves order, so immediates are compared as raw words.
 #define NUM_CMPOP(opc, op)                                                                                    \
-      case opc:                                                                                               \
+      CASE(opc):                                                                                              \
       {                                                                                                       \
         opi_t lhs = r[OPI_BINOP_REG_LHS(ip)];                                                                 \
         opi_t rhs = r[OPI_BINOP_REG_RHS(ip)];                                                                 \
-        if (opi_unlikely(lhs->type != opi_num_type || rhs->type != opi_num_type))                             \
+        int ret;                                                                                              \
+        if (opi_likely(opi_is_imm(lhs) & opi_is_imm(rhs)))                                                    \
+          ret = (intptr_t)lhs op (intptr_t)rhs;                                                               \
+        else if (opi_unlikely(!opi_is_num(lhs) || !opi_is_num(rhs)))                                          \
+          ret = -1;                                                                                           \
+        else if (opi_is_int(lhs) & opi_is_int(rhs))                                                           \
+          ret = opi_int_get_value(lhs) op opi_int_get_value(rhs);                                             \
+        else                                                                                                  \
+          ret = opi_num_get_value(lhs) op opi_num_get_value(rhs);                                             \
+        if (opi_unlikely(ret < 0))                                                                            \
           r[OPI_BINOP_REG_OUT(ip)] = opi_undefined(opi_symbol("type-error"));                                 \
         else                                                                                                  \
-          r[OPI_BINOP_REG_OUT(ip)] = opi_num_get_value(lhs) op opi_num_get_value(rhs) ? opi_true : opi_false; \
-        break;                                                                                                \
+          r[OPI_BINOP_REG_OUT(ip)] = ret ? opi_true : opi_false;                                              \
+        NEXT();                                                                                               \
       }
       NUM_CMPOP(OPI_OPC_NUMEQ, ==)
       NUM_CMPOP(OPI_OPC_NUMNE, !=)
@@ -85,129 +236,204 @@ opi_vm(OpiBytecode *bc)
       NUM_CMPOP(OPI_OPC_LE, <=)
       NUM_CMPOP(OPI_OPC_GE, >=)
 
-      case OPI_OPC_CONS:
+      // Operands are known to be numbers.
+#define NUM_BINOP_NN(opc, name, imm_op)                                     \
+      CASE(opc):                                                            \
+      {                                                                     \
+        opi_t lhs = r[OPI_BINOP_REG_LHS(ip)];                               \
+        opi_t rhs = r[OPI_BINOP_REG_RHS(ip)];                               \
+        intptr_t z;                                                         \
+        if (opi_likely(opi_is_imm(lhs) & opi_is_imm(rhs)) &&                \
+            !imm_op(opi_imm_get_value(lhs), opi_imm_get_value(rhs), &z) &&  \
+            opi_likely(z >= OPI_IMM_MIN && z <= OPI_IMM_MAX))               \
+          r[OPI_BINOP_REG_OUT(ip)] = opi_imm_new(z);                        \
+        else                                                                \
+          r[OPI_BINOP_REG_OUT(ip)] = opi_num_##name(lhs, rhs);              \
+        NEXT();                                                             \
+      }
+      NUM_BINOP_NN(OPI_OPC_ADD_NN, add, __builtin_add_overflow)
+      NUM_BINOP_NN(OPI_OPC_SUB_NN, sub, __builtin_sub_overflow)
+      NUM_BINOP_NN(OPI_OPC_MUL_NN, mul, __builtin_mul_overflow)
+      NUM_BINOP_NN(OPI_OPC_DIV_NN, div, imm_div_inexact)
+      CASE(OPI_OPC_FMOD_NN):
+        r[OPI_BINOP_REG_OUT(ip)] =
+          opi_num_mod(r[OPI_BINOP_REG_LHS(ip)], r[OPI_BINOP_REG_RHS(ip)]);
+        NEXT();
+
+#define NUM_CMPOP_NN(opc, op)                                                \
+      CASE(opc):                                                             \
+      {                                                                      \
+        opi_t lhs = r[OPI_BINOP_REG_LHS(ip)];                                \
+        opi_t rhs = r[OPI_BINOP_REG_RHS(ip)];                                \
+        int ret;                                                             \
+        if (opi_likely(opi_is_imm(lhs) & opi_is_imm(rhs)))                   \
+          ret = (intptr_t)lhs op (intptr_t)rhs;                              \
+        else if (opi_is_int(lhs) & opi_is_int(rhs))                          \
+          ret = opi_int_get_value(lhs) op opi_int_get_value(rhs);            \
+        else                                                                 \
+          ret = opi_num_get_value(lhs) op opi_num_get_value(rhs);            \
+        r[OPI_BINOP_REG_OUT(ip)] = ret ? opi_true : opi_false;               \
+        NEXT();                                                              \
+      }
+      NUM_CMPOP_NN(OPI_OPC_NUMEQ_NN, ==)
+      NUM_CMPOP_NN(OPI_OPC_NUMNE_NN, !=)
+      NUM_CMPOP_NN(OPI_OPC_LT_NN, <)
+      NUM_CMPOP_NN(OPI_OPC_GT_NN, >)
+      NUM_CMPOP_NN(OPI_OPC_LE_NN, <=)
+      NUM_CMPOP_NN(OPI_OPC_GE_NN, >=)
+
+      CASE(OPI_OPC_CONS):
       {
         opi_t lhs = r[OPI_BINOP_REG_LHS(ip)];
         opi_t rhs = r[OPI_BINOP_REG_RHS(ip)];
         r[OPI_BINOP_REG_OUT(ip)] = opi_cons(lhs, rhs);
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_SETVAR:
+      CASE(OPI_OPC_SETVAR):
       {
         opi_var_set(r[OPI_SETVAR_REG_REF(ip)], r[OPI_SETVAR_REG_VAL(ip)]);;
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_DEREF:
+      CASE(OPI_OPC_DEREF):
       {
         r[OPI_DEREF_REG_OUT(ip)] = OPI_VAR(r[OPI_DEREF_REG_VAR(ip)])->val;
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_PHI:
+      CASE(OPI_OPC_PHI):
         r[OPI_PHI_REG(ip)] = opi_nil;
-        break;
+        NEXT();
 
-      case OPI_OPC_TEST:
+      CASE(OPI_OPC_TEST):
       {
         uintptr_t test = (uintptr_t)(r[OPI_TEST_REG_IN(ip)] != opi_false);
         r[OPI_TEST_REG_OUT(ip)] = (void*)test;
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_GUARD:
+      CASE(OPI_OPC_GUARD):
         opi_assert(r[OPI_GUARD_REG(ip)]);
-        break;
+        NEXT();
 
-      case OPI_OPC_CONST:
+      CASE(OPI_OPC_CONST):
         r[OPI_CONST_REG_OUT(ip)] = OPI_CONST_ARG_CELL(ip);
-        break;
+        NEXT();
 
-      case OPI_OPC_APPLY:
+      CASE(OPI_OPC_APPLY):
       {
         opi_t fn = r[OPI_APPLY_REG_FN(ip)];
         size_t nargs = OPI_APPLY_ARG_NARGS(ip);
-        if (opi_unlikely(fn->type != opi_fn_type)) {
+        if (opi_unlikely(opi_typeof(fn) != opi_fn_type)) {
           while (nargs--)
             opi_drop(opi_pop());
           r[OPI_APPLY_REG_OUT(ip)] = opi_undefined(opi_symbol("type-error"));
-          break;
+          NEXT();
+        }
+#ifdef OPI_FRAME_STACK
+        if (opi_is_lambda(fn) & opi_test_arity(opi_fn_get_arity(fn), nargs)) {
+          callee = fn;
+          callee_nargs = nargs;
+          goto call_lambda;
         }
+#endif
         r[OPI_APPLY_REG_OUT(ip)] = opi_apply(fn, nargs);
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_APPLYI:
+      CASE(OPI_OPC_APPLYI):
       {
         opi_t fn = r[OPI_APPLY_REG_FN(ip)];
         size_t nargs = OPI_APPLY_ARG_NARGS(ip);
+#ifdef OPI_FRAME_STACK
+        if (opi_is_lambda(fn)) {
+          callee = fn;
+          callee_nargs = nargs;
+          goto call_lambda;
+        }
+#endif
         r[OPI_APPLY_REG_OUT(ip)] = opi_fn_apply(fn, nargs);
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_APPLYTC:
+      CASE(OPI_OPC_APPLYTC):
       {
         opi_t fn = r[OPI_APPLY_REG_FN(ip)];
         size_t nargs = OPI_APPLY_ARG_NARGS(ip);
-        if (opi_unlikely(fn->type != opi_fn_type)) {
+        if (opi_unlikely(opi_typeof(fn) != opi_fn_type)) {
           while (nargs--)
             opi_drop(opi_pop());
           r[OPI_APPLY_REG_OUT(ip)] = opi_undefined(opi_symbol("type-error"));
-          break;
+          NEXT();
         }
         if (opi_is_lambda(fn) & opi_test_arity(opi_fn_get_arity(fn), nargs)) {
           // Tail Call
           OpiLambda *lam = OPI_FN(fn)->data;
           opi_current_fn = OPI_FN(fn);
+#ifdef OPI_USE_LIBJIT
+          if (opi_jit_ready(lam->bc)) {
+            // continue in native code
+            if (g_fp == fp0) {
+              g_regs_top = r0;
+              return opi_lambda_fn();
+            }
+            ret = opi_lambda_fn();
+            goto do_return;
+          }
+#endif
+          opi_drain_frees_safepoint();
+          if (opi_unlikely(r + lam->bc->nvals > g_regs_end)) {
+            ret = opi_stack_overflow(nargs);
+            goto do_return;
+          }
           bc = lam->bc;
           ip = bc->tape;
-          if (bc->nvals > r_cap) {
-            if (r == r_stack)
-              r = malloc(sizeof(opi_t) * bc->nvals);
-            else
-              r = realloc(r, sizeof(opi_t) * (r_cap = bc->nvals));
-          }
-          continue;
+          g_regs_top = r + bc->nvals;
+          DISPATCH();
         } else {
           // Fall back to default APPLY
           r[OPI_APPLY_REG_OUT(ip)] = opi_apply(fn, nargs);
         }
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_RET:
-      {
-        opi_t ret = r[OPI_RET_REG_VAL(ip)];
-        if (r != r_stack)
-          free(r);
-        return ret;
-      }
+      CASE(OPI_OPC_RET):
+        ret = r[OPI_RET_REG_VAL(ip)];
+        opi_drain_frees_safepoint();
+        goto do_return;
+
+      CASE(OPI_OPC_YIELD):
+        // only generator bodies yield, and they are never pushed as frames
+        opi_assert(g_fp == fp0 && yield_ip);
+        *yield_ip = ip;
+        g_regs_top = r0;
+        return r[OPI_YIELD_REG_VAL(ip)];
 
-      case OPI_OPC_PUSH:
+      CASE(OPI_OPC_PUSH):
         opi_push(r[OPI_PUSH_REG_VAL(ip)]);
-        break;
+        NEXT();
 
-      case OPI_OPC_POP:
+      CASE(OPI_OPC_POP):
         opi_sp -= OPI_POP_ARG_N(ip);
-        break;
+        NEXT();
 
-      case OPI_OPC_LDCAP:
+      CASE(OPI_OPC_LDCAP):
       {
         OpiLambda *data = opi_current_fn->data;
-        r[OPI_LDCAP_REG_OUT(ip)] = data->caps[OPI_LDCAP_ARG_IDX(ip)];
-        break;
+        r[OPI_LDCAP_REG_OUT(ip)] = opi_lambda_ldcap(data, OPI_LDCAP_ARG_IDX(ip));
+        NEXT();
       }
 
-      case OPI_OPC_PARAM:
+      CASE(OPI_OPC_PARAM):
         r[OPI_PARAM_REG_OUT(ip)] = opi_get(OPI_PARAM_ARG_OFFS(ip));
-        break;
+        NEXT();
 
-      case OPI_OPC_ALCFN:
+      CASE(OPI_OPC_ALCFN):
         r[OPI_ALCFN_REG_OUT(ip)] = opi_fn_alloc();
-        break;
+        NEXT();
 
-      case OPI_OPC_FINFN:
+      CASE(OPI_OPC_FINFN):
       {
         OpiFnInsnData *data = OPI_FINFN_ARG_DATA(ip);
         size_t ncaps = data->ncaps;
@@ -220,78 +446,190 @@ opi_vm(OpiBytecode *bc)
           opi_inc_rc(lam->caps[i] = r[data->caps[i]]);
 
         opi_t fn = r[OPI_FINFN_REG_CELL(ip)];
-        opi_fn_finalize(fn, opi_lambda_fn, data->arity);
+        opi_fn_finalize(fn, opi_lambda_handle(data->bc), data->arity);
         opi_fn_set_data(fn, lam, opi_lambda_delete);
 
-        if ((lam->scp = scp))
-          opi_rec_scope_set(scp, scpcnt++, (void*)fn, (void*)opi_lam_destroy, (void*)opi_lam_free);
+        if (scp) {
+          lam->scpidx = scpcnt;
+          opi_rec_scp_set(scp, scpcnt++, fn, (void*)opi_lam_destroy, (void*)opi_lam_free);
+        }
 
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_INCRC:
+      CASE(OPI_OPC_INCRC):
         opi_inc_rc(r[OPI_INCRC_REG_CELL(ip)]);
-        break;
+        NEXT();
 
-      case OPI_OPC_DECRC:
+      CASE(OPI_OPC_DECRC):
         opi_dec_rc(r[OPI_DECRC_REG_CELL(ip)]);
-        break;
+        NEXT();
 
-      case OPI_OPC_DROP:
+      CASE(OPI_OPC_DROP):
         opi_drop(r[OPI_DROP_REG_CELL(ip)]);
-        break;
+        NEXT();
 
-      case OPI_OPC_UNREF:
+      CASE(OPI_OPC_UNREF):
         opi_unref(r[OPI_UNREF_REG_CELL(ip)]);
-        break;
+        NEXT();
 
-      case OPI_OPC_IF:
+      CASE(OPI_OPC_IF):
       {
         if (!r[OPI_IF_REG_TEST(ip)]) {
           ip = OPI_IF_ARG_ELSE(ip);
-          continue;
+          DISPATCH();
         }
-        break;
+        NEXT();
       }
 
-      case OPI_OPC_JMP:
+      CASE(OPI_OPC_JMP):
         ip = OPI_JMP_ARG_TO(ip);
-        continue;
+        DISPATCH();
 
-      case OPI_OPC_DUP:
+      CASE(OPI_OPC_DUP):
         r[OPI_DUP_REG_OUT(ip)] = r[OPI_DUP_REG_IN(ip)];
-        break;
+        NEXT();
 
-      case OPI_OPC_BEGSCP:
-        scp = opi_rec_scope(OPI_BEGSCP_ARG_N(ip));
+      CASE(OPI_OPC_BEGSCP):
+        scp = opi_rec_scp_alloc(OPI_BEGSCP_ARG_N(ip));
         scpcnt = 0;
-        break;
+        NEXT();
 
-      case OPI_OPC_ENDSCP:
-        opi_assert(scpcnt == scp->nrefs);
-        opi_rec_scope_finalize(scp);
+      CASE(OPI_OPC_ENDSCP):
+        opi_assert(scpcnt == scp->n);
+        opi_rec_scp_finalize(scp);
         scp = NULL;
-        break;
+        NEXT();
 
-      case OPI_OPC_TESTTY:
+      CASE(OPI_OPC_TESTTY):
         r[OPI_TESTTY_REG_OUT(ip)] =
-          (void*)(uintptr_t)(r[OPI_TESTTY_REG_CELL(ip)]->type == OPI_TESTTY_ARG_TYPE(ip));
-        break;
+          (void*)(uintptr_t)(opi_typeof(r[OPI_TESTTY_REG_CELL(ip)]) == OPI_TESTTY_ARG_TYPE(ip));
+        NEXT();
 
-      case OPI_OPC_LDFLD:
+      CASE(OPI_OPC_LDFLD):
       {
         char *ptr = (char*)r[OPI_LDFLD_REG_CELL(ip)];
         size_t offs = OPI_LDFLD_ARG_OFFS(ip);
         r[OPI_LDFLD_REG_OUT(ip)] = *(opi_t*)(ptr + offs);
-        break;
+        NEXT();
+      }
+
+      /* Superinstructions. */
+      CASE(OPI_OPC_CONSTPUSH):
+        opi_push(r[OPI_CONST_REG_OUT(ip)] = OPI_CONST_ARG_CELL(ip));
+        NEXT();
+
+      CASE(OPI_OPC_PARAMRC):
+        opi_inc_rc(r[OPI_PARAM_REG_OUT(ip)] = opi_get(OPI_PARAM_ARG_OFFS(ip)));
+        NEXT();
+
+      CASE(OPI_OPC_APPLYRC):
+      {
+        opi_t fn = r[OPI_APPLY_REG_FN(ip)];
+        size_t nargs = OPI_APPLY_ARG_NARGS(ip);
+        if (opi_unlikely(opi_typeof(fn) != opi_fn_type)) {
+          while (nargs--)
+            opi_drop(opi_pop());
+          ret = opi_undefined(opi_symbol("type-error"));
+        } else {
+#ifdef OPI_FRAME_STACK
+          if (opi_is_lambda(fn) & opi_test_arity(opi_fn_get_arity(fn), nargs)) {
+            callee = fn;
+            callee_nargs = nargs;
+            goto call_lambda;
+          }
+#endif
+          ret = opi_apply(fn, nargs);
+        }
+        opi_inc_rc(r[OPI_APPLY_REG_OUT(ip)] = ret);
+        NEXT();
+      }
+
+      CASE(OPI_OPC_DECPUSH):
+      {
+        opi_t x = r[OPI_PUSH_REG_VAL(ip)];
+        opi_dec_rc(x);
+        opi_push(x);
+        NEXT();
       }
 
-      case OPI_OPC_END:
+      CASE(OPI_OPC_TESTTYIF):
+        if (opi_typeof(r[OPI_TESTTYIF_REG_CELL(ip)]) != OPI_TESTTYIF_ARG_TYPE(ip)) {
+          ip = OPI_TESTTYIF_ARG_ELSE(ip);
+          DISPATCH();
+        }
+        NEXT();
+
+      CASE(OPI_OPC_END):
         opi_assert(!"unexpected end");
         abort();
     }
 
     ip += 1;
+    continue;
+
+#ifdef OPI_FRAME_STACK
+call_lambda:
+    {
+      OpiLambda *lam = OPI_FN(callee)->data;
+#ifdef OPI_USE_LIBJIT
+      if (opi_jit_ready(lam->bc)) {
+        SET_CALL_RESULT(opi_fn_apply(callee, callee_nargs));
+        ip += 1;
+        DISPATCH();
+      }
+#endif
+      if (opi_unlikely(g_fp == g_frames_end || opi_sp > opi_stack_limit ||
+                       g_regs_top + lam->bc->nvals > g_regs_end)) {
+        SET_CALL_RESULT(opi_stack_overflow(callee_nargs));
+        ip += 1;
+        DISPATCH();
+      }
+
+      *g_fp++ = (VmFrame) {
+        .bc = bc, .ip = ip, .r = r,
+        .fn = opi_current_fn, .scp = scp, .scpcnt = scpcnt,
+      };
+      opi_nargs = callee_nargs;
+      opi_current_fn = OPI_FN(callee);
+      scp = NULL;
+      scpcnt = 0;
+      bc = lam->bc;
+      ip = bc->tape;
+      r = g_regs_top;
+      g_regs_top = r + bc->nvals;
+      DISPATCH();
+    }
+#endif
+
+do_return:
+#ifdef OPI_FRAME_STACK
+    if (g_fp != fp0) {
+      VmFrame *f = --g_fp;
+      g_regs_top = r;
+      bc = f->bc;
+      ip = f->ip;
+      r = f->r;
+      opi_current_fn = f->fn;
+      scp = f->scp;
+      scpcnt = f->scpcnt;
+      SET_CALL_RESULT(ret);
+      ip += 1;
+      DISPATCH();
+    }
+#endif
+    if (yield_ip)
+      *yield_ip = NULL;
+    g_regs_top = r0;
+    return ret;
   }
 }
 
+opi_t
+opi_vm(OpiBytecode *bc)
+{ return vm(bc, NULL, NULL, NULL); }
+
+opi_t
+opi_vm_resume(OpiBytecode *bc, opi_t *regs, OpiFlatInsn **ip)
+{ return vm(bc, regs, *ip ? *ip + 1 : NULL, ip); }
+
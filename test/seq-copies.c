@@ -0,0 +1,112 @@
+/*
+ * Drain one copy of a sequence in the middle of consuming a batch of another
+ * copy (as `foldl` does when its function forces the same sequence): trimming
+ * of the shared cache must not release the elements of that batch.
+ */
+#include "opium/opium.h"
+
+#define NELTS 0x4000
+
+typedef struct {
+  OpiHeader header;
+  size_t id;
+} Elt;
+
+static opi_type_t elt_type;
+static char g_deleted[NELTS];
+
+static void
+elt_delete(opi_type_t ty, opi_t x)
+{
+  Elt *elt = (void*)x;
+  opi_assert(!g_deleted[elt->id]);
+  g_deleted[elt->id] = TRUE;
+  opi_free(elt, sizeof(Elt));
+}
+
+typedef struct {
+  size_t i;
+} Iter;
+
+static opi_t
+iter_next(OpiIter *iter)
+{
+  Iter *self = (void*)iter;
+  if (self->i == NELTS)
+    return NULL;
+  Elt *elt = opi_alloc(sizeof(Elt));
+  elt->id = self->i++;
+  opi_init_cell(elt, elt_type);
+  return OPI(elt);
+}
+
+static size_t
+iter_next_batch(OpiIter *iter, opi_t *out, size_t n)
+{
+  size_t k = 0;
+  for (opi_t x; k < n && (x = iter_next(iter)); )
+    out[k++] = x;
+  return k;
+}
+
+static OpiIter*
+iter_copy(OpiIter *iter)
+{
+  Iter *copy = opi_alloc(sizeof(Iter));
+  *copy = *(Iter*)iter;
+  return (OpiIter*)copy;
+}
+
+static void
+iter_delete(OpiIter *iter)
+{ opi_free(iter, sizeof(Iter)); }
+
+int
+main(void)
+{
+  opi_init(OPI_INIT_DEFAULT);
+  elt_type = opi_type_new("Elt");
+  opi_type_set_delete_cell(elt_type, elt_delete);
+
+  Iter *iter = opi_alloc(sizeof(Iter));
+  iter->i = 0;
+  opi_t s = opi_seq_new((OpiIter*)iter, (OpiSeqCfg) {
+    .next = iter_next,
+    .copy = iter_copy,
+    .dtor = iter_delete,
+    .next_batch = iter_next_batch,
+  });
+  opi_inc_rc(s);
+  opi_t a = opi_seq_copy(s);
+  opi_t b = opi_seq_copy(s);
+  opi_inc_rc(a);
+  opi_inc_rc(b);
+  opi_unref(s);
+
+  opi_t buf[OPI_SEQ_BATCH];
+  size_t n, cnt = 0;
+  while ((n = opi_seq_next_batch(a, buf, OPI_SEQ_BATCH))) {
+    // drain the other copy before looking at the batch
+    for (opi_t x; (x = opi_seq_next(b)); )
+      opi_drop(x);
+    for (size_t i = 0; i < n; ++i) {
+      opi_assert(opi_typeof(buf[i]) == elt_type);
+      opi_assert(((Elt*)buf[i])->id == cnt + i);
+      opi_assert(!g_deleted[cnt + i]);
+      opi_drop(buf[i]);
+    }
+    cnt += n;
+  }
+  opi_assert(cnt == NELTS);
+
+  // everything is released with the last copy
+  opi_unref(a);
+  opi_unref(b);
+  opi_drain_frees(SIZE_MAX);
+  for (size_t i = 0; i < NELTS; ++i)
+    opi_assert(g_deleted[i]);
+
+  opi_type_delete(elt_type);
+  opi_cleanup();
+  return EXIT_SUCCESS;
+}